@@ -5,19 +5,116 @@
 #include <linux/slab.h>
 #include <linux/gfp.h>
 #include <linux/sched.h>
+#include <linux/percpu.h>
+#include <linux/bottom_half.h>
+#include <linux/irqflags.h>
+#include <linux/refcount.h>
+#include <linux/workqueue.h>
+#include <linux/rbtree_augmented.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/preempt.h>
 #include "aux_structs.h"
 
-static struct rb_data *rb_data_lookup(struct rb_root *root, uint32_t offset)
+#define CREATE_TRACE_POINTS
+#include "lock_tree_trace.h"
+
+/*
+ * Tree values. A value is freed when its last reference
+ * is dropped, and lockless readers of the RCU tree may
+ * still be looking at an erased value, so values dropped
+ * from it are freed after a grace period.
+ */
+struct lt_value *lt_value_alloc(size_t len, gfp_t gfp)
+{
+	struct lt_value *value = kmalloc(sizeof(*value) + len, gfp);
+
+	if(!value)
+		return NULL;
+	refcount_set(&value->ref, 1);
+	value->len = len;
+	return value;
+}
+
+static void lt_value_free_rcu(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct lt_value, rcu));
+}
+
+/* Erased values an RCU tree snapshot may still reach wait for it */
+static void lt_value_release(struct lt_value *value, bool deferred)
+{
+	if(!refcount_dec_and_test(&value->ref))
+		return;
+	if(!deferred)
+		kfree(value);
+	else if(!cb_snapshot_defer(&value->rcu, lt_value_free_rcu))
+		kfree_rcu(value, rcu);
+}
+
+/* Only for values no reader can still see */
+void lt_value_put(struct lt_value *value)
+{
+	lt_value_release(value, false);
+}
+
+/*
+ * Keys. Integer keys are compared directly, other key
+ * types go through the tree's comparator, after the
+ * cached prefixes when prefix caching is on
+ */
+int lt_skey_cmp(u64 a, u64 b)
+{
+	const struct lt_skey *ka = (const struct lt_skey *)(uintptr_t)a;
+	const struct lt_skey *kb = (const struct lt_skey *)(uintptr_t)b;
+	int ret = memcmp(ka->bytes, kb->bytes, min(ka->len, kb->len));
+
+	if(ret)
+		return ret;
+	return ka->len < kb->len ? -1 : ka->len > kb->len;
+}
+
+/* First 8 bytes, big endian and zero padded, so they order like the keys */
+u64 lt_skey_prefix(u64 key)
+{
+	const struct lt_skey *k = (const struct lt_skey *)(uintptr_t)key;
+	u64 prefix = 0;
+	u32 i;
+
+	for(i=0;i<sizeof(prefix);i++)
+		prefix = (prefix << 8) | (i < k->len ? k->bytes[i] : 0);
+	return prefix;
+}
+
+static inline u64 lt_key_prefix(struct lock_tree *lt, u64 key)
+{
+	return lt->key_prefix ? lt->key_prefix(key) : 0;
+}
+
+static inline int lt_key_cmp(struct lock_tree *lt, u64 key, u64 prefix,
+		struct rb_data *data)
+{
+	if(lt->key_prefix && prefix != data->prefix)
+		return prefix < data->prefix ? -1 : 1;
+	if(lt->key_cmp)
+		return lt->key_cmp(key, data->offset);
+	return key < data->offset ? -1 : key > data->offset;
+}
+
+static struct rb_data *rb_data_lookup(struct lock_tree *lt, u64 offset)
 {
 	struct rb_node *index;
+	u64 prefix = lt_key_prefix(lt, offset);
 
-	index = root->rb_node;
+	index = lt->tree.rb_tree.rb_node;
 
 	while(index){
 		struct rb_data *data = container_of(index, struct rb_data, node);
-		if(offset < data->offset)
+		int cmp = lt_key_cmp(lt, offset, prefix, data);
+
+		if(cmp < 0)
 			index = index->rb_left;
-		else if(offset > data->offset)
+		else if(cmp > 0)
 			index = index->rb_right;
 		else
 			return data;
@@ -29,18 +126,141 @@ static struct rb_data *rb_data_lookup(struct rb_root *root, uint32_t offset)
  * Auxiliary red black tree search and insert
  * functions, based on rb_data offset field
  */
-static char *rb_data_search(struct rb_root *root, uint32_t offset)
+static char *rb_data_search(struct lock_tree *lt, u64 offset)
 {
-	struct rb_data *found_node = rb_data_lookup(root, offset);
+	struct rb_data *found_node = rb_data_lookup(lt, offset);
 	return found_node ? found_node->str : NULL;
 }
 
-static int rb_data_insert(struct rb_root *root, char *str, uint32_t offset)
+/* Value of the greatest key less than or equal to offset */
+static char *rb_data_search_le(struct lock_tree *lt, u64 offset)
+{
+	struct rb_node *index = lt->tree.rb_tree.rb_node;
+	struct rb_data *found = NULL;
+	u64 prefix = lt_key_prefix(lt, offset);
+
+	while(index){
+		struct rb_data *data = container_of(index, struct rb_data, node);
+		int cmp = lt_key_cmp(lt, offset, prefix, data);
+
+		if(cmp < 0){
+			index = index->rb_left;
+		}else{
+			found = data;
+			if(!cmp)
+				break;
+			index = index->rb_right;
+		}
+	}
+	return found ? found->str : NULL;
+}
+
+/*
+ * Order statistics for the RB tree, every node keeps
+ * the size of its subtree through the augmented rbtree
+ * callbacks. Only maintained when lt->order_stats is set,
+ * so the plain RB tree pays nothing for it.
+ */
+static inline unsigned long rb_data_size(struct rb_node *node)
+{
+	return node ? rb_entry(node, struct rb_data, node)->size : 0;
+}
+
+static inline unsigned long rb_data_compute_size(struct rb_data *data)
+{
+	return 1 + rb_data_size(data->node.rb_left) +
+		rb_data_size(data->node.rb_right);
+}
+
+static void rb_size_propagate(struct rb_node *rb, struct rb_node *stop)
+{
+	while(rb != stop){
+		struct rb_data *data = rb_entry(rb, struct rb_data, node);
+		unsigned long size = rb_data_compute_size(data);
+
+		if(data->size == size)
+			break;
+		data->size = size;
+		rb = rb_parent(rb);
+	}
+}
+
+static void rb_size_copy(struct rb_node *rb_old, struct rb_node *rb_new)
+{
+	rb_entry(rb_new, struct rb_data, node)->size =
+		rb_entry(rb_old, struct rb_data, node)->size;
+}
+
+static void rb_size_rotate(struct rb_node *rb_old, struct rb_node *rb_new)
+{
+	struct rb_data *old = rb_entry(rb_old, struct rb_data, node);
+
+	rb_entry(rb_new, struct rb_data, node)->size = old->size;
+	old->size = rb_data_compute_size(old);
+}
+
+static const struct rb_augment_callbacks rb_size_callbacks = {
+	.propagate = rb_size_propagate,
+	.copy = rb_size_copy,
+	.rotate = rb_size_rotate,
+};
+
+/* Number of keys below offset, or up to it when inclusive */
+static unsigned long rb_data_count_below(struct lock_tree *lt, u64 offset,
+		bool inclusive)
+{
+	struct rb_node *index = lt->tree.rb_tree.rb_node;
+	u64 prefix = lt_key_prefix(lt, offset);
+	unsigned long count = 0;
+
+	while(index){
+		struct rb_data *data = container_of(index, struct rb_data, node);
+		int cmp = lt_key_cmp(lt, offset, prefix, data);
+
+		if(cmp < 0){
+			index = index->rb_left;
+			continue;
+		}
+		count += rb_data_size(index->rb_left);
+		if(!cmp){
+			if(inclusive)
+				count++;
+			break;
+		}
+		count++;
+		index = index->rb_right;
+	}
+	return count;
+}
+
+static char *rb_data_select(struct lock_tree *lt, unsigned long k)
+{
+	struct rb_node *index = lt->tree.rb_tree.rb_node;
+
+	while(index){
+		unsigned long left = rb_data_size(index->rb_left);
+
+		if(k == left)
+			return rb_entry(index, struct rb_data, node)->str;
+		if(k < left){
+			index = index->rb_left;
+		}else{
+			k -= left + 1;
+			index = index->rb_right;
+		}
+	}
+	return NULL;
+}
+
+/* On success the tree owns the caller's reference to value */
+static int rb_data_insert(struct lock_tree *lt, struct lt_value *value,
+		u64 offset)
 {
+	struct rb_root *root = &(lt->tree.rb_tree);
 	struct rb_node **index, *parent = NULL;
 	struct rb_data *newnode; 
 
-	BUG_ON(str == NULL);
+	BUG_ON(value == NULL);
 
 	index = &root->rb_node;
 
@@ -55,60 +275,174 @@ static int rb_data_insert(struct rb_root *root, char *str, uint32_t offset)
 		return -1;
 	}
 
-	newnode->str = kmalloc((strlen(str) + 1) * sizeof(char), GFP_ATOMIC);
-	if(!newnode->str){
-		pr_err("Memory allocation failed for RB tree node string\n");
-		kfree(newnode);
-		return -1;
-	}
-
-	newnode->str = strcpy(newnode->str, str);
+	newnode->str = value->data;
 	newnode->offset = offset;
+	newnode->prefix = lt_key_prefix(lt, offset);
 
 	while(*index){
 		struct rb_data *data = container_of(*index, struct rb_data, node);
+		int cmp = lt_key_cmp(lt, offset, newnode->prefix, data);
 		parent = *index;
 
-		if(offset < data->offset)
+		if(cmp < 0)
 			index = &((*index)->rb_left);
-		else if(offset > data->offset)
+		else if(cmp > 0)
 			index = &((*index)->rb_right);
-		else
+		else{
 			/* Node already in rbtree */
+			kfree(newnode);
 			return -1;
+		}
 	}
 
 	/* Link new node and rebalance */
 	rb_link_node(&newnode->node, parent, index);
-	rb_insert_color(&newnode->node, root);
+	if(lt->order_stats){
+		/* The new leaf adds one to every subtree on its path */
+		newnode->size = 1;
+		for(;parent;parent = rb_parent(parent))
+			rb_entry(parent, struct rb_data, node)->size++;
+		rb_insert_augmented(&newnode->node, root, &rb_size_callbacks);
+	}else{
+		rb_insert_color(&newnode->node, root);
+	}
 	return 0;
 }
 
-static int rb_data_erase(struct rb_root *root, uint32_t offset)
+static void rb_data_remove(struct lock_tree *lt, struct rb_data *node_to_remove)
+{
+	//pr_info("Deleted string %s from RB tree\n", node_to_remove->str);
+	if(lt->order_stats)
+		rb_erase_augmented(&node_to_remove->node,
+				&(lt->tree.rb_tree), &rb_size_callbacks);
+	else
+		rb_erase(&node_to_remove->node, &(lt->tree.rb_tree));
+	/* Lookaside hits may still be reading it without the lock */
+	lt_value_release(lt_value_of(node_to_remove->str), lt->lookaside != NULL);
+	kfree(node_to_remove);
+}
+
+static int rb_data_erase(struct lock_tree *lt, u64 offset)
 {
-	struct rb_data *node_to_remove = rb_data_lookup(root, offset);
+	struct rb_data *node_to_remove = rb_data_lookup(lt, offset);
 
 	if(node_to_remove){
-		//pr_info("Deleted string %s from RB tree\n", node_to_remove->str);
-		rb_erase(&node_to_remove->node, root);
-		kfree(node_to_remove->str);
-		kfree(node_to_remove);
+		rb_data_remove(lt, node_to_remove);
 		return 0;
 	}
 	return -1;
 }
 
+/* Erases [lo, hi] one node at a time, from the first key >= lo */
+static unsigned long rb_data_erase_range(struct lock_tree *lt, u64 lo, u64 hi)
+{
+	struct rb_node *index = lt->tree.rb_tree.rb_node, *first = NULL, *next;
+	u64 prefix = lt_key_prefix(lt, lo), hi_prefix = lt_key_prefix(lt, hi);
+	unsigned long erased = 0;
+
+	while(index){
+		struct rb_data *data = container_of(index, struct rb_data, node);
+
+		if(lt_key_cmp(lt, lo, prefix, data) <= 0){
+			first = index;
+			index = index->rb_left;
+		}else{
+			index = index->rb_right;
+		}
+	}
+
+	for(index = first;index;index = next){
+		struct rb_data *data = container_of(index, struct rb_data, node);
+
+		if(lt_key_cmp(lt, hi, hi_prefix, data) < 0)
+			break;
+		next = rb_next(index);
+		rb_data_remove(lt, data);
+		erased++;
+	}
+	return erased;
+}
+
+/* Frees between scheduling points during teardown */
+enum { TEARDOWN_BATCH = 1024 };
+
+static void rb_data_free(struct rb_data *del)
+{
+	lt_value_release(lt_value_of(del->str), false);
+	kfree(del);
+}
+
 static void rb_data_destroy(struct rb_root *root)
 {
 	struct rb_data *del, *temp;
+	unsigned long freed = 0;
 	/*
 	 * Use kernel provided postorder
 	 * traversal macro to destroy red black
 	 * tree
 	 */
 	rbtree_postorder_for_each_entry_safe(del, temp, root, node){
-		kfree(del->str);
-		kfree(del);
+		rb_data_free(del);
+		if(!(++freed % TEARDOWN_BATCH))
+			cond_resched();
+	}
+	*root = RB_ROOT;
+}
+
+/*
+ * Split the tree in up to max subtrees for parallel
+ * teardown, freeing the nodes above them breadth first
+ */
+static int rb_data_detach(struct rb_root *root, void **subtrees, int max)
+{
+	struct rb_node *node = root->rb_node;
+	int head = 0, tail = 0;
+
+	*root = RB_ROOT;
+	if(node)
+		subtrees[tail++] = node;
+	/* Splitting a node nets at most one more subtree */
+	while(head < tail && tail - head < max){
+		node = subtrees[head++];
+		if(tail + 2 > max){
+			memmove(subtrees, subtrees + head,
+					(tail - head) * sizeof(*subtrees));
+			tail -= head;
+			head = 0;
+		}
+		if(node->rb_left)
+			subtrees[tail++] = node->rb_left;
+		if(node->rb_right)
+			subtrees[tail++] = node->rb_right;
+		rb_data_free(rb_entry(node, struct rb_data, node));
+	}
+	memmove(subtrees, subtrees + head, (tail - head) * sizeof(*subtrees));
+	return tail - head;
+}
+
+/*
+ * Detached subtrees have stale parent pointers, so
+ * instead of the postorder iterator they are freed
+ * by rotating left children up, which needs no stack
+ */
+static void rb_data_destroy_subtree(struct rb_node *node)
+{
+	struct rb_node *left, *next;
+	unsigned long freed = 0;
+
+	while(node){
+		left = node->rb_left;
+		if(left){
+			node->rb_left = left->rb_right;
+			left->rb_right = node;
+			node = left;
+			continue;
+		}
+		next = node->rb_right;
+		rb_data_free(rb_entry(node, struct rb_data, node));
+		node = next;
+		if(!(++freed % TEARDOWN_BATCH))
+			cond_resched();
 	}
 }
 
@@ -119,35 +453,33 @@ static void rb_data_destroy(struct rb_root *root)
  * key and value of cb_kv
  * */
 
-static char *rcu_tree_search(struct cb_root *root, uint32_t offset)
+static char *rcu_tree_search(struct cb_root *root, u64 offset)
 {
 	struct cb_kv *found = cb_find(root, offset);
 	return found ? (char *)(found->value) : NULL;
 }
 
-static int rcu_tree_insert(struct cb_root *root, char *str, uint32_t offset)
+static char *rcu_tree_search_le(struct cb_root *root, u64 offset)
 {
-	char *data;
+	struct cb_kv *found = cb_find_le(root, offset);
+	return found ? (char *)(found->value) : NULL;
+}
 
-	BUG_ON(str == NULL);
-	
-	data = kmalloc((strlen(str) + 1) * sizeof(char), GFP_ATOMIC);
+/* On success the tree owns the caller's reference to value */
+static int rcu_tree_insert(struct cb_root *root, struct lt_value *value,
+		u64 offset)
+{
+	BUG_ON(value == NULL);
 
-	if(!data){
-		pr_err("Could not allocate memory for RCU tree node string\n");
-		return -1;
-	}
-	data = strcpy(data, str);
 	/*
 	 * RCU tree is configured to cause a kernel
-	 * panic upon error, so if we return from this
-	 * call, all is good
+	 * panic upon allocation error, so if we return
+	 * from this call, the only failure is a duplicate key
 	 */
-	cb_insert(root, offset, (void *)data);
-	return 0;
+	return cb_insert(root, offset, (void *)value->data);
 }
 
-static int rcu_tree_erase(struct cb_root *root, uint32_t offset)
+static int rcu_tree_erase(struct cb_root *root, u64 offset)
 {
 	char *deleted = (char *)cb_erase(root, offset);
 
@@ -155,13 +487,19 @@ static int rcu_tree_erase(struct cb_root *root, uint32_t offset)
 		return -1;
 
 	//pr_info("Deleted string %s from RCU tree\n", deleted);
-	kfree(deleted);
+	lt_value_release(lt_value_of(deleted), true);
 	return 0;
 }
 
 static void kv_destroy(struct cb_kv *kv)
 {
-	kfree(kv->value);
+	lt_value_release(lt_value_of(kv->value), false);
+}
+
+/* Bulk erases hand over pairs readers may still be looking at */
+static void kv_destroy_deferred(struct cb_kv *kv)
+{
+	lt_value_release(lt_value_of(kv->value), true);
 }
 
 static void rcu_tree_destroy(struct cb_root *root)
@@ -169,10 +507,259 @@ static void rcu_tree_destroy(struct cb_root *root)
 	cb_destroy(root, kv_destroy);
 }
 
-void lt_init_lock(struct lock_tree *lt)
+/*
+ * Skip list call wrappers, values are stored
+ * like in the RCU tree and erased ones may still
+ * be read by lockless searches
+ */
+static int skiplist_erase(struct sl_root *root, u64 offset)
+{
+	char *deleted = (char *)sl_erase(root, offset);
+
+	if(!deleted)
+		return -1;
+	lt_value_release(lt_value_of(deleted), true);
+	return 0;
+}
+
+static void sl_value_destroy(void *value)
+{
+	lt_value_release(lt_value_of(value), false);
+}
+
+static void sl_value_destroy_deferred(void *value)
+{
+	lt_value_release(lt_value_of(value), true);
+}
+
+/*
+ * Adaptive lock internals. Decisions are taken every
+ * ADAPTIVE_PERIOD exclusive acquisitions: reader-writer
+ * mode if enough of the window were reads, blocking if
+ * enough acquisitions found the lock contended, spinning
+ * otherwise.
+ */
+enum {
+	ADAPTIVE_PERIOD = 4096,
+	ADAPTIVE_RW_READ_PCT = 70,
+	ADAPTIVE_BLOCK_CONTENDED_PCT = 50
+};
+
+static char *adaptive_mode_names[] = {"SPIN", "BLOCK", "RW"};
+
+static bool adaptive_trylock(struct adaptive_lock *al, ADAPTMODE_T mode,
+		bool excl)
+{
+	switch(mode){
+		case ADAPT_SPIN:
+			return spin_trylock(&(al->slock));
+		case ADAPT_BLOCK:
+			return mutex_trylock(&(al->mlock));
+		case ADAPT_RW:
+			if(excl)
+				return write_trylock(&(al->rwlock));
+			return read_trylock(&(al->rwlock));
+	}
+	return false;
+}
+
+static void adaptive_acquire(struct adaptive_lock *al, ADAPTMODE_T mode,
+		bool excl)
+{
+	if(adaptive_trylock(al, mode, excl))
+		return;
+
+	this_cpu_inc(al->samples->contended);
+	switch(mode){
+		case ADAPT_SPIN:
+			spin_lock(&(al->slock));
+			break;
+		case ADAPT_BLOCK:
+			mutex_lock(&(al->mlock));
+			break;
+		case ADAPT_RW:
+			if(excl)
+				write_lock(&(al->rwlock));
+			else
+				read_lock(&(al->rwlock));
+			break;
+	}
+}
+
+static void adaptive_release(struct adaptive_lock *al, ADAPTMODE_T mode,
+		bool excl)
+{
+	switch(mode){
+		case ADAPT_SPIN:
+			spin_unlock(&(al->slock));
+			break;
+		case ADAPT_BLOCK:
+			mutex_unlock(&(al->mlock));
+			break;
+		case ADAPT_RW:
+			if(excl)
+				write_unlock(&(al->rwlock));
+			else
+				read_unlock(&(al->rwlock));
+			break;
+	}
+}
+
+/* Caller must hold the lock exclusively */
+static void adaptive_maybe_switch(struct adaptive_lock *al)
+{
+	struct adaptive_sample now = {0, 0, 0};
+	unsigned long reads, writes, contended, total;
+	ADAPTMODE_T mode = al->mode, target;
+	int cpu;
+
+	if(++al->since_decision < ADAPTIVE_PERIOD)
+		return;
+	al->since_decision = 0;
+
+	/*
+	 * Per-CPU counters only ever grow, so the
+	 * window is the difference from the last sums
+	 */
+	for_each_possible_cpu(cpu){
+		struct adaptive_sample *s = per_cpu_ptr(al->samples, cpu);
+		now.reads += READ_ONCE(s->reads);
+		now.writes += READ_ONCE(s->writes);
+		now.contended += READ_ONCE(s->contended);
+	}
+	reads = now.reads - al->last.reads;
+	writes = now.writes - al->last.writes;
+	contended = now.contended - al->last.contended;
+	al->last = now;
+
+	total = reads + writes;
+	if(!total)
+		return;
+	if(al->allow_rw && reads * 100 >= total * ADAPTIVE_RW_READ_PCT)
+		target = ADAPT_RW;
+	else if(contended * 100 >= total * ADAPTIVE_BLOCK_CONTENDED_PCT)
+		target = ADAPT_BLOCK;
+	else
+		target = ADAPT_SPIN;
+
+	if(target == mode)
+		return;
+	/*
+	 * Only a thread that took the target lock for a stale
+	 * mode can hold it, and it drops it as soon as it sees
+	 * the mode. Do not wait for it though, it may be preempted
+	 * on this CPU while we hold a spinlock, so retry next period.
+	 */
+	if(!adaptive_trylock(al, target, true))
+		return;
+	WRITE_ONCE(al->mode, target);
+	adaptive_release(al, mode, true);
+	al->switches++;
+}
+
+static void adaptive_lock(struct adaptive_lock *al, bool excl)
+{
+	ADAPTMODE_T mode;
+	bool held_excl;
+
+	if(excl)
+		this_cpu_inc(al->samples->writes);
+	else
+		this_cpu_inc(al->samples->reads);
+
+	for(;;){
+		mode = READ_ONCE(al->mode);
+		/* Outside reader-writer mode every holder is exclusive */
+		held_excl = excl || mode != ADAPT_RW;
+		adaptive_acquire(al, mode, held_excl);
+		if(READ_ONCE(al->mode) == mode)
+			break;
+		adaptive_release(al, mode, held_excl);
+	}
+
+	if(held_excl){
+		WRITE_ONCE(al->owner, current);
+		adaptive_maybe_switch(al);
+	}
+}
+
+static bool adaptive_lock_try(struct adaptive_lock *al, bool excl)
+{
+	ADAPTMODE_T mode = READ_ONCE(al->mode);
+	bool held_excl = excl || mode != ADAPT_RW;
+
+	if(!adaptive_trylock(al, mode, held_excl))
+		return false;
+	if(READ_ONCE(al->mode) != mode){
+		adaptive_release(al, mode, held_excl);
+		return false;
+	}
+	if(excl)
+		this_cpu_inc(al->samples->writes);
+	else
+		this_cpu_inc(al->samples->reads);
+	if(held_excl){
+		WRITE_ONCE(al->owner, current);
+		adaptive_maybe_switch(al);
+	}
+	return true;
+}
+
+/*
+ * The mode cannot change while we hold the lock, and an
+ * exclusive holder holds the lock of the current mode even
+ * if it switched it, so only shared holders go by excl.
+ */
+static void adaptive_unlock(struct adaptive_lock *al, bool excl)
+{
+	if(READ_ONCE(al->owner) == current){
+		WRITE_ONCE(al->owner, NULL);
+		adaptive_release(al, READ_ONCE(al->mode), true);
+		return;
+	}
+	WARN_ON(excl || READ_ONCE(al->mode) != ADAPT_RW);
+	adaptive_release(al, ADAPT_RW, false);
+}
+
+static int adaptive_init(struct adaptive_lock *al, bool allow_rw)
+{
+	spin_lock_init(&(al->slock));
+	mutex_init(&(al->mlock));
+	rwlock_init(&(al->rwlock));
+	al->mode = ADAPT_SPIN;
+	al->owner = NULL;
+	al->allow_rw = allow_rw;
+	al->since_decision = 0;
+	memset(&(al->last), 0, sizeof(al->last));
+	al->switches = 0;
+	al->reported_switches = 0;
+	al->samples = alloc_percpu(struct adaptive_sample);
+	if(!al->samples){
+		pr_err("Could not allocate adaptive lock samples\n");
+		return -1;
+	}
+	return 0;
+}
+
+int lt_init_lock(struct lock_tree *lt)
 {
 	BUG_ON(lt == NULL);
 
+	if(lt->irq_safe != LT_IRQ_NONE){
+		/* Only spinning locks can be taken in interrupt context */
+		if(lt->lock_type != RWLOCK && lt->lock_type != SPINLOCK){
+			pr_err("Only RWLOCK and SPINLOCK can be IRQ-safe\n");
+			return -1;
+		}
+		if(lt->irq_safe == LT_IRQ_HARD){
+			lt->irq_flags = alloc_percpu(unsigned long);
+			if(!lt->irq_flags){
+				pr_err("Could not allocate per-CPU IRQ flags\n");
+				return -1;
+			}
+		}
+	}
+
 	switch(lt->lock_type){
 		case MUTEX:
 			mutex_init(&(lt->lock.mlock));
@@ -186,23 +773,42 @@ void lt_init_lock(struct lock_tree *lt)
 		case RWSEM:
 			init_rwsem(&(lt->lock.rwsem));
 			break;
+		case ADAPTIVE:
+			return adaptive_init(&(lt->lock.alock),
+					lt->tree_type == RB_TREE);
 		default:
 			BUG();
 			break;
 	}
+	return 0;
 }
 
 void lt_init_tree(struct lock_tree *lt)
 {
 	BUG_ON(lt == NULL);
 
+	if(lt->key_type == KEY_STRING){
+		lt->key_cmp = lt_skey_cmp;
+		lt->key_prefix = lt->prefix_cache ? lt_skey_prefix : NULL;
+	}else{
+		lt->key_cmp = NULL;
+		lt->key_prefix = NULL;
+	}
+
 	switch(lt->tree_type){
 		case RB_TREE:
 			lt->tree.rb_tree = RB_ROOT;
 			break;
 		case RCU_TREE:
 			cb_init();
+			memset(&lt->reported_mag, 0, sizeof(lt->reported_mag));
+			cb_copy_stats(&lt->reported_copy);
 			lt->tree.rcu_tree = CB_ROOT;
+			lt->tree.rcu_tree.cmp = lt->key_cmp;
+			lt->tree.rcu_tree.prefix = lt->key_prefix;
+			break;
+		case SKIPLIST:
+			sl_init(&(lt->tree.skiplist), lt->key_cmp, lt->key_prefix);
 			break;
 		default:
 			BUG();
@@ -210,123 +816,819 @@ void lt_init_tree(struct lock_tree *lt)
 	}
 }
 
-void lt_read_lock(struct lock_tree *lt)
+/*
+ * IRQ-safe spinning locks, for readers running in softirq
+ * or hardirq context. Every acquisition first disables
+ * bottom halves, as read_lock_bh() does, or interrupts, as
+ * spin_lock_irqsave() does. The saved flags are kept per CPU,
+ * nothing else can take the lock on that CPU before they are
+ * restored.
+ */
+static inline void lt_irq_disable(struct lock_tree *lt)
 {
-	BUG_ON(lt == NULL);
+	unsigned long flags;
 
-	/* Reader lock only necessary on red black tree */
-	if(lt->tree_type != RCU_TREE){
-		switch(lt->lock_type){
-			/* On mutexes and spinlocks read and write locks are the same */
-			case MUTEX:
-				mutex_lock(&(lt->lock.mlock));
-				break;
-			case RWLOCK:
-				read_lock(&(lt->lock.rwlock));
-				break;
-			case SPINLOCK:
-				spin_lock(&(lt->lock.slock));
-				break;
-			case RWSEM:
-				down_read(&(lt->lock.rwsem));
-				break;
-		}
+	switch(lt->irq_safe){
+		case LT_IRQ_BH:
+			local_bh_disable();
+			break;
+		case LT_IRQ_HARD:
+			local_irq_save(flags);
+			__this_cpu_write(*lt->irq_flags, flags);
+			break;
+		default:
+			break;
 	}
 }
 
-void lt_read_unlock(struct lock_tree *lt)
+static inline void lt_irq_enable(struct lock_tree *lt)
 {
-	BUG_ON(lt == NULL);
+	switch(lt->irq_safe){
+		case LT_IRQ_BH:
+			local_bh_enable();
+			break;
+		case LT_IRQ_HARD:
+			local_irq_restore(__this_cpu_read(*lt->irq_flags));
+			break;
+		default:
+			break;
+	}
+}
 
-	if(lt->tree_type != RCU_TREE){
-		switch(lt->lock_type){
-			case MUTEX:
-				mutex_unlock(&(lt->lock.mlock));
-				break;
-			case RWLOCK:
-				read_unlock(&(lt->lock.rwlock));
-				break;
-			case SPINLOCK:
-				spin_unlock(&(lt->lock.slock));
-				break;
-			case RWSEM:
-				up_read(&(lt->lock.rwsem));
-				break;
-		}
+/*
+ * Raw lock operations, the exported wrappers
+ * below add the tracepoints around them
+ */
+static void __lt_read_lock(struct lock_tree *lt)
+{
+	switch(lt->lock_type){
+		/* On mutexes and spinlocks read and write locks are the same */
+		case MUTEX:
+			mutex_lock(&(lt->lock.mlock));
+			break;
+		case RWLOCK:
+			lt_irq_disable(lt);
+			read_lock(&(lt->lock.rwlock));
+			break;
+		case SPINLOCK:
+			lt_irq_disable(lt);
+			spin_lock(&(lt->lock.slock));
+			break;
+		case RWSEM:
+			down_read(&(lt->lock.rwsem));
+			break;
+		case ADAPTIVE:
+			adaptive_lock(&(lt->lock.alock), false);
+			break;
 	}
 }
 
-void lt_write_lock(struct lock_tree *lt)
+static int __lt_read_trylock(struct lock_tree *lt)
 {
-	BUG_ON(lt == NULL);
+	switch(lt->lock_type){
+		case MUTEX:
+			return mutex_trylock(&(lt->lock.mlock));
+		case RWLOCK:
+			lt_irq_disable(lt);
+			if(read_trylock(&(lt->lock.rwlock)))
+				return 1;
+			lt_irq_enable(lt);
+			return 0;
+		case SPINLOCK:
+			lt_irq_disable(lt);
+			if(spin_trylock(&(lt->lock.slock)))
+				return 1;
+			lt_irq_enable(lt);
+			return 0;
+		case RWSEM:
+			return down_read_trylock(&(lt->lock.rwsem));
+		case ADAPTIVE:
+			return adaptive_lock_try(&(lt->lock.alock), false);
+	}
+	return 0;
+}
 
+static void __lt_write_lock(struct lock_tree *lt)
+{
 	switch(lt->lock_type){
 		case MUTEX:
 			mutex_lock(&(lt->lock.mlock));
 			break;
 		case RWLOCK:
+			lt_irq_disable(lt);
 			write_lock(&(lt->lock.rwlock));
 			break;
 		case SPINLOCK:
+			lt_irq_disable(lt);
 			spin_lock(&(lt->lock.slock));
 			break;
 		case RWSEM:
 			down_write(&(lt->lock.rwsem));
 			break;
+		case ADAPTIVE:
+			adaptive_lock(&(lt->lock.alock), true);
+			break;
+	}
+}
+
+static int __lt_write_trylock(struct lock_tree *lt)
+{
+	switch(lt->lock_type){
+		case MUTEX:
+			return mutex_trylock(&(lt->lock.mlock));
+		case RWLOCK:
+			lt_irq_disable(lt);
+			if(write_trylock(&(lt->lock.rwlock)))
+				return 1;
+			lt_irq_enable(lt);
+			return 0;
+		case SPINLOCK:
+			lt_irq_disable(lt);
+			if(spin_trylock(&(lt->lock.slock)))
+				return 1;
+			lt_irq_enable(lt);
+			return 0;
+		case RWSEM:
+			return down_write_trylock(&(lt->lock.rwsem));
+		case ADAPTIVE:
+			return adaptive_lock_try(&(lt->lock.alock), true);
+	}
+	return 0;
+}
+
+void lt_read_lock(struct lock_tree *lt)
+{
+	BUG_ON(lt == NULL);
+
+	/*
+	 * Reader lock only necessary on red black tree,
+	 * RCU tree readers only need to be in a read-side
+	 * critical section for the values they return
+	 */
+	if(lt->tree_type != RB_TREE){
+		rcu_read_lock();
+		return;
+	}
+
+	/* Only probe for contention while someone is tracing it */
+	if(trace_lt_lock_contended_enabled()){
+		if(!__lt_read_trylock(lt)){
+			trace_lt_lock_contended(lt->lock_type, false);
+			__lt_read_lock(lt);
+		}
+	}else{
+		__lt_read_lock(lt);
+	}
+	trace_lt_lock_acquired(lt->lock_type, false);
+}
+
+void lt_read_unlock(struct lock_tree *lt)
+{
+	BUG_ON(lt == NULL);
+
+	if(lt->tree_type != RB_TREE){
+		rcu_read_unlock();
+		return;
+	}
+
+	trace_lt_lock_release(lt->lock_type, false);
+	switch(lt->lock_type){
+		case MUTEX:
+			mutex_unlock(&(lt->lock.mlock));
+			break;
+		case RWLOCK:
+			read_unlock(&(lt->lock.rwlock));
+			lt_irq_enable(lt);
+			break;
+		case SPINLOCK:
+			spin_unlock(&(lt->lock.slock));
+			lt_irq_enable(lt);
+			break;
+		case RWSEM:
+			up_read(&(lt->lock.rwsem));
+			break;
+		case ADAPTIVE:
+			adaptive_unlock(&(lt->lock.alock), false);
+			break;
+	}
+}
+
+void lt_write_lock(struct lock_tree *lt)
+{
+	BUG_ON(lt == NULL);
+
+	/* Skip list writers only keep the nodes they walk alive */
+	if(lt->tree_type == SKIPLIST){
+		rcu_read_lock();
+		return;
+	}
+
+	/* Keep node allocations out of the critical section */
+	if(lt->tree_type == RCU_TREE)
+		cb_refill();
+
+	if(trace_lt_lock_contended_enabled()){
+		if(!__lt_write_trylock(lt)){
+			trace_lt_lock_contended(lt->lock_type, true);
+			__lt_write_lock(lt);
+		}
+	}else{
+		__lt_write_lock(lt);
 	}
+	trace_lt_lock_acquired(lt->lock_type, true);
 }
 
 void lt_write_unlock(struct lock_tree *lt)
 {
 	BUG_ON(lt == NULL);
 
+	if(lt->tree_type == SKIPLIST){
+		rcu_read_unlock();
+		return;
+	}
+
+	trace_lt_lock_release(lt->lock_type, true);
 	switch(lt->lock_type){
 		case MUTEX:
 			mutex_unlock(&(lt->lock.mlock));
 			break;
 		case RWLOCK:
 			write_unlock(&(lt->lock.rwlock));
+			lt_irq_enable(lt);
 			break;
 		case SPINLOCK:
 			spin_unlock(&(lt->lock.slock));
+			lt_irq_enable(lt);
 			break;
 		case RWSEM:
 			up_write(&(lt->lock.rwsem));
 			break;
+		case ADAPTIVE:
+			adaptive_unlock(&(lt->lock.alock), true);
+			break;
+	}
+}
+
+int lt_write_trylock(struct lock_tree *lt)
+{
+	BUG_ON(lt == NULL);
+
+	if(lt->tree_type == SKIPLIST){
+		rcu_read_lock();
+		return 1;
+	}
+
+	if(!__lt_write_trylock(lt))
+		return 0;
+	trace_lt_lock_acquired(lt->lock_type, true);
+	return 1;
+}
+
+static void fc_report(struct fc_state *fc, const char *stage_name)
+{
+	unsigned long batches = fc->batches - fc->reported_batches;
+	unsigned long ops = fc->ops - fc->reported_ops;
+
+	if(!batches)
+		return;
+	pr_info("%s stage: flat combining applied %lu writes in %lu batches, "
+			"%lu.%02lu writes per batch\n", stage_name, ops, batches,
+			ops / batches, (ops * 100 / batches) % 100);
+	fc->reported_batches = fc->batches;
+	fc->reported_ops = fc->ops;
+}
+
+/*
+ * Lookaside cache. Writers bump the shard generation after
+ * the erase is in the tree and searches read it before the
+ * walk, so an entry filled from a walk that missed an erase
+ * carries a generation the erase already left behind.
+ */
+enum { LT_LOOKASIDE_MAX_BITS = 16 };
+
+static inline atomic_long_t *lookaside_gen(struct lock_tree *lt, u64 offset)
+{
+	return &(lt->lookaside_gens[hash_64(offset, LT_LOOKASIDE_SHARD_BITS)].gen);
+}
+
+static void lookaside_invalidate(struct lock_tree *lt, u64 offset)
+{
+	if(!lt->lookaside)
+		return;
+	smp_mb__before_atomic();
+	atomic_long_inc(lookaside_gen(lt, offset));
+}
+
+static void lookaside_invalidate_all(struct lock_tree *lt)
+{
+	int i;
+
+	if(!lt->lookaside)
+		return;
+	smp_mb__before_atomic();
+	for(i=0;i<(1 << LT_LOOKASIDE_SHARD_BITS);i++)
+		atomic_long_inc(&(lt->lookaside_gens[i].gen));
+}
+
+static unsigned long lookaside_gen_begin(struct lock_tree *lt, u64 offset)
+{
+	unsigned long gen = atomic_long_read(lookaside_gen(lt, offset));
+
+	smp_rmb();
+	return gen;
+}
+
+/* Interrupt context searches leave the cache alone, they could tear an entry */
+static void lookaside_fill(struct lock_tree *lt, u64 offset, char *found,
+		unsigned long gen)
+{
+	struct lt_lookaside_cpu *lc;
+	struct lt_lookaside_entry *e;
+
+	if(in_interrupt())
+		return;
+	lc = get_cpu_ptr(lt->lookaside);
+	e = &(lc->entries[hash_64(offset, lt->lookaside_bits)]);
+	e->key = offset;
+	e->value = found;
+	e->gen = gen;
+	lc->stats.fills++;
+	put_cpu_ptr(lt->lookaside);
+}
+
+char *lt_lookaside_search(struct lock_tree *lt, u64 offset)
+{
+	struct lt_lookaside_cpu *lc;
+	struct lt_lookaside_entry *e;
+	char *found = NULL;
+
+	BUG_ON(lt == NULL);
+
+	if(!lt->lookaside)
+		return NULL;
+	lc = get_cpu_ptr(lt->lookaside);
+	e = &(lc->entries[hash_64(offset, lt->lookaside_bits)]);
+	lc->stats.lookups++;
+	if(e->value && e->key == offset){
+		if(e->gen == atomic_long_read(lookaside_gen(lt, offset))){
+			found = e->value;
+			lc->stats.hits++;
+		}else{
+			e->value = NULL;
+			lc->stats.stale++;
+		}
+	}
+	put_cpu_ptr(lt->lookaside);
+	return found;
+}
+
+int lt_init_lookaside(struct lock_tree *lt, unsigned int entries)
+{
+	struct lt_lookaside_cpu *lc;
+	int cpu;
+
+	BUG_ON(lt == NULL);
+
+	lt->lookaside_bits = clamp_t(unsigned int,
+			order_base_2(max(entries, 2U)), 1, LT_LOOKASIDE_MAX_BITS);
+	lt->lookaside_gens = kcalloc(1 << LT_LOOKASIDE_SHARD_BITS,
+			sizeof(*(lt->lookaside_gens)), GFP_KERNEL);
+	lt->lookaside = alloc_percpu(struct lt_lookaside_cpu);
+	if(!lt->lookaside_gens || !lt->lookaside)
+		goto err;
+	for_each_possible_cpu(cpu){
+		lc = per_cpu_ptr(lt->lookaside, cpu);
+		lc->entries = kcalloc_node(1 << lt->lookaside_bits,
+				sizeof(*(lc->entries)), GFP_KERNEL, cpu_to_node(cpu));
+		if(!lc->entries)
+			goto err;
+	}
+	memset(&lt->reported_lookaside, 0, sizeof(lt->reported_lookaside));
+	return 0;
+err:
+	lt_destroy_lookaside(lt);
+	return -1;
+}
+
+void lt_destroy_lookaside(struct lock_tree *lt)
+{
+	int cpu;
+
+	BUG_ON(lt == NULL);
+
+	if(lt->lookaside){
+		for_each_possible_cpu(cpu)
+			kfree(per_cpu_ptr(lt->lookaside, cpu)->entries);
+		free_percpu(lt->lookaside);
+		lt->lookaside = NULL;
+	}
+	kfree(lt->lookaside_gens);
+	lt->lookaside_gens = NULL;
+}
+
+/* Per-CPU counters since the last report */
+static void lookaside_report(struct lock_tree *lt, const char *stage_name)
+{
+	struct lt_lookaside_stats now = {}, *last = &lt->reported_lookaside;
+	unsigned long lookups, hits, stale;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu){
+		struct lt_lookaside_stats *st = &per_cpu_ptr(lt->lookaside, cpu)->stats;
+
+		now.lookups += READ_ONCE(st->lookups);
+		now.hits += READ_ONCE(st->hits);
+		now.stale += READ_ONCE(st->stale);
+		now.fills += READ_ONCE(st->fills);
+	}
+	for(i=0;i<(1 << LT_LOOKASIDE_SHARD_BITS);i++)
+		now.invalidations += atomic_long_read(&(lt->lookaside_gens[i].gen));
+
+	lookups = now.lookups - last->lookups;
+	hits = now.hits - last->hits;
+	stale = now.stale - last->stale;
+	if(lookups)
+		pr_info("%s stage: lookaside cache hit %lu of %lu searches (%lu%%), "
+				"%lu stale entries dropped (%lu%%), %lu fills, %lu "
+				"shard invalidations\n", stage_name, hits, lookups,
+				hits * 100 / lookups, stale, stale * 100 / lookups,
+				now.fills - last->fills,
+				now.invalidations - last->invalidations);
+	*last = now;
+}
+
+/* RCU tree node magazines, counts since the last report */
+static void mag_report(struct lock_tree *lt, const char *stage_name)
+{
+	struct cb_mag_stats now, *last = &lt->reported_mag;
+	unsigned long hits, allocs;
+
+	cb_magazine_stats(&now);
+	hits = now.hits - last->hits;
+	allocs = hits + now.misses - last->misses;
+	if(allocs)
+		pr_info("%s stage: node magazines served %lu of %lu allocations "
+				"(%lu%%), %lu refills brought %lu nodes, %lu nodes "
+				"recycled, %lu returned to the slab\n", stage_name,
+				hits, allocs, hits * 100 / allocs,
+				now.refills - last->refills,
+				now.refilled - last->refilled,
+				now.recycled - last->recycled,
+				now.overflows - last->overflows);
+	*last = now;
+}
+
+/*
+ * RCU tree nodes allocated per update since the last report,
+ * one plus rotations when updating in place, the whole path
+ * in persistent mode
+ */
+static void copy_report(struct lock_tree *lt, const char *stage_name)
+{
+	struct cb_copy_stats now, *last = &lt->reported_copy;
+	unsigned long updates, nodes;
+
+	cb_copy_stats(&now);
+	updates = now.updates - last->updates;
+	nodes = now.nodes - last->nodes;
+	if(updates)
+		pr_info("%s stage: %lu updates allocated %lu nodes, %lu.%02lu "
+				"per update, %lu retired nodes and values kept for "
+				"snapshots\n", stage_name, updates, nodes,
+				nodes / updates, (nodes * 100 / updates) % 100,
+				now.retained - last->retained);
+	*last = now;
+}
+
+void lt_lock_report(struct lock_tree *lt, const char *stage_name)
+{
+	struct adaptive_lock *al;
+	unsigned long switches;
+
+	BUG_ON(lt == NULL);
+
+	if(lt->fc.slots)
+		fc_report(&(lt->fc), stage_name);
+	if(lt->tree_type == RCU_TREE){
+		mag_report(lt, stage_name);
+		copy_report(lt, stage_name);
+	}
+	if(lt->lookaside)
+		lookaside_report(lt, stage_name);
+
+	if(lt->lock_type != ADAPTIVE)
+		return;
+	al = &(lt->lock.alock);
+	switches = READ_ONCE(al->switches);
+	pr_info("%s stage: adaptive lock switched mode %lu times, now in %s mode\n",
+			stage_name, switches - al->reported_switches,
+			adaptive_mode_names[READ_ONCE(al->mode)]);
+	al->reported_switches = switches;
+}
+
+/*
+ * Cache lines the hot part of a node spans, averaged over
+ * the offsets within a line consecutive slab objects land
+ * on, in hundredths
+ */
+static unsigned long hot_lines_centi(struct cb_layout *layout)
+{
+	size_t step = layout->node_align >= L1_CACHE_BYTES ?
+		L1_CACHE_BYTES : layout->node_size;
+	unsigned long lines = 0, offsets = 0;
+	size_t off = 0;
+
+	do{
+		lines += DIV_ROUND_UP(off + layout->hot_bytes, L1_CACHE_BYTES);
+		offsets++;
+		off = (off + step) % L1_CACHE_BYTES;
+	}while(off);
+	return lines * 100 / offsets;
+}
+
+/*
+ * RCU tree node layout and the cache lines a successful
+ * lookup is expected to touch, the average search depth
+ * times the lines a node's hot part spans. Measured miss
+ * counts come from perf, this is what the layout allows.
+ */
+void lt_tree_report(struct lock_tree *lt)
+{
+	struct cb_layout layout;
+	unsigned long depth, lines;
+
+	BUG_ON(lt == NULL);
+
+	if(lt->tree_type != RCU_TREE)
+		return;
+	cb_get_layout(&(lt->tree.rcu_tree), &layout);
+	pr_info("RCU tree nodes: %zu bytes aligned to %zu, %zu hot bytes, "
+			"%zu nodes per %d byte cache line\n", layout.node_size,
+			layout.node_align, layout.hot_bytes,
+			L1_CACHE_BYTES / layout.node_size, L1_CACHE_BYTES);
+	if(!layout.nodes)
+		return;
+	depth = layout.path_length * 100 / layout.nodes;
+	lines = depth * hot_lines_centi(&layout) / 100;
+	pr_info("RCU tree of %lu nodes: average search depth %lu.%02lu, "
+			"about %lu.%02lu cache lines per lookup\n", layout.nodes,
+			depth / 100, depth % 100, lines / 100, lines % 100);
+}
+
+size_t lt_node_bytes(struct lock_tree *lt)
+{
+	struct cb_layout layout;
+
+	BUG_ON(lt == NULL);
+
+	switch(lt->tree_type){
+		case RCU_TREE:
+			/* One node per key */
+			cb_get_layout(&(lt->tree.rcu_tree), &layout);
+			return layout.node_size;
+		case SKIPLIST:
+			return sl_node_bytes();
+		default:
+			return sizeof(struct rb_data);
 	}
 }
 
-char *lt_search(struct lock_tree *lt, uint32_t offset)
+void lt_destroy_lock(struct lock_tree *lt)
+{
+	BUG_ON(lt == NULL);
+
+	free_percpu(lt->irq_flags);
+	lt->irq_flags = NULL;
+
+	if(lt->lock_type == ADAPTIVE)
+		free_percpu(lt->lock.alock.samples);
+}
+
+/*
+ * Tree operations, traced on entry and exit,
+ * exit events carry the operation's result
+ */
+char *lt_search(struct lock_tree *lt, u64 offset)
+{
+	unsigned long gen = 0;
+	char *found;
+
+	BUG_ON(lt == NULL);
+
+	trace_lt_search_enter(offset, 0);
+	if(lt->lookaside)
+		gen = lookaside_gen_begin(lt, offset);
+	if(lt->tree_type == RB_TREE)
+		found = rb_data_search(lt, offset);
+	else if(lt->tree_type == SKIPLIST)
+		found = sl_search(&(lt->tree.skiplist), offset);
+	else
+		found = rcu_tree_search(&(lt->tree.rcu_tree), offset);
+	if(lt->lookaside && found)
+		lookaside_fill(lt, offset, found, gen);
+	trace_lt_search_exit(offset, found != NULL);
+	return found;
+}
+
+char *lt_search_le(struct lock_tree *lt, u64 offset)
 {
+	char *found;
+
 	BUG_ON(lt == NULL);
 
+	trace_lt_search_enter(offset, 0);
+	if(lt->tree_type == RB_TREE)
+		found = rb_data_search_le(lt, offset);
+	else if(lt->tree_type == SKIPLIST)
+		found = sl_search_le(&(lt->tree.skiplist), offset);
+	else
+		found = rcu_tree_search_le(&(lt->tree.rcu_tree), offset);
+	trace_lt_search_exit(offset, found != NULL);
+	return found;
+}
+
+static int __lt_insert_value(struct lock_tree *lt, struct lt_value *value,
+		u64 offset)
+{
+	int ret;
+
+	trace_lt_insert_enter(offset, 0);
 	if(lt->tree_type == RB_TREE)
-		return rb_data_search(&(lt->tree.rb_tree), offset);
-	return rcu_tree_search(&(lt->tree.rcu_tree), offset);
+		ret = rb_data_insert(lt, value, offset);
+	else if(lt->tree_type == SKIPLIST)
+		ret = sl_insert(&(lt->tree.skiplist), offset, value->data);
+	else
+		ret = rcu_tree_insert(&(lt->tree.rcu_tree), value, offset);
+	trace_lt_insert_exit(offset, ret);
+	return ret;
+}
+
+int lt_insert_data(struct lock_tree *lt, const void *data, size_t len,
+		u64 offset)
+{
+	struct lt_value *value;
+
+	BUG_ON(lt == NULL || data == NULL);
+
+	/*
+	 * GFP_ATOMIC flag is used because we cannot allow
+	 * kmalloc to block while holding a lock
+	 */
+	value = lt_value_alloc(len, GFP_ATOMIC);
+	if(!value){
+		pr_err("Could not allocate memory for tree value\n");
+		return -1;
+	}
+	memcpy(value->data, data, len);
+	if(__lt_insert_value(lt, value, offset)){
+		lt_value_put(value);
+		return -1;
+	}
+	return 0;
+}
+
+/* The tree takes its own reference, the caller's is untouched */
+int lt_insert_ref(struct lock_tree *lt, struct lt_value *value, u64 offset)
+{
+	BUG_ON(lt == NULL || value == NULL);
+
+	refcount_inc(&value->ref);
+	if(__lt_insert_value(lt, value, offset)){
+		/* Never the last reference */
+		refcount_dec(&value->ref);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Order statistics, the RB tree needs order_stats set
+ * before lt_init_tree to keep its subtree sizes
+ */
+unsigned long lt_rank(struct lock_tree *lt, u64 offset)
+{
+	BUG_ON(lt == NULL);
+
+	if(lt->tree_type == RB_TREE){
+		BUG_ON(!lt->order_stats);
+		return rb_data_count_below(lt, offset, false);
+	}
+	if(lt->tree_type == SKIPLIST)
+		return sl_rank(&(lt->tree.skiplist), offset);
+	return cb_rank(&(lt->tree.rcu_tree), offset);
+}
+
+char *lt_select(struct lock_tree *lt, unsigned long k)
+{
+	struct cb_kv *found;
+
+	BUG_ON(lt == NULL);
+
+	if(lt->tree_type == RB_TREE){
+		BUG_ON(!lt->order_stats);
+		return rb_data_select(lt, k);
+	}
+	if(lt->tree_type == SKIPLIST)
+		return (char *)sl_select(&(lt->tree.skiplist), k);
+	found = cb_select(&(lt->tree.rcu_tree), k);
+	return found ? (char *)(found->value) : NULL;
+}
+
+unsigned long lt_count_range(struct lock_tree *lt, u64 lo, u64 hi)
+{
+	unsigned long below, upto;
+
+	BUG_ON(lt == NULL);
+
+	if(lt->tree_type == RCU_TREE)
+		return cb_count_range(&(lt->tree.rcu_tree), lo, hi);
+	if(lt->tree_type == SKIPLIST)
+		return sl_count_range(&(lt->tree.skiplist), lo, hi);
+	BUG_ON(!lt->order_stats);
+	below = rb_data_count_below(lt, lo, false);
+	upto = rb_data_count_below(lt, hi, true);
+	return upto > below ? upto - below : 0;
+}
+
+/* Copy of the value of offset, truncated to size bytes */
+int lt_search_copy(struct lock_tree *lt, u64 offset, void *buf, size_t size)
+{
+	char *found = lt_search(lt, offset);
+	struct lt_value *value;
+
+	if(!found)
+		return -1;
+	value = lt_value_of(found);
+	memcpy(buf, found, min(size, value->len));
+	return value->len;
+}
+
+int lt_insert(struct lock_tree *lt, char *str, u64 offset)
+{
+	BUG_ON(str == NULL);
+	return lt_insert_data(lt, str, strlen(str) + 1, offset);
 }
 
-int lt_insert(struct lock_tree *lt, char *str, uint32_t offset)
+int lt_erase(struct lock_tree *lt, u64 offset)
 {
+	int ret;
+
 	BUG_ON(lt == NULL);
 
+	trace_lt_erase_enter(offset, 0);
 	if(lt->tree_type == RB_TREE)
-		return rb_data_insert(&(lt->tree.rb_tree), str, offset);
-	return rcu_tree_insert(&(lt->tree.rcu_tree), str, offset);
+		ret = rb_data_erase(lt, offset);
+	else if(lt->tree_type == SKIPLIST)
+		ret = skiplist_erase(&(lt->tree.skiplist), offset);
+	else
+		ret = rcu_tree_erase(&(lt->tree.rcu_tree), offset);
+	if(!ret)
+		lookaside_invalidate(lt, offset);
+	trace_lt_erase_exit(offset, ret);
+	return ret;
 }
 
-int lt_erase(struct lock_tree *lt, uint32_t offset)
+unsigned long lt_erase_range(struct lock_tree *lt, u64 lo, u64 hi)
 {
+	unsigned long erased;
+
 	BUG_ON(lt == NULL);
 
 	if(lt->tree_type == RB_TREE)
-		return rb_data_erase(&(lt->tree.rb_tree), offset);
-	return rcu_tree_erase(&(lt->tree.rcu_tree), offset);
+		erased = rb_data_erase_range(lt, lo, hi);
+	else if(lt->tree_type == SKIPLIST)
+		erased = sl_erase_range(&(lt->tree.skiplist), lo, hi,
+				sl_value_destroy_deferred);
+	else
+		erased = cb_erase_range(&(lt->tree.rcu_tree), lo, hi,
+				kv_destroy_deferred);
+	/* The keys of a range hash to any shard */
+	if(erased)
+		lookaside_invalidate_all(lt);
+	return erased;
+}
+
+int lt_snapshot(struct lock_tree *lt, struct cb_snapshot *snap)
+{
+	BUG_ON(lt == NULL);
+
+	if(lt->tree_type != RCU_TREE)
+		return -1;
+	return cb_snapshot(&(lt->tree.rcu_tree), snap);
+}
+
+void lt_snapshot_release(struct lock_tree *lt, struct cb_snapshot *snap)
+{
+	BUG_ON(lt == NULL || lt->tree_type != RCU_TREE);
+
+	cb_snapshot_release(snap);
 }
 
 void lt_destroy_tree(struct lock_tree *lt)
 {
 	BUG_ON(lt == NULL);
 
+	lookaside_invalidate_all(lt);
 	switch(lt->tree_type){
 		case RB_TREE:
 			rb_data_destroy(&(lt->tree.rb_tree));
@@ -334,7 +1636,223 @@ void lt_destroy_tree(struct lock_tree *lt)
 		case RCU_TREE:
 			rcu_tree_destroy(&(lt->tree.rcu_tree));
 			break;
+		case SKIPLIST:
+			sl_destroy(&(lt->tree.skiplist), sl_value_destroy);
+			break;
+	}
+}
+
+/*
+ * Parallel teardown. The top of the tree is taken apart
+ * into up to parts subtrees, or the skip list into runs of
+ * nodes, which are destroyed by the unbound workqueue
+ * concurrently, and the node caches are destroyed once they
+ * are all done.
+ */
+struct teardown_work {
+	struct work_struct work;
+	struct lock_tree *lt;
+	void *subtree;
+};
+
+static void teardown_fn(struct work_struct *work)
+{
+	struct teardown_work *tw = container_of(work, struct teardown_work, work);
+
+	if(tw->lt->tree_type == RB_TREE)
+		rb_data_destroy_subtree(tw->subtree);
+	else if(tw->lt->tree_type == SKIPLIST)
+		sl_destroy_part(tw->subtree, sl_value_destroy);
+	else
+		cb_destroy_subtree(tw->subtree, kv_destroy);
+}
+
+void lt_destroy_tree_parallel(struct lock_tree *lt, int parts)
+{
+	struct teardown_work *works;
+	void **subtrees;
+	int i, n;
+
+	BUG_ON(lt == NULL);
+
+	lookaside_invalidate_all(lt);
+	works = parts > 1 ? kcalloc(parts, sizeof(*works), GFP_KERNEL) : NULL;
+	subtrees = parts > 1 ? kcalloc(parts, sizeof(*subtrees), GFP_KERNEL) : NULL;
+	if(!works || !subtrees){
+		/* Serial teardown needs no memory */
+		kfree(works);
+		kfree(subtrees);
+		lt_destroy_tree(lt);
+		return;
+	}
+
+	if(lt->tree_type == RB_TREE)
+		n = rb_data_detach(&(lt->tree.rb_tree), subtrees, parts);
+	else if(lt->tree_type == SKIPLIST)
+		n = sl_detach(&(lt->tree.skiplist), subtrees, parts);
+	else
+		n = cb_detach(&(lt->tree.rcu_tree), subtrees, parts, kv_destroy);
+
+	for(i=0;i<n;i++){
+		works[i].lt = lt;
+		works[i].subtree = subtrees[i];
+		INIT_WORK(&works[i].work, teardown_fn);
+		queue_work(system_unbound_wq, &works[i].work);
+	}
+	for(i=0;i<n;i++)
+		flush_work(&works[i].work);
+
+	if(lt->tree_type == RCU_TREE)
+		cb_destroy_cache();
+	else if(lt->tree_type == SKIPLIST)
+		sl_destroy_cache();
+	kfree(works);
+	kfree(subtrees);
+}
+
+/*
+ * Flat combining. The combiner keeps sweeping the
+ * slots while sweeps find new requests, up to a limit
+ * so that a steady stream of writers cannot keep it
+ * holding the lock forever
+ */
+enum { FC_MAX_PASSES = 4 };
+
+int lt_init_combining(struct lock_tree *lt, int num_slots)
+{
+	BUG_ON(lt == NULL);
+
+	/* Every skip list writer would be a combiner */
+	if(lt->tree_type == SKIPLIST){
+		pr_err("The skip list has no write lock to combine under\n");
+		return -1;
+	}
+
+	lt->fc.slots = kcalloc(num_slots, sizeof(*(lt->fc.slots)), GFP_KERNEL);
+	if(!lt->fc.slots){
+		pr_err("Could not allocate flat combining slots\n");
+		return -1;
 	}
+	lt->fc.num_slots = num_slots;
+	return 0;
+}
+
+void lt_destroy_combining(struct lock_tree *lt)
+{
+	BUG_ON(lt == NULL);
+
+	kfree(lt->fc.slots);
+	lt->fc.slots = NULL;
+}
+
+/* Caller must hold the write lock */
+static void fc_combine(struct lock_tree *lt, int slot_id)
+{
+	struct fc_state *fc = &(lt->fc);
+	int i, pass, applied, total = 0;
+
+	for(pass=0;pass<FC_MAX_PASSES;pass++){
+		applied = 0;
+		for(i=0;i<fc->num_slots;i++){
+			struct fc_slot *slot = &(fc->slots[i]);
+			FCOP_T op = smp_load_acquire(&(slot->op));
+
+			if(op == FC_NONE)
+				continue;
+			if(op == FC_INSERT)
+				slot->result = lt_insert_data(lt, slot->data,
+						slot->len, slot->offset);
+			else if(op == FC_INSERT_REF)
+				slot->result = lt_insert_ref(lt,
+						(struct lt_value *)slot->data,
+						slot->offset);
+			else if(op == FC_ERASE_RANGE)
+				slot->result = min_t(unsigned long, INT_MAX,
+						lt_erase_range(lt, slot->offset,
+							slot->hi));
+			else
+				slot->result = lt_erase(lt, slot->offset);
+			if(fc->cs_work)
+				fc->cs_work(slot_id);
+			/* Hand the result back to the owner */
+			smp_store_release(&(slot->op), FC_NONE);
+			applied++;
+		}
+		if(!applied)
+			break;
+		total += applied;
+	}
+	if(total){
+		fc->ops += total;
+		fc->batches++;
+	}
+}
+
+static int fc_submit(struct lock_tree *lt, int slot_id, FCOP_T op,
+		const void *data, size_t len, u64 offset, u64 hi)
+{
+	struct fc_slot *slot;
+
+	BUG_ON(lt == NULL || lt->fc.slots == NULL);
+	BUG_ON(slot_id >= lt->fc.num_slots);
+
+	/* A combiner allocates for the whole batch */
+	if(lt->tree_type == RCU_TREE)
+		cb_refill();
+
+	slot = &(lt->fc.slots[slot_id]);
+	slot->data = data;
+	slot->len = len;
+	slot->offset = offset;
+	slot->hi = hi;
+	smp_store_release(&(slot->op), op);
+
+	/*
+	 * Either become the combiner or wait for
+	 * the current one to serve our slot
+	 */
+	for(;;){
+		if(lt_write_trylock(lt)){
+			fc_combine(lt, slot_id);
+			lt_write_unlock(lt);
+		}
+		if(smp_load_acquire(&(slot->op)) == FC_NONE)
+			return slot->result;
+		/* The combiner may be sharing our CPU */
+		cond_resched();
+		cpu_relax();
+	}
+}
+
+int lt_combined_insert_data(struct lock_tree *lt, int slot, const void *data,
+		size_t len, u64 offset)
+{
+	BUG_ON(data == NULL);
+	return fc_submit(lt, slot, FC_INSERT, data, len, offset, 0);
+}
+
+int lt_combined_insert(struct lock_tree *lt, int slot, char *str, u64 offset)
+{
+	BUG_ON(str == NULL);
+	return lt_combined_insert_data(lt, slot, str, strlen(str) + 1, offset);
+}
+
+int lt_combined_insert_ref(struct lock_tree *lt, int slot, struct lt_value *value,
+		u64 offset)
+{
+	BUG_ON(value == NULL);
+	return fc_submit(lt, slot, FC_INSERT_REF, value, 0, offset, 0);
+}
+
+int lt_combined_erase(struct lock_tree *lt, int slot, u64 offset)
+{
+	return fc_submit(lt, slot, FC_ERASE, NULL, 0, offset, 0);
+}
+
+unsigned long lt_combined_erase_range(struct lock_tree *lt, int slot, u64 lo,
+		u64 hi)
+{
+	return fc_submit(lt, slot, FC_ERASE_RANGE, NULL, 0, lo, hi);
 }
 
 void simple_barrier_init(struct simple_barrier *b, int num_threads)
@@ -350,17 +1868,44 @@ void simple_barrier_init(struct simple_barrier *b, int num_threads)
 
 void simple_barrier_wait(struct simple_barrier *b)
 {
+	simple_barrier_wait_abortable(b, NULL);
+}
+
+int simple_barrier_wait_abortable(struct simple_barrier *b,
+		bool (*aborted)(void))
+{
+	int remaining;
+
 	if(!b){
 		pr_err("NULL barrier argument passed\n");
-		return;
+		return -1;
 	}
 	/* 
 	 * Decrement and test barrier atomic
-	 * If the result is false, then join the wait_queue,
+	 * If the result is not zero, then join the wait_queue,
 	 * else wake up those sleeping in the wait queue
 	 */
-	if(atomic_dec_and_test(&(b->counter)) == false)
-		wait_event_interruptible(b->wq, atomic_read(&(b->counter)) == 0);
-	else
+	remaining = atomic_dec_return(&(b->counter));
+	trace_barrier_arrive(b, remaining);
+	if(!remaining){
+		trace_barrier_release(b);
 		wake_up_interruptible(&(b->wq));
+		return 0;
+	}
+	if(!aborted){
+		wait_event_interruptible(b->wq, atomic_read(&(b->counter)) == 0);
+		return 0;
+	}
+	/*
+	 * The abort is a plain flag nobody wakes us for,
+	 * so look at it again every poll interval
+	 */
+	while(atomic_read(&(b->counter))){
+		if(aborted())
+			return -1;
+		wait_event_interruptible_timeout(b->wq,
+				atomic_read(&(b->counter)) == 0,
+				msecs_to_jiffies(SIMPLE_BARRIER_POLL_MS));
+	}
+	return 0;
 }
@@ -1,11 +1,18 @@
+#ifndef _AUX_STRUCTS_H
+#define _AUX_STRUCTS_H
+
 #include <linux/rbtree.h>
 #include <linux/rcupdate.h>
 #include <linux/rwsem.h>
 #include <linux/mutex.h>
 #include <linux/spinlock.h>
 #include <linux/wait.h>
+#include <linux/percpu.h>
+#include <linux/refcount.h>
+#include <linux/gfp.h>
 #include <asm/atomic.h>
 #include "cbtree.h"
+#include "skiplist.h"
 
 /* 
  * Enums for lock and tree type.
@@ -19,21 +26,207 @@ typedef enum {
 	MUTEX,
 	RWLOCK,
 	SPINLOCK,
-	RWSEM
+	RWSEM,
+	ADAPTIVE
 }LOCKTYPE_T;
 
 typedef enum {
 	RB_TREE,
-	RCU_TREE
+	RCU_TREE,
+	SKIPLIST
 }TREETYPE_T;
 
+/*
+ * Context of the fastest reader, spinning locks taken
+ * by process context disable bottom halves for softirq
+ * readers and interrupts for hardirq readers
+ */
+typedef enum {
+	LT_IRQ_NONE,
+	LT_IRQ_BH,
+	LT_IRQ_HARD
+}LTIRQ_T;
+
+/*
+ * Key types. Keys are u64 in the whole API, either
+ * the key itself or, for string keys, a pointer to a
+ * struct lt_skey that outlives every node keyed by it.
+ * String keys compare like memcmp, a shorter key sorting
+ * before the longer keys it is a prefix of, and can cache
+ * an order preserving prefix of their first 8 bytes in the
+ * tree nodes so that most comparisons skip the key bytes.
+ */
+typedef enum {
+	KEY_U64,
+	KEY_STRING
+}KEYTYPE_T;
+
+struct lt_skey {
+	u32 len;
+	u8 bytes[];
+};
+
+int lt_skey_cmp(u64 a, u64 b);
+u64 lt_skey_prefix(u64 key);
+
+/*
+ * Adaptive lock, switches between spinning,
+ * blocking and reader-writer behaviour at runtime.
+ * Every acquisition samples the read/write mix and
+ * whether the lock was contended into per-CPU counters,
+ * and every ADAPTIVE_PERIOD exclusive acquisitions the
+ * holder picks a new mode from the sampled window.
+ *
+ * A mode switch is a quiescent hand-off: the switching
+ * thread holds the current mode's lock exclusively, takes
+ * the new mode's lock, publishes the new mode and only then
+ * drops the old lock. Threads that acquired a lock for a
+ * stale mode see the mode changed, drop it and retry.
+ */
+typedef enum {
+	ADAPT_SPIN,
+	ADAPT_BLOCK,
+	ADAPT_RW
+}ADAPTMODE_T;
+
+struct adaptive_sample {
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long contended;
+};
+
+struct adaptive_lock {
+	spinlock_t slock;
+	struct mutex mlock;
+	rwlock_t rwlock;
+	ADAPTMODE_T mode;
+	/*
+	 * Exclusive holder, readers included, NULL while the lock is
+	 * free or read held in reader-writer mode. A reader that
+	 * switches to that mode still holds it for writing, so
+	 * unlocking goes by this rather than by the mode.
+	 */
+	struct task_struct *owner;
+	/* Reader-writer mode is pointless if readers take no lock */
+	bool allow_rw;
+	/* Protected by the lock itself, only touched when held exclusively */
+	unsigned int since_decision;
+	struct adaptive_sample last;
+	unsigned long switches;
+	unsigned long reported_switches;
+	struct adaptive_sample __percpu *samples;
+};
+
+/*
+ * Flat combining for write operations. Each writer
+ * owns a slot where it publishes its request, and
+ * whichever writer acquires the lock applies every
+ * pending request in one batch, storing each result
+ * in its slot. Slots are cache line aligned so that
+ * publishing does not bounce the neighbours' lines.
+ */
+typedef enum {
+	FC_NONE,
+	FC_INSERT,
+	FC_INSERT_REF,
+	FC_ERASE,
+	FC_ERASE_RANGE
+}FCOP_T;
+
+struct fc_slot {
+	FCOP_T op;
+	u64 offset;
+	/* Last key of a range erase */
+	u64 hi;
+	const void *data;
+	size_t len;
+	/* Keys a range erase removed, capped at INT_MAX */
+	int result;
+} ____cacheline_aligned_in_smp;
+
+struct fc_state {
+	struct fc_slot *slots;
+	int num_slots;
+	/*
+	 * Optional, run by the combiner after every request
+	 * it applies, with the combiner's own slot
+	 */
+	void (*cs_work)(int slot);
+	/* Protected by the write lock */
+	unsigned long batches;
+	unsigned long ops;
+	unsigned long reported_batches;
+	unsigned long reported_ops;
+};
+
+/*
+ * Per-CPU lookaside cache of search results, direct mapped
+ * on the key's hash. An entry remembers the generation of
+ * its key's shard when it was filled and erases bump that
+ * generation, so a hit needs neither the lock nor the tree.
+ * Inserts never make a cached value wrong, they do not bump.
+ */
+enum { LT_LOOKASIDE_SHARD_BITS = 6 };
+
+struct lt_lookaside_entry {
+	u64 key;
+	char *value;
+	unsigned long gen;
+};
+
+struct lt_lookaside_stats {
+	unsigned long lookups;
+	unsigned long hits;
+	/* Entries for the key whose shard had moved on since */
+	unsigned long stale;
+	unsigned long fills;
+	/* Shard generation bumps, only summed at report time */
+	unsigned long invalidations;
+};
+
+/* Only touched by its CPU, from task context with preemption off */
+struct lt_lookaside_cpu {
+	struct lt_lookaside_entry *entries;
+	struct lt_lookaside_stats stats;
+};
+
+struct lt_lookaside_gen {
+	atomic_long_t gen;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Tree values, both trees store a pointer to data.
+ * Inserting by copy allocates a value holding the only
+ * reference, inserting by reference makes the tree share
+ * a value the caller allocated (for instance a buffer pool)
+ * and the caller drops its own reference when done with it.
+ */
+struct lt_value {
+	struct rcu_head rcu;
+	refcount_t ref;
+	size_t len;
+	char data[];
+};
+
+static inline struct lt_value *lt_value_of(const char *data)
+{
+	return (struct lt_value *)(data - offsetof(struct lt_value, data));
+}
+
+struct lt_value *lt_value_alloc(size_t len, gfp_t gfp);
+void lt_value_put(struct lt_value *value);
+
 /* 
  * Wrapper data structure for
  * rbtree configuration
  */
 struct rb_data {
 	char *str;
-	uint32_t offset;
+	u64 offset;
+	/* Cached key prefix, only set with prefix caching */
+	u64 prefix;
+	/* Subtree size, only kept with order statistics */
+	unsigned long size;
 	struct rb_node node;
 };
 
@@ -57,13 +250,38 @@ struct lock_tree {
 		rwlock_t rwlock;
 		spinlock_t slock;
 		struct rw_semaphore rwsem;
+		struct adaptive_lock alock;
 	}lock;
 	union {
 		struct rb_root rb_tree;
 		struct cb_root rcu_tree;
+		struct sl_root skiplist;
 	}tree;
 	LOCKTYPE_T lock_type;
 	TREETYPE_T tree_type;
+	/* Set before lt_init_lock, only for RWLOCK and SPINLOCK */
+	LTIRQ_T irq_safe;
+	/* Saved interrupt flags with LT_IRQ_HARD */
+	unsigned long __percpu *irq_flags;
+	/* Key configuration, set before lt_init_tree */
+	KEYTYPE_T key_type;
+	bool prefix_cache;
+	/* Keep RB tree subtree sizes for the order statistics */
+	bool order_stats;
+	/* Resolved by lt_init_tree, NULL for integer keys */
+	int (*key_cmp)(u64 a, u64 b);
+	u64 (*key_prefix)(u64 key);
+	/* Flat combining, slots are NULL when disabled */
+	struct fc_state fc;
+	/* RCU tree node magazine counters at the last report */
+	struct cb_mag_stats reported_mag;
+	/* RCU tree path copy counters at the last report */
+	struct cb_copy_stats reported_copy;
+	/* Lookaside cache, NULL when disabled */
+	struct lt_lookaside_cpu __percpu *lookaside;
+	struct lt_lookaside_gen *lookaside_gens;
+	unsigned int lookaside_bits;
+	struct lt_lookaside_stats reported_lookaside;
 };
 
 /* 
@@ -72,21 +290,87 @@ struct lock_tree {
  * all possible configurations, for
  * instance, on the RCU tree configurations
  * the reader lock/unlock functions do nothing
+ * and the skip list takes no lock at all
  */
 
 /* Initialization */
-void lt_init_lock(struct lock_tree *lt);
+int lt_init_lock(struct lock_tree *lt);
 void lt_init_tree(struct lock_tree *lt);
 /* Locks */
 void lt_read_lock(struct lock_tree *lt);
 void lt_read_unlock(struct lock_tree *lt);
 void lt_write_lock(struct lock_tree *lt);
 void lt_write_unlock(struct lock_tree *lt);
+int lt_write_trylock(struct lock_tree *lt);
+void lt_lock_report(struct lock_tree *lt, const char *stage_name);
+/* RCU tree node layout and expected cache lines per lookup */
+void lt_tree_report(struct lock_tree *lt);
+/*
+ * Bytes of tree structure per key, keys and values not
+ * included. Walks an RCU_TREE, best called while it is empty.
+ */
+size_t lt_node_bytes(struct lock_tree *lt);
+void lt_destroy_lock(struct lock_tree *lt);
 /* Trees */
-char *lt_search(struct lock_tree *lt, uint32_t offset);
-int lt_insert(struct lock_tree *lt, char *str, uint32_t offset);
-int lt_erase(struct lock_tree *lt, uint32_t offset);
+char *lt_search(struct lock_tree *lt, u64 offset);
+/* Floor search, value of the greatest key <= offset */
+char *lt_search_le(struct lock_tree *lt, u64 offset);
+/*
+ * Order statistics, caller holds the read lock. Rank is the
+ * number of keys below offset, select the value of the k-th
+ * smallest key (from 0) and count_range the number of keys
+ * in [lo, hi]. The RB tree needs order_stats.
+ */
+unsigned long lt_rank(struct lock_tree *lt, u64 offset);
+char *lt_select(struct lock_tree *lt, unsigned long k);
+unsigned long lt_count_range(struct lock_tree *lt, u64 lo, u64 hi);
+/* Caller holds the read lock, returns the value length or -1 */
+int lt_search_copy(struct lock_tree *lt, u64 offset, void *buf, size_t size);
+int lt_insert(struct lock_tree *lt, char *str, u64 offset);
+/* Insert a copy of len bytes of arbitrary data */
+int lt_insert_data(struct lock_tree *lt, const void *data, size_t len,
+		u64 offset);
+int lt_insert_ref(struct lock_tree *lt, struct lt_value *value, u64 offset);
+int lt_erase(struct lock_tree *lt, u64 offset);
+/*
+ * Erases every key in [lo, hi] and returns how many went,
+ * the RCU tree publishes the whole range removal at once,
+ * the skip list erases the keys one at a time
+ */
+unsigned long lt_erase_range(struct lock_tree *lt, u64 lo, u64 hi);
+/*
+ * Point-in-time view of an RCU tree in persistent mode, for
+ * scans that run while writers go on. Returns -1 for other
+ * trees or without persistent mode. Release it before the
+ * tree is destroyed.
+ */
+int lt_snapshot(struct lock_tree *lt, struct cb_snapshot *snap);
+void lt_snapshot_release(struct lock_tree *lt, struct cb_snapshot *snap);
 void lt_destroy_tree(struct lock_tree *lt);
+/* Teardown split across up to parts workqueue items, parts <= 1 is serial */
+void lt_destroy_tree_parallel(struct lock_tree *lt, int parts);
+/*
+ * Lookaside cache of entries (rounded up to a power of two)
+ * per CPU, set up after lt_init_lock. Values erased from any
+ * tree are then freed after a grace period, and a value
+ * lt_lookaside_search returns stays valid until the caller,
+ * in task context, leaves its RCU read-side critical section.
+ * lt_search fills the cache, NULL is a miss.
+ */
+int lt_init_lookaside(struct lock_tree *lt, unsigned int entries);
+void lt_destroy_lookaside(struct lock_tree *lt);
+char *lt_lookaside_search(struct lock_tree *lt, u64 offset);
+/* Flat combined writes, slot is the caller's thread id */
+int lt_init_combining(struct lock_tree *lt, int num_slots);
+void lt_destroy_combining(struct lock_tree *lt);
+int lt_combined_insert(struct lock_tree *lt, int slot, char *str, u64 offset);
+int lt_combined_insert_data(struct lock_tree *lt, int slot, const void *data,
+		size_t len, u64 offset);
+int lt_combined_insert_ref(struct lock_tree *lt, int slot, struct lt_value *value,
+		u64 offset);
+int lt_combined_erase(struct lock_tree *lt, int slot, u64 offset);
+unsigned long lt_combined_erase_range(struct lock_tree *lt, int slot, u64 lo,
+		u64 hi);
 
 /*
  * Simple barrier implementation
@@ -104,3 +388,14 @@ struct simple_barrier {
 /* Barrier Functions */
 void simple_barrier_init(struct simple_barrier *b, int num_threads);
 void simple_barrier_wait(struct simple_barrier *b);
+/*
+ * Waits like simple_barrier_wait but checks aborted() every
+ * SIMPLE_BARRIER_POLL_MS while others are missing, returns -1
+ * once it is true and 0 when every thread arrived. A barrier
+ * left this way is spent, init it again before reuse.
+ */
+#define SIMPLE_BARRIER_POLL_MS 100
+int simple_barrier_wait_abortable(struct simple_barrier *b,
+		bool (*aborted)(void));
+
+#endif /* _AUX_STRUCTS_H */
@@ -0,0 +1,189 @@
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+#include <linux/printk.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/rcupdate.h>
+#include <linux/math64.h>
+#include "cbtree.h"
+#include "bulk_check.h"
+
+/*
+ * Tree A holds the even keys 2 to 2n and tree B the
+ * multiples of 3 up to 3n, so they share the multiples
+ * of 6 up to 2n. Values only tag which tree a pair came
+ * from, a union must keep A's pair of every shared key.
+ */
+#define BULK_A	((void *)1UL)
+#define BULK_B	((void *)2UL)
+
+/* Keys inserted between reschedules */
+enum { BULK_BATCH = 65536 };
+
+/* State of the walk in progress, checks run one at a time */
+static u64 walk_lo, walk_hi, walk_last, walk_a_max;
+static unsigned long walk_keys;
+static bool walk_ok;
+static unsigned long dropped;
+static bool dropped_ok;
+
+static void bulk_walk_kv(struct cb_kv *kv)
+{
+	bool in_a = !(kv->key % 2) && kv->key <= walk_a_max;
+
+	if(kv->key < walk_lo || kv->key > walk_hi ||
+			(walk_keys && kv->key <= walk_last) ||
+			(!in_a && kv->key % 3) ||
+			kv->value != (in_a ? BULK_A : BULK_B))
+		walk_ok = false;
+	walk_last = kv->key;
+	walk_keys++;
+}
+
+/* Keys in [lo, hi], in order, as many as expected, with the right values */
+static bool bulk_walk(struct cb_root *tree, u64 lo, u64 hi,
+		unsigned long expected, const char *what)
+{
+	walk_lo = lo;
+	walk_hi = hi;
+	walk_keys = 0;
+	walk_ok = true;
+	cb_for_each(tree, bulk_walk_kv);
+	if(walk_ok && walk_keys == expected)
+		return true;
+	pr_err("%s: %lu keys, expected %lu, %s\n", what, walk_keys, expected,
+			walk_ok ? "in order" : "out of order, range or value");
+	return false;
+}
+
+/* Pairs of B union drops for keys A holds */
+static void bulk_drop_kv(struct cb_kv *kv)
+{
+	if(kv->value != BULK_B || kv->key % 6)
+		dropped_ok = false;
+	dropped++;
+}
+
+static void bulk_build(struct cb_root *tree, unsigned long n, u64 step,
+		void *value)
+{
+	unsigned long i;
+
+	*tree = CB_ROOT;
+	for(i=1;i<=n;i++){
+		cb_insert(tree, i * step, value);
+		if(!(i % BULK_BATCH))
+			cond_resched();
+	}
+}
+
+/* Frees the nodes but not the shared node cache */
+static void bulk_free(struct cb_root *tree)
+{
+	if(tree->root)
+		cb_destroy_subtree(tree->root, NULL);
+	tree->root = NULL;
+}
+
+static int bulk_check_split_join(unsigned long n)
+{
+	struct cb_root a, right = CB_ROOT;
+	unsigned long below = (n - 1) / 2;
+	ktime_t start;
+	s64 split_us, join_us;
+	int ret = -1;
+
+	bulk_build(&a, n, 2, BULK_A);
+
+	/* Keys >= n move right, n itself included when even */
+	start = ktime_get();
+	cb_split(&a, n, &right);
+	split_us = ktime_us_delta(ktime_get(), start);
+	if(!bulk_walk(&a, 2, n - 1, below, "split, left") ||
+			!bulk_walk(&right, n, 2 * n, n - below, "split, right"))
+		goto out;
+
+	if(below && cb_join(&right, &a) != -1){
+		pr_err("join accepted overlapping trees\n");
+		goto out;
+	}
+	start = ktime_get();
+	if(cb_join(&a, &right)){
+		pr_err("join refused ordered trees\n");
+		goto out;
+	}
+	join_us = ktime_us_delta(ktime_get(), start);
+	if(!bulk_walk(&a, 2, 2 * n, n, "join") ||
+			!bulk_walk(&right, 0, 0, 0, "join, right"))
+		goto out;
+
+	pr_info("Split and join of %lu keys: %lld us and %lld us\n", n,
+			split_us, join_us);
+	ret = 0;
+out:
+	bulk_free(&a);
+	bulk_free(&right);
+	return ret;
+}
+
+static int bulk_check_union(unsigned long n, int threads, s64 *us)
+{
+	struct cb_root a, b;
+	unsigned long shared = n / 3;
+	ktime_t start;
+	int ret = -1;
+
+	bulk_build(&a, n, 2, BULK_A);
+	bulk_build(&b, n, 3, BULK_B);
+	dropped = 0;
+	dropped_ok = true;
+
+	start = ktime_get();
+	if(threads > 1)
+		cb_union_parallel(&a, &b, threads, bulk_drop_kv);
+	else
+		cb_union(&a, &b, bulk_drop_kv);
+	*us = ktime_us_delta(ktime_get(), start);
+
+	if(!bulk_walk(&a, 2, 3 * n, 2 * n - shared, "union") ||
+			!bulk_walk(&b, 0, 0, 0, "union, other"))
+		goto out;
+	if(!dropped_ok || dropped != shared){
+		pr_err("union dropped %lu pairs, expected %lu of the other tree\n",
+				dropped, shared);
+		goto out;
+	}
+	ret = 0;
+out:
+	bulk_free(&a);
+	bulk_free(&b);
+	return ret;
+}
+
+int bulk_check_run(unsigned long num_keys, int max_threads)
+{
+	s64 us, serial_us = 0;
+	int threads, ret = -1;
+
+	if(num_keys < 2){
+		pr_err("Bulk operations need at least 2 keys to check\n");
+		return -1;
+	}
+	walk_a_max = 2 * num_keys;
+	if(bulk_check_split_join(num_keys))
+		goto out;
+	for(threads=1;threads<=max_threads;threads*=2){
+		if(bulk_check_union(num_keys, threads, &us))
+			goto out;
+		if(threads == 1)
+			serial_us = us;
+		pr_info("Union of two trees of %lu keys on %d kthread(s): %lld us, "
+				"%lld%% of serial\n", num_keys, threads, us,
+				serial_us ? div64_s64(us * 100, serial_us) : 100);
+	}
+	pr_info("Bulk operations checked on %lu keys\n", num_keys);
+	ret = 0;
+out:
+	/* Let the nodes the updates retired go before the runs start */
+	rcu_barrier();
+	return ret;
+}
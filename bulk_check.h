@@ -0,0 +1,16 @@
+#ifndef _BULK_CHECK_H
+#define _BULK_CHECK_H
+
+/*
+ * Self-check of the RCU tree bulk operations, run on
+ * scratch trees of integer keys next to the workload's
+ * tree, whose node cache must be set up. Splits a tree of
+ * num_keys keys and joins it back, then merges it with an
+ * overlapping tree through cb_union and cb_union_parallel
+ * on 2 up to max_threads kthreads, checking the order,
+ * size and values of every result and timing each union.
+ * Returns -1 if any result is wrong or out of memory.
+ */
+int bulk_check_run(unsigned long num_keys, int max_threads);
+
+#endif /* _BULK_CHECK_H */
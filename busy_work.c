@@ -0,0 +1,95 @@
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+#include <linux/printk.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/cache.h>
+#include <linux/delay.h>
+#include <linux/timex.h>
+#include <asm/processor.h>
+#include "busy_work.h"
+
+/* One buffer per thread, or every slot pointing to the shared one */
+static char **buffers;
+static char *shared_buffer;
+static int num_buffers;
+/* Without a cycle counter, cycles are spent as nanoseconds of ndelay */
+static bool use_ndelay;
+
+int busy_work_init(int num_threads, unsigned int max_lines, bool shared)
+{
+	size_t size = (size_t)max_lines * L1_CACHE_BYTES;
+	int i;
+
+	use_ndelay = !get_cycles();
+	if(use_ndelay)
+		pr_warn("No cycle counter, busy work cycles are spent as nanoseconds\n");
+
+	buffers = kcalloc(num_threads, sizeof(*buffers), GFP_KERNEL);
+	if(!buffers)
+		goto fail;
+	num_buffers = num_threads;
+	if(!max_lines)
+		return 0;
+
+	if(shared){
+		shared_buffer = vzalloc(size);
+		if(!shared_buffer)
+			goto fail;
+		for(i=0;i<num_threads;i++)
+			buffers[i] = shared_buffer;
+		return 0;
+	}
+	for(i=0;i<num_threads;i++){
+		buffers[i] = vzalloc(size);
+		if(!buffers[i])
+			goto fail;
+	}
+	return 0;
+
+fail:
+	pr_err("Could not allocate busy work buffers\n");
+	busy_work_exit();
+	return -1;
+}
+
+void busy_work_exit(void)
+{
+	int i;
+
+	if(shared_buffer)
+		vfree(shared_buffer);
+	else if(buffers)
+		for(i=0;i<num_buffers;i++)
+			vfree(buffers[i]);
+	kfree(buffers);
+	buffers = NULL;
+	shared_buffer = NULL;
+	num_buffers = 0;
+}
+
+static void spin_cycles(unsigned long cycles)
+{
+	cycles_t start;
+
+	if(use_ndelay){
+		ndelay(cycles);
+		return;
+	}
+	start = get_cycles();
+	while(get_cycles() - start < cycles)
+		cpu_relax();
+}
+
+void busy_work_run(int id, const struct busy_work *w)
+{
+	char *buf = buffers[id];
+	unsigned int i;
+
+	/* Read-modify-write, so shared lines move between CPUs */
+	for(i=0;i<w->lines;i++){
+		char *line = buf + (size_t)i * L1_CACHE_BYTES;
+		WRITE_ONCE(*line, READ_ONCE(*line) + 1);
+	}
+	if(w->cycles)
+		spin_cycles(w->cycles);
+}
@@ -0,0 +1,28 @@
+#ifndef _BUSY_WORK_H
+#define _BUSY_WORK_H
+
+#include <linux/types.h>
+
+/*
+ * Calibrated busy work, injected inside the critical
+ * section and between operations to model the work a
+ * real service does around its index operations. A unit
+ * of work spins for a number of cycles and touches a
+ * number of cache lines, either of a buffer private to
+ * the thread or of one buffer shared by all threads.
+ */
+struct busy_work {
+	unsigned long cycles;
+	unsigned int lines;
+};
+
+static inline bool busy_work_empty(const struct busy_work *w)
+{
+	return !w->cycles && !w->lines;
+}
+
+int busy_work_init(int num_threads, unsigned int max_lines, bool shared);
+void busy_work_exit(void);
+void busy_work_run(int id, const struct busy_work *w);
+
+#endif /* _BUSY_WORK_H */
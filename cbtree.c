@@ -1,7 +1,19 @@
 #include <linux/kernel.h>
 #include <linux/slab.h>
 #include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/log2.h>
+#include <linux/prefetch.h>
+#include <linux/percpu.h>
+#include <linux/irqflags.h>
+#include <linux/err.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
 #include "cbtree.h"
+#include "lock_tree_trace.h"
 
 #define assert(s) BUG_ON(!(s))
 
@@ -16,21 +28,49 @@
 
 enum { INPLACE = 1 };
 
-typedef uintptr_t k_t;
+typedef u64 k_t;
 
 typedef struct cb_kv kv_t;
 
+/*
+ * jmal: Node layouts. By default the original field order,
+ * aligned as the slab sees fit. CB_COMPACT_NODE (make
+ * CB_COMPACT=1) puts everything a search reads, children,
+ * key and prefix, in the first 32 bytes of a cache line
+ * aligned node, narrows size to 32 bits (trees of up to 4G
+ * nodes) and moves it behind the value with the rcu_head.
+ * The rcu_head cannot overlay the hot fields, a retired node
+ * stays readable until its grace period ends.
+ */
+#ifdef CB_COMPACT_NODE
+struct TreeBB_Node
+{
+        SHARED(struct TreeBB_Node *, left);
+        SHARED(struct TreeBB_Node *, right);
+
+        kv_t kv;
+
+        SHARED(u32, size);
+
+        struct rcu_head rcu;
+} ____cacheline_aligned;
+
+#define NODE_CACHE_FLAGS	(SLAB_PANIC | SLAB_HWCACHE_ALIGN)
+#else
 struct TreeBB_Node
 {
         SHARED(struct TreeBB_Node *, left);
         SHARED(struct TreeBB_Node *, right);
-        SHARED(unsigned int, size);
+        SHARED(unsigned long, size);
 
         kv_t kv;
 
         struct rcu_head rcu;
 };
 
+#define NODE_CACHE_FLAGS	SLAB_PANIC
+#endif
+
 typedef struct TreeBB_Node node_t;
 
 static inline node_t*
@@ -45,6 +85,30 @@ nodeOf(kv_t *kv)
 
 static struct kmem_cache *node_cache;
 
+/*
+ * jmal: Bound on the depth of any walk that keeps its path.
+ * A weight balanced tree with WEIGHT 4 has height at most
+ * log_{5/4}(n). Nodes take at least 32 bytes, so no more than
+ * 2^(BITS_PER_LONG - 5) of them fit in the address space, and
+ * 28/9 is just above 1/log2(5/4): 184 on 64-bit, 85 on 32-bit.
+ */
+enum { MAX_DEPTH = (BITS_PER_LONG - 5) * 28 / 9 + 1 };
+
+/*
+ * jmal: Path of the iterative updates, one per CPU instead
+ * of on the kernel stack of every writer. An update keeps
+ * its CPU's with preemption off, nothing it does sleeps
+ * since nodes come from the magazines or GFP_ATOMIC. If it
+ * cannot be allocated updates take the recursive path.
+ */
+struct updatePath
+{
+        node_t *nodes[MAX_DEPTH];
+        u8 dir[MAX_DEPTH];
+};
+
+static struct updatePath __percpu *updatePaths;
+
 /*
  * jmal: Changes to adapt to loadable
  * module: remove __init macro and core_initcall,
@@ -55,17 +119,68 @@ static struct kmem_cache *node_cache;
  * calls
  */
 
+/*
+ * jmal: Per-CPU node magazines. Writers take nodes from
+ * their CPU's magazine instead of the slab, nodes coming
+ * back from their grace period go to the magazine of the
+ * CPU running the callback, and TreeBB_Refill() tops the
+ * magazine up from the slab before a writer takes its lock,
+ * so allocations under the lock rarely reach the allocator.
+ * Magazines are touched with interrupts off, RCU callbacks
+ * may run from softirq on the same CPU.
+ */
+enum { MAG_SIZE = 64, MAG_LOW = 16 };
+
+struct magazine
+{
+        unsigned int count;
+        node_t *nodes[MAG_SIZE];
+        struct cb_mag_stats stats;
+};
+
+static bool useMagazines;
+static struct magazine __percpu *magazines;
+
+void
+TreeBB_SetMagazines(bool on)
+{
+        useMagazines = on;
+}
+
 int 
 TreeBBInit(void)
 {
         node_cache = kmem_cache_create("struct TreeBB_Node",
-                                       sizeof(node_t), 0, SLAB_PANIC, NULL);
+                                       sizeof(node_t), 0, NODE_CACHE_FLAGS, NULL);
+        // MAX_DEPTH relies on it
+        BUILD_BUG_ON(sizeof(node_t) < 32);
+        updatePaths = alloc_percpu(struct updatePath);
+        // Without magazines every node comes from the slab
+        if (useMagazines)
+                magazines = alloc_percpu(struct magazine);
         return 0;
 }
 
 static node_t *
 TreeBBNewNode(void)
 {
+        struct magazine *mag;
+        node_t *node = NULL;
+        unsigned long flags;
+
+        if (magazines) {
+                local_irq_save(flags);
+                mag = this_cpu_ptr(magazines);
+                if (mag->count) {
+                        node = mag->nodes[--mag->count];
+                        mag->stats.hits++;
+                } else {
+                        mag->stats.misses++;
+                }
+                local_irq_restore(flags);
+                if (node)
+                        return node;
+        }
         return kmem_cache_alloc(node_cache, GFP_ATOMIC);
 }
 
@@ -73,22 +188,223 @@ static void
 __TreeBBFreeNode(struct rcu_head *rcu)
 {
         node_t *n = container_of(rcu, node_t, rcu);
+        struct magazine *mag;
+        unsigned long flags;
+
+        if (magazines) {
+                local_irq_save(flags);
+                mag = this_cpu_ptr(magazines);
+                if (mag->count < MAG_SIZE) {
+                        mag->nodes[mag->count++] = n;
+                        mag->stats.recycled++;
+                        n = NULL;
+                } else {
+                        mag->stats.overflows++;
+                }
+                local_irq_restore(flags);
+                if (!n)
+                        return;
+        }
         kmem_cache_free(node_cache, n);
 }
 
+/*
+ * Allocations happen with no lock held, so they may sleep,
+ * and the magazine is only touched to hand the batch over.
+ * The writer may have moved to another CPU in between,
+ * whatever does not fit there goes back to the slab.
+ */
+void
+TreeBB_Refill(void)
+{
+        node_t *batch[MAG_SIZE];
+        struct magazine *mag;
+        unsigned long flags;
+        int want, got, i;
+
+        if (!magazines)
+                return;
+        want = MAG_SIZE - READ_ONCE(raw_cpu_ptr(magazines)->count);
+        if (want <= MAG_SIZE - MAG_LOW)
+                return;
+        for (got = 0; got < want; got++) {
+                batch[got] = kmem_cache_alloc(node_cache, GFP_KERNEL);
+                if (!batch[got])
+                        break;
+        }
+
+        local_irq_save(flags);
+        mag = this_cpu_ptr(magazines);
+        for (i = 0; i < got && mag->count < MAG_SIZE; i++)
+                mag->nodes[mag->count++] = batch[i];
+        mag->stats.refills++;
+        mag->stats.refilled += i;
+        local_irq_restore(flags);
+        for (; i < got; i++)
+                kmem_cache_free(node_cache, batch[i]);
+}
+
+void
+TreeBB_MagazineStats(struct cb_mag_stats *stats)
+{
+        struct cb_mag_stats *s;
+        int cpu;
+
+        memset(stats, 0, sizeof(*stats));
+        if (!magazines)
+                return;
+        for_each_possible_cpu(cpu) {
+                s = &per_cpu_ptr(magazines, cpu)->stats;
+                stats->hits += READ_ONCE(s->hits);
+                stats->misses += READ_ONCE(s->misses);
+                stats->refills += READ_ONCE(s->refills);
+                stats->refilled += READ_ONCE(s->refilled);
+                stats->recycled += READ_ONCE(s->recycled);
+                stats->overflows += READ_ONCE(s->overflows);
+        }
+}
+
+/* Only once no callback can refill them, after an rcu_barrier() */
+static void
+drainMagazines(void)
+{
+        struct magazine *mag;
+        int cpu;
+
+        if (!magazines)
+                return;
+        for_each_possible_cpu(cpu) {
+                mag = per_cpu_ptr(magazines, cpu);
+                while (mag->count)
+                        kmem_cache_free(node_cache, mag->nodes[--mag->count]);
+        }
+        free_percpu(magazines);
+        magazines = NULL;
+}
+
+/*
+ * jmal: Persistent mode and snapshots. With persistent set
+ * (before cb_init) updates always copy the path instead of
+ * rewriting one pointer in place, so every version of the
+ * tree stays whole as long as the nodes it uses do. Nodes an
+ * update replaces wait on pending until the new root is
+ * published, then go to the limbo of the newest snapshot,
+ * or to call_rcu() when none is taken. A released snapshot
+ * hands its limbo to the next older one, the oldest to
+ * call_rcu(), so nothing is freed while a snapshot that
+ * may reach it is around. Snapshots of all trees share one
+ * list, which only makes them keep more than they need.
+ */
+static bool persistent;
+/* Writers are serialized, but the union kthreads all make nodes */
+static struct cb_copy_stats copyStats;
+static DEFINE_PER_CPU(unsigned long, copyNodes);
+static DEFINE_SPINLOCK(snapLock);
+/* Oldest first */
+static LIST_HEAD(snapshots);
+/* Retired by the update in progress, writers are serialized */
+static struct rcu_head *pendingHead, *pendingLast;
+static unsigned long pendingCount;
+
+void
+TreeBB_SetPersistent(bool on)
+{
+        persistent = on;
+}
+
+static inline bool
+updateInPlace(void)
+{
+        return INPLACE && !persistent;
+}
+
+/* Queues head, func keeps its callback until it is handed to call_rcu() */
+static void
+limboPush(struct rcu_head **head, struct rcu_head **last,
+          struct rcu_head *first, struct rcu_head *tail)
+{
+        tail->next = *head;
+        if (!*head)
+                *last = tail;
+        *head = first;
+}
+
+static void
+limboFree(struct rcu_head *head)
+{
+        struct rcu_head *next;
+
+        for (; head; head = next) {
+                next = head->next;
+                call_rcu(head, head->func);
+        }
+}
+
 static void
 TreeBBFreeNode(node_t *n)
 {
+        if (persistent) {
+                n->rcu.func = __TreeBBFreeNode;
+                limboPush(&pendingHead, &pendingLast, &n->rcu, &n->rcu);
+                pendingCount++;
+                return;
+        }
         call_rcu(&n->rcu, __TreeBBFreeNode);
 }
 
+/* After every publication of a new root in persistent mode */
+static void
+publishVersion(struct cb_root *tree)
+{
+        struct cb_snapshot *newest;
+        struct rcu_head *head = pendingHead;
+
+        if (!persistent)
+                return;
+        WRITE_ONCE(tree->version, tree->version + 1);
+        if (!head)
+                return;
+        spin_lock(&snapLock);
+        if (!list_empty(&snapshots)) {
+                newest = list_last_entry(&snapshots, struct cb_snapshot, list);
+                limboPush(&newest->limbo, &newest->limboLast, head, pendingLast);
+                copyStats.retained += pendingCount;
+                head = NULL;
+        }
+        spin_unlock(&snapLock);
+        pendingHead = NULL;
+        pendingCount = 0;
+        limboFree(head);
+}
+
 /******************************************************************
  * Tree algorithms
  */
 
 enum { WEIGHT = 4 };
 
+/*
+ * jmal: Order of (key, prefix) against a node's key,
+ * cached prefixes settle most comparisons without
+ * calling the comparator
+ */
 static inline int
+keyCmp(struct cb_root *tree, k_t key, u64 prefix, kv_t *kv)
+{
+        if (tree->prefix && prefix != kv->prefix)
+                return prefix < kv->prefix ? -1 : 1;
+        if (tree->cmp)
+                return tree->cmp(key, kv->key);
+        return key < kv->key ? -1 : key > kv->key;
+}
+
+static inline u64
+keyPrefix(struct cb_root *tree, k_t key)
+{
+        return tree->prefix ? tree->prefix(key) : 0;
+}
+
+static inline unsigned long
 nodeSize(node_t *node)
 {
         return node ? GET(node->size) : 0;
@@ -98,6 +414,7 @@ static inline node_t *
 mkNode(node_t *left, node_t *right, kv_t *kv)
 {
         node_t *node = TreeBBNewNode();
+        this_cpu_inc(copyNodes);
         SET(node->left, left);
         SET(node->right, right);
         SET(node->size, 1 + nodeSize(left) + nodeSize(right));
@@ -111,6 +428,7 @@ singleL(node_t *left, node_t *right, kv_t *kv)
 //        printf("%s\n", __func__);
         node_t *res = mkNode(mkNode(left, GET(right->left), kv),
                              GET(right->right), &right->kv);
+        trace_cb_rotate(CB_ROTATE_SINGLE_L, kv->key);
         TreeBBFreeNode(right);
         return res;
 }
@@ -124,6 +442,7 @@ doubleL(node_t *left, node_t *right, kv_t *kv)
                                     GET(right->right),
                                     &right->kv),
                              &GET(right->left)->kv);
+        trace_cb_rotate(CB_ROTATE_DOUBLE_L, kv->key);
         TreeBBFreeNode(GET(right->left));
         TreeBBFreeNode(right);
         return res;
@@ -136,6 +455,7 @@ singleR(node_t *left, node_t *right, kv_t *kv)
         node_t *res = mkNode(GET(left->left),
                              mkNode(GET(left->right), right, kv),
                              &left->kv);
+        trace_cb_rotate(CB_ROTATE_SINGLE_R, kv->key);
         TreeBBFreeNode(left);
         return res;
 }
@@ -149,6 +469,7 @@ doubleR(node_t *left, node_t *right, kv_t *kv)
                                     &left->kv),
                              mkNode(GET(GET(left->right)->right), right, kv),
                              &GET(left->right)->kv);
+        trace_cb_rotate(CB_ROTATE_DOUBLE_R, kv->key);
         TreeBBFreeNode(GET(left->right));
         TreeBBFreeNode(left);
         return res;
@@ -157,7 +478,7 @@ doubleR(node_t *left, node_t *right, kv_t *kv)
 static node_t *
 mkBalancedL(node_t *left, node_t *right, kv_t *kv)
 {
-        int rln = nodeSize(GET(right->left)),
+        unsigned long rln = nodeSize(GET(right->left)),
                 rrn = nodeSize(GET(right->right));
         if (rln < rrn)
                 return singleL(left, right, kv);
@@ -167,7 +488,7 @@ mkBalancedL(node_t *left, node_t *right, kv_t *kv)
 static node_t *
 mkBalancedR(node_t *left, node_t *right, kv_t *kv)
 {
-        int lln = nodeSize(GET(left->left)),
+        unsigned long lln = nodeSize(GET(left->left)),
                 lrn = nodeSize(GET(left->right));
         if (lrn < lln)
                 return singleR(left, right, kv);
@@ -192,7 +513,7 @@ mkBalancedR(node_t *left, node_t *right, kv_t *kv)
 static inline node_t *
 mkBalanced(node_t *cur, node_t *left, node_t *right, int replace, bool inPlace)
 {
-        int ln = nodeSize(left), rn = nodeSize(right);
+        unsigned long ln = nodeSize(left), rn = nodeSize(right);
         kv_t *kv = &cur->kv;
         node_t *res;
 
@@ -213,7 +534,8 @@ balanced:
                 // When updating in-place, we only ever modify one of
                 // the two pointers as our visible write.  We also
                 // modify the size, but this is okay because size is
-                // never in a reader's read set.
+                // never in a reader's read set (other than the order
+                // statistics, which tolerate it).
                 if (replace == 0) {
                         assert(GET(cur->right) == right);
                         // XXX rcu_assign_pointer
@@ -235,8 +557,10 @@ balanced:
 }
 
 static node_t *
-insert(node_t *node, kv_t *kv)
+insertRec(struct cb_root *tree, node_t *node, kv_t *kv)
 {
+        int c;
+
         if (!node)
                 return mkNode(NULL, NULL, kv);
 
@@ -251,26 +575,113 @@ insert(node_t *node, kv_t *kv)
         // delayed updates to the size fields combined with competing
         // writers might result in tree imbalance.
 
-        if (kv->key < node->kv.key)
-                return mkBalanced(node, insert(GET(node->left), kv),
-                                  GET(node->right), 0, INPLACE);
-        if (kv->key > node->kv.key)
+        c = keyCmp(tree, kv->key, kv->prefix, &node->kv);
+        if (c < 0)
+                return mkBalanced(node, insertRec(tree, GET(node->left), kv),
+                                  GET(node->right), 0, updateInPlace());
+        if (c > 0)
                 return mkBalanced(node, GET(node->left),
-                                  insert(GET(node->right), kv),
-                                  1, INPLACE);
+                                  insertRec(tree, GET(node->right), kv),
+                                  1, updateInPlace());
         return node;
 }
 
+/*
+ * jmal: Iterative versions of the updates. The descent
+ * records the path in the CPU's updatePath and the
+ * rebalance walks it back bottom-up, making the same
+ * mkBalanced() calls as the recursion would.
+ */
+static bool recursive;
+
+void
+TreeBB_SetRecursive(bool on)
+{
+        recursive = on;
+}
+
+/*
+ * jmal: Optional software prefetch of both children
+ * during lookups, so the next level's line is on its
+ * way while the current key is compared
+ */
+static bool prefetching;
+
 void
-TreeBB_Insert(struct cb_root *tree, uintptr_t key, void *value)
+TreeBB_SetPrefetch(bool on)
 {
-        kv_t kv = {key, value};
-        node_t *nroot = insert(tree->root, &kv);
+        prefetching = on;
+}
+
+static inline void
+prefetchChildren(node_t *node)
+{
+        if (prefetching) {
+                prefetch(GET(node->left));
+                prefetch(GET(node->right));
+        }
+}
+
+static node_t *
+insertIter(struct cb_root *tree, node_t *root, kv_t *kv,
+           struct updatePath *up)
+{
+        node_t **path = up->nodes;
+        u8 *dir = up->dir;
+        node_t *node = root, *sub;
+        int depth = 0, c;
+
+        while (node) {
+                c = keyCmp(tree, kv->key, kv->prefix, &node->kv);
+                // Already present, nothing below us changed so
+                // the recursion's rebalance would be a no-op
+                if (c == 0)
+                        return root;
+                BUG_ON(depth == MAX_DEPTH);
+                path[depth] = node;
+                dir[depth++] = c > 0;
+                node = c < 0 ? GET(node->left) : GET(node->right);
+        }
+
+        sub = mkNode(NULL, NULL, kv);
+        while (depth--) {
+                node = path[depth];
+                if (dir[depth])
+                        sub = mkBalanced(node, GET(node->left), sub, 1,
+                                         updateInPlace());
+                else
+                        sub = mkBalanced(node, sub, GET(node->right), 0,
+                                         updateInPlace());
+        }
+        return sub;
+}
+
+/*
+ * jmal: Report whether the key was actually inserted,
+ * the tree grows by exactly one node if it was
+ */
+int
+TreeBB_Insert(struct cb_root *tree, u64 key, void *value)
+{
+        kv_t kv = {.key = key, .prefix = keyPrefix(tree, key), .value = value};
+        unsigned long before = nodeSize(tree->root);
+        node_t *nroot;
+
+        if (recursive || !updatePaths) {
+                nroot = insertRec(tree, tree->root, &kv);
+        } else {
+                nroot = insertIter(tree, tree->root, &kv,
+                                   get_cpu_ptr(updatePaths));
+                put_cpu_ptr(updatePaths);
+        }
         rcu_assign_pointer(tree->root, nroot);
+        copyStats.updates++;
+        publishVersion(tree);
+        return nodeSize(nroot) > before ? 0 : -1;
 }
 
 static node_t *
-deleteMin(node_t *node, node_t **minOut)
+deleteMinRec(node_t *node, node_t **minOut)
 {
         node_t *left = GET(node->left), *right = GET(node->right);
         if (!left) {
@@ -284,13 +695,35 @@ deleteMin(node_t *node, node_t **minOut)
         // walking between the element being replaced and the min
         // element being removed, which means we must keep this min
         // element visible.)
-        return mkBalanced(node, deleteMin(left, minOut), right, 0, false);
+        return mkBalanced(node, deleteMinRec(left, minOut), right, 0, false);
 }
 
+/* Iterative deleteMin, path holds the ancestors above node */
 static node_t *
-delete(node_t *node, k_t key, void **deleted)
+deleteMinIter(node_t *node, node_t **minOut, node_t **path, int depth)
+{
+        int top = depth;
+        node_t *sub;
+
+        while (GET(node->left)) {
+                BUG_ON(depth == MAX_DEPTH);
+                path[depth++] = node;
+                node = GET(node->left);
+        }
+        *minOut = node;
+        sub = GET(node->right);
+        // Non-destructive, as in the recursive version
+        while (depth-- > top)
+                sub = mkBalanced(path[depth], sub, GET(path[depth]->right),
+                                 0, false);
+        return sub;
+}
+
+static node_t *
+deleteRec(struct cb_root *tree, node_t *node, k_t key, u64 prefix, void **deleted)
 {
         node_t *min, *left, *right;
+        int c;
 
         if (!node) {
                 *deleted = NULL;
@@ -299,10 +732,14 @@ delete(node_t *node, k_t key, void **deleted)
 
         left = GET(node->left);
         right = GET(node->right);
-        if (key < node->kv.key)
-                return mkBalanced(node, delete(left, key, deleted), right, 0, INPLACE);
-        if (key > node->kv.key)
-                return mkBalanced(node, left, delete(right, key, deleted), 1, INPLACE);
+        c = keyCmp(tree, key, prefix, &node->kv);
+        if (c < 0)
+                return mkBalanced(node, deleteRec(tree, left, key, prefix, deleted),
+                                  right, 0, updateInPlace());
+        if (c > 0)
+                return mkBalanced(node, left,
+                                  deleteRec(tree, right, key, prefix, deleted),
+                                  1, updateInPlace());
 
         // We found our node to delete
         *deleted = node->kv.value;
@@ -311,7 +748,7 @@ delete(node_t *node, k_t key, void **deleted)
                 return right;
         if (!right)
                 return left;
-        right = deleteMin(right, &min);
+        right = deleteMinRec(right, &min);
         // This needs to be performed non-destructively because the
         // min element is still linked in to the tree below us.  Thus,
         // we need to create a new min element here, which will be
@@ -320,25 +757,91 @@ delete(node_t *node, k_t key, void **deleted)
         return mkBalanced(min, left, right, 1, false);
 }
 
+static node_t *
+deleteIter(struct cb_root *tree, node_t *root, k_t key, void **deleted,
+           struct updatePath *up)
+{
+        node_t **path = up->nodes;
+        u8 *dir = up->dir;
+        node_t *node = root, *min, *left, *right, *sub;
+        u64 prefix = keyPrefix(tree, key);
+        int depth = 0, c;
+
+        while (node) {
+                c = keyCmp(tree, key, prefix, &node->kv);
+                if (c == 0)
+                        break;
+                BUG_ON(depth == MAX_DEPTH);
+                path[depth] = node;
+                dir[depth++] = c > 0;
+                node = c < 0 ? GET(node->left) : GET(node->right);
+        }
+        if (!node) {
+                *deleted = NULL;
+                return root;
+        }
+
+        // We found our node to delete
+        left = GET(node->left);
+        right = GET(node->right);
+        *deleted = node->kv.value;
+        TreeBBFreeNode(node);
+        if (!left) {
+                sub = right;
+        } else if (!right) {
+                sub = left;
+        } else {
+                // The min search continues on the same path array
+                right = deleteMinIter(right, &min, path, depth);
+                sub = mkBalanced(min, left, right, 1, false);
+        }
+
+        while (depth--) {
+                node = path[depth];
+                if (dir[depth])
+                        sub = mkBalanced(node, GET(node->left), sub, 1,
+                                         updateInPlace());
+                else
+                        sub = mkBalanced(node, sub, GET(node->right), 0,
+                                         updateInPlace());
+        }
+        return sub;
+}
+
 void *
-TreeBB_Delete(struct cb_root *tree, uintptr_t key)
+TreeBB_Delete(struct cb_root *tree, u64 key)
 {
         void *deleted;
-        node_t *nroot = delete(tree->root, key, &deleted);
+        node_t *nroot;
+
+        if (recursive || !updatePaths) {
+                nroot = deleteRec(tree, tree->root, key, keyPrefix(tree, key),
+                                  &deleted);
+        } else {
+                nroot = deleteIter(tree, tree->root, key, &deleted,
+                                   get_cpu_ptr(updatePaths));
+                put_cpu_ptr(updatePaths);
+        }
         rcu_assign_pointer(tree->root, nroot);
+        copyStats.updates++;
+        publishVersion(tree);
         return deleted;
 }
 
 struct cb_kv *
-TreeBB_Find(struct cb_root *tree, uintptr_t needle)
+TreeBB_Find(struct cb_root *tree, u64 needle)
 {
         node_t *node;
+        u64 prefix = keyPrefix(tree, needle);
+        int c;
 
         node = tree->root;
         while (node) {
-                if (node->kv.key == needle)
+                prefetchChildren(node);
+                c = keyCmp(tree, needle, prefix, &node->kv);
+                if (c == 0)
                         break;
-                else if (node->kv.key > needle)
+                else if (c < 0)
                         node = GET(node->left);
                 else
                         node = GET(node->right);
@@ -347,13 +850,15 @@ TreeBB_Find(struct cb_root *tree, uintptr_t needle)
 }
 
 struct cb_kv *
-TreeBB_FindGT(struct cb_root *tree, uintptr_t needle)
+TreeBB_FindGT(struct cb_root *tree, u64 needle)
 {
         node_t *node = tree->root;
         node_t *res = NULL;
+        u64 prefix = keyPrefix(tree, needle);
 
         while (node) {
-                if (node->kv.key > needle) {
+                prefetchChildren(node);
+                if (keyCmp(tree, needle, prefix, &node->kv) < 0) {
                         res = node;
                         node = GET(node->left);
                 } else {
@@ -364,16 +869,20 @@ TreeBB_FindGT(struct cb_root *tree, uintptr_t needle)
 }
 
 struct cb_kv *
-TreeBB_FindLE(struct cb_root *tree, uintptr_t needle)
+TreeBB_FindLE(struct cb_root *tree, u64 needle)
 {
         node_t *node = tree->root;
         node_t *res = NULL;
+        u64 prefix = keyPrefix(tree, needle);
+        int c;
 
         while (node) {
-                if (node->kv.key == needle)
+                prefetchChildren(node);
+                c = keyCmp(tree, needle, prefix, &node->kv);
+                if (c == 0)
                         return &node->kv;
 
-                if (node->kv.key > needle) {
+                if (c < 0) {
                         node = GET(node->left);
                 } else {
                         res = node;
@@ -383,20 +892,656 @@ TreeBB_FindLE(struct cb_root *tree, uintptr_t needle)
         return res ? &res->kv : NULL;
 }
 
+/*
+ * jmal: Order statistics on the subtree sizes the weight
+ * balancing already keeps, O(log n) and lockless like Find.
+ * Sizes are updated in place after the child pointers, so
+ * with concurrent writers the results may mix versions of
+ * the tree, they are exact while there are none.
+ */
+
+/* Number of keys below needle, or up to it when inclusive */
+static unsigned long
+countBelow(struct cb_root *tree, k_t needle, bool inclusive)
+{
+        node_t *node = tree->root;
+        u64 prefix = keyPrefix(tree, needle);
+        unsigned long count = 0;
+        int c;
+
+        while (node) {
+                c = keyCmp(tree, needle, prefix, &node->kv);
+                if (c < 0) {
+                        node = GET(node->left);
+                        continue;
+                }
+                if (c == 0) {
+                        count += nodeSize(GET(node->left));
+                        if (inclusive)
+                                count++;
+                        break;
+                }
+                count += nodeSize(GET(node->left)) + 1;
+                node = GET(node->right);
+        }
+        return count;
+}
+
+unsigned long
+TreeBB_Rank(struct cb_root *tree, u64 needle)
+{
+        return countBelow(tree, needle, false);
+}
+
+struct cb_kv *
+TreeBB_Select(struct cb_root *tree, unsigned long k)
+{
+        node_t *node = tree->root;
+        unsigned long ln;
+
+        while (node) {
+                ln = nodeSize(GET(node->left));
+                if (k == ln)
+                        return &node->kv;
+                if (k < ln) {
+                        node = GET(node->left);
+                } else {
+                        k -= ln + 1;
+                        node = GET(node->right);
+                }
+        }
+        return NULL;
+}
+
+unsigned long
+TreeBB_CountRange(struct cb_root *tree, u64 lo, u64 hi)
+{
+        unsigned long below = countBelow(tree, lo, false);
+        unsigned long upto = countBelow(tree, hi, true);
+
+        // Empty for lo > hi, or when racing writers skew the two walks
+        return upto > below ? upto - below : 0;
+}
+
+/*
+ * jmal: Join based bulk operations. They never write to a
+ * node a reader can reach, the result is built from new
+ * nodes and untouched subtrees of the inputs and published
+ * with one rcu_assign_pointer() per tree. Nodes the result
+ * no longer uses are kept on lists (linked through their
+ * rcu_head) and only handed to call_rcu() after publication,
+ * so readers of the old version can still walk them.
+ * Dropped nodes also lose their key-value pair, which the
+ * caller's destroyer gets after publication as well.
+ */
+struct nodeList
+{
+        struct rcu_head *head, *last;
+};
+
+struct bulk
+{
+        struct nodeList retired;
+        struct nodeList dropped;
+};
+
+static void
+listPush(struct nodeList *l, node_t *node)
+{
+        node->rcu.next = l->head;
+        if (!l->head)
+                l->last = &node->rcu;
+        l->head = &node->rcu;
+}
+
+static void
+listSplice(struct nodeList *l, struct nodeList *from)
+{
+        if (!from->head)
+                return;
+        from->last->next = l->head;
+        if (!l->head)
+                l->last = from->last;
+        l->head = from->head;
+}
+
 static void
-foreach(node_t *node, void (*cb)(struct cb_kv *))
+bulkRetire(struct bulk *b, node_t *node)
+{
+        listPush(&b->retired, node);
+}
+
+static void
+bulkFlush(struct cb_root *tree, struct bulk *b,
+          void (*kv_destroyer)(struct cb_kv *))
+{
+        struct rcu_head *rcu, *next;
+
+        for (rcu = b->dropped.head; rcu; rcu = next) {
+                next = rcu->next;
+                if (kv_destroyer != NULL)
+                        kv_destroyer(&container_of(rcu, node_t, rcu)->kv);
+                TreeBBFreeNode(container_of(rcu, node_t, rcu));
+        }
+        for (rcu = b->retired.head; rcu; rcu = next) {
+                next = rcu->next;
+                TreeBBFreeNode(container_of(rcu, node_t, rcu));
+        }
+        copyStats.updates++;
+        publishVersion(tree);
+}
+
+/*
+ * New node for kv over left and right, with at most one
+ * single or double rotation, as mkBalanced but without
+ * touching or freeing anything before publication
+ */
+static node_t *
+bulkBalanced(struct bulk *b, node_t *left, node_t *right, kv_t *kv)
+{
+        unsigned long ln = nodeSize(left), rn = nodeSize(right);
+        node_t *rl, *lr;
+
+        if (ln + rn >= 2 && rn > WEIGHT * ln) {
+                rl = GET(right->left);
+                bulkRetire(b, right);
+                if (nodeSize(rl) < nodeSize(GET(right->right)))
+                        return mkNode(mkNode(left, rl, kv),
+                                      GET(right->right), &right->kv);
+                bulkRetire(b, rl);
+                return mkNode(mkNode(left, GET(rl->left), kv),
+                              mkNode(GET(rl->right), GET(right->right),
+                                     &right->kv),
+                              &rl->kv);
+        }
+        if (ln + rn >= 2 && ln > WEIGHT * rn) {
+                lr = GET(left->right);
+                bulkRetire(b, left);
+                if (nodeSize(lr) < nodeSize(GET(left->left)))
+                        return mkNode(GET(left->left),
+                                      mkNode(lr, right, kv), &left->kv);
+                bulkRetire(b, lr);
+                return mkNode(mkNode(GET(left->left), GET(lr->left),
+                                     &left->kv),
+                              mkNode(GET(lr->right), right, kv),
+                              &lr->kv);
+        }
+        return mkNode(left, right, kv);
+}
+
+/*
+ * Join left, kv and right, every key of left below kv's and
+ * every key of right above it. The heavier side is descended
+ * along its inner spine until the sizes are within WEIGHT,
+ * rebalancing on the way back up.
+ */
+static node_t *
+joinRec(struct bulk *b, node_t *left, kv_t *kv, node_t *right)
+{
+        unsigned long ln = nodeSize(left), rn = nodeSize(right);
+        node_t *sub;
+
+        if (ln + rn >= 2 && rn > WEIGHT * ln) {
+                bulkRetire(b, right);
+                sub = joinRec(b, left, kv, GET(right->left));
+                return bulkBalanced(b, sub, GET(right->right), &right->kv);
+        }
+        if (ln + rn >= 2 && ln > WEIGHT * rn) {
+                bulkRetire(b, left);
+                sub = joinRec(b, GET(left->right), kv, right);
+                return bulkBalanced(b, GET(left->left), sub, &left->kv);
+        }
+        return mkNode(left, right, kv);
+}
+
+/*
+ * Split node into the keys below key, returned, and
+ * those above it, in *right. A node holding key itself
+ * is left to the caller through *found, unretired.
+ */
+static node_t *
+splitRec(struct bulk *b, struct cb_root *tree, node_t *node, k_t key,
+         u64 prefix, node_t **right, node_t **found)
+{
+        node_t *left;
+        int c;
+
+        if (!node) {
+                *right = NULL;
+                return NULL;
+        }
+        c = keyCmp(tree, key, prefix, &node->kv);
+        if (c == 0) {
+                *found = node;
+                *right = GET(node->right);
+                return GET(node->left);
+        }
+        bulkRetire(b, node);
+        if (c < 0) {
+                left = splitRec(b, tree, GET(node->left), key, prefix,
+                                right, found);
+                *right = joinRec(b, *right, &node->kv, GET(node->right));
+                return left;
+        }
+        left = splitRec(b, tree, GET(node->right), key, prefix, right, found);
+        return joinRec(b, GET(node->left), &node->kv, left);
+}
+
+/* Node without its maximum, whose node goes to *last, unretired */
+static node_t *
+splitLast(struct bulk *b, node_t *node, node_t **last)
+{
+        node_t *sub;
+
+        if (!GET(node->right)) {
+                *last = node;
+                return GET(node->left);
+        }
+        bulkRetire(b, node);
+        sub = splitLast(b, GET(node->right), last);
+        return joinRec(b, GET(node->left), &node->kv, sub);
+}
+
+/* Join without a middle key, the maximum of left is pulled up */
+static node_t *
+join2(struct bulk *b, node_t *left, node_t *right)
+{
+        node_t *last;
+
+        if (!left)
+                return right;
+        left = splitLast(b, left, &last);
+        bulkRetire(b, last);
+        return joinRec(b, left, &last->kv, right);
+}
+
+/*
+ * Union of t1 and t2. Keys present in both keep t1's
+ * pair and t2's goes to the dropped list. With depth > 0
+ * the left halves are merged on a new kthread while this
+ * one merges the right halves, down to depth levels, as
+ * long as they hold UNION_FORK_MIN keys between them.
+ *
+ * The recursion follows t2 down, and at each level splits
+ * t1 and joins the halves back, so it nests at most as deep
+ * as the two trees' heights, which weight balance keeps
+ * within MAX_DEPTH each. A forked kthread starts on a fresh
+ * stack.
+ */
+enum { UNION_FORK_MIN = 4096, UNION_MAX_THREADS = 64 };
+
+static node_t *unionRec(struct bulk *b, struct cb_root *tree, node_t *t1,
+                        node_t *t2, int depth);
+
+struct unionJob
+{
+        struct cb_root *tree;
+        node_t *t1, *t2, *res;
+        int depth;
+        struct bulk b;
+        struct completion done;
+};
+
+static int
+unionJobFn(void *arg)
+{
+        struct unionJob *job = arg;
+
+        job->res = unionRec(&job->b, job->tree, job->t1, job->t2, job->depth);
+        complete(&job->done);
+        return 0;
+}
+
+static node_t *
+unionRec(struct bulk *b, struct cb_root *tree, node_t *t1, node_t *t2,
+         int depth)
+{
+        struct unionJob *job = NULL;
+        struct task_struct *task;
+        node_t *l1, *r1, *found = NULL, *left, *right;
+        kv_t *kv = &t2->kv;
+
+        if (!t1)
+                return t2;
+        if (!t2)
+                return t1;
+
+        l1 = splitRec(b, tree, t1, t2->kv.key, t2->kv.prefix, &r1, &found);
+        if (found) {
+                kv = &found->kv;
+                bulkRetire(b, found);
+                listPush(&b->dropped, t2);
+        } else {
+                bulkRetire(b, t2);
+        }
+
+        if (depth > 0 &&
+            nodeSize(l1) + nodeSize(GET(t2->left)) >= UNION_FORK_MIN)
+                job = kmalloc(sizeof(*job), GFP_KERNEL);
+        if (job) {
+                *job = (struct unionJob) {
+                        .tree = tree, .t1 = l1, .t2 = GET(t2->left),
+                        .depth = depth - 1,
+                };
+                init_completion(&job->done);
+                task = kthread_run(unionJobFn, job, "cb_union");
+                if (IS_ERR(task)) {
+                        kfree(job);
+                        job = NULL;
+                }
+        }
+        if (!job)
+                left = unionRec(b, tree, l1, GET(t2->left), depth - 1);
+        right = unionRec(b, tree, r1, GET(t2->right), depth - 1);
+        if (job) {
+                wait_for_completion(&job->done);
+                left = job->res;
+                listSplice(&b->retired, &job->b.retired);
+                listSplice(&b->dropped, &job->b.dropped);
+                kfree(job);
+        }
+        return joinRec(b, left, kv, right);
+}
+
+static void
+listAppend(struct nodeList *l, node_t *node)
+{
+        node->rcu.next = NULL;
+        if (l->head)
+                l->last->next = &node->rcu;
+        else
+                l->head = &node->rcu;
+        l->last = &node->rcu;
+}
+
+/*
+ * Drops every node of a detached subtree, without writing
+ * to anything but the rcu_heads. The list of dropped nodes
+ * is the breadth first work queue, so the walk takes no
+ * stack whatever the height.
+ */
+static unsigned long
+dropSubtree(struct bulk *b, node_t *node)
+{
+        struct nodeList queue = {};
+        struct rcu_head *next;
+        unsigned long dropped = nodeSize(node);
+
+        if (node)
+                listAppend(&queue, node);
+        for (next = queue.head; next; next = next->next) {
+                node = container_of(next, node_t, rcu);
+                if (GET(node->left))
+                        listAppend(&queue, GET(node->left));
+                if (GET(node->right))
+                        listAppend(&queue, GET(node->right));
+        }
+        listSplice(&b->dropped, &queue);
+        return dropped;
+}
+
+void
+TreeBB_Split(struct cb_root *tree, u64 key, struct cb_root *right)
+{
+        struct bulk b = {};
+        node_t *found = NULL, *left, *rnode;
+
+        left = splitRec(&b, tree, tree->root, key, keyPrefix(tree, key),
+                        &rnode, &found);
+        if (found) {
+                rnode = joinRec(&b, NULL, &found->kv, rnode);
+                bulkRetire(&b, found);
+        }
+        right->cmp = tree->cmp;
+        right->prefix = tree->prefix;
+        rcu_assign_pointer(right->root, rnode);
+        rcu_assign_pointer(tree->root, left);
+        bulkFlush(tree, &b, NULL);
+}
+
+int
+TreeBB_Join(struct cb_root *tree, struct cb_root *right)
+{
+        struct bulk b = {};
+        node_t *max = tree->root, *min = right->root, *nroot;
+
+        if (max && min) {
+                while (GET(max->right))
+                        max = GET(max->right);
+                while (GET(min->left))
+                        min = GET(min->left);
+                if (keyCmp(tree, min->kv.key, min->kv.prefix, &max->kv) <= 0)
+                        return -1;
+        }
+        nroot = join2(&b, tree->root, right->root);
+        rcu_assign_pointer(tree->root, nroot);
+        rcu_assign_pointer(right->root, NULL);
+        bulkFlush(tree, &b, NULL);
+        return 0;
+}
+
+unsigned long
+TreeBB_EraseRange(struct cb_root *tree, u64 lo, u64 hi,
+                  void (*kv_destroyer)(struct cb_kv *))
+{
+        struct bulk b = {};
+        kv_t loKv = {.key = lo, .prefix = keyPrefix(tree, lo)};
+        node_t *found = NULL, *left, *mid, *right, *nroot;
+        unsigned long erased = 0;
+
+        if (keyCmp(tree, hi, keyPrefix(tree, hi), &loKv) < 0)
+                return 0;
+
+        left = splitRec(&b, tree, tree->root, lo, loKv.prefix, &mid, &found);
+        if (found) {
+                listPush(&b.dropped, found);
+                erased++;
+                found = NULL;
+        }
+        mid = splitRec(&b, tree, mid, hi, keyPrefix(tree, hi), &right, &found);
+        if (found) {
+                listPush(&b.dropped, found);
+                erased++;
+        }
+        erased += dropSubtree(&b, mid);
+
+        nroot = join2(&b, left, right);
+        rcu_assign_pointer(tree->root, nroot);
+        bulkFlush(tree, &b, kv_destroyer);
+        return erased;
+}
+
+void
+TreeBB_UnionParallel(struct cb_root *tree, struct cb_root *other, int threads,
+                     void (*kv_destroyer)(struct cb_kv *))
+{
+        struct bulk b = {};
+        node_t *nroot;
+
+        threads = clamp_t(int, threads, 1, UNION_MAX_THREADS);
+        nroot = unionRec(&b, tree, tree->root, other->root, ilog2(threads));
+        rcu_assign_pointer(tree->root, nroot);
+        rcu_assign_pointer(other->root, NULL);
+        bulkFlush(tree, &b, kv_destroyer);
+}
+
+void
+TreeBB_Union(struct cb_root *tree, struct cb_root *other,
+             void (*kv_destroyer)(struct cb_kv *))
+{
+        TreeBB_UnionParallel(tree, other, 1, kv_destroyer);
+}
+
+/*
+ * jmal: Snapshot API. Taking one copies the root under
+ * snapLock, so that any update publishing after it sees it
+ * on the list. The nodes of a snapshot are never written
+ * again, its readers need no RCU read lock and may sleep.
+ */
+int
+TreeBB_Snapshot(struct cb_root *tree, struct cb_snapshot *snap)
+{
+        if (!persistent)
+                return -1;
+        snap->limbo = NULL;
+        snap->limboLast = NULL;
+        spin_lock(&snapLock);
+        snap->tree = *tree;
+        snap->tree.root = READ_ONCE(tree->root);
+        snap->version = READ_ONCE(tree->version);
+        snap->size = nodeSize(snap->tree.root);
+        list_add_tail(&snap->list, &snapshots);
+        spin_unlock(&snapLock);
+        return 0;
+}
+
+void
+TreeBB_SnapshotRelease(struct cb_snapshot *snap)
+{
+        struct cb_snapshot *older;
+        struct rcu_head *head;
+
+        spin_lock(&snapLock);
+        head = snap->limbo;
+        if (head && !list_is_first(&snap->list, &snapshots)) {
+                older = list_prev_entry(snap, list);
+                limboPush(&older->limbo, &older->limboLast, head,
+                          snap->limboLast);
+                head = NULL;
+        }
+        list_del(&snap->list);
+        spin_unlock(&snapLock);
+        limboFree(head);
+}
+
+bool
+TreeBB_SnapshotDefer(struct rcu_head *head, void (*func)(struct rcu_head *))
+{
+        struct cb_snapshot *newest;
+
+        if (!persistent)
+                return false;
+        spin_lock(&snapLock);
+        if (list_empty(&snapshots)) {
+                spin_unlock(&snapLock);
+                return false;
+        }
+        newest = list_last_entry(&snapshots, struct cb_snapshot, list);
+        head->func = func;
+        limboPush(&newest->limbo, &newest->limboLast, head, head);
+        copyStats.retained++;
+        spin_unlock(&snapLock);
+        return true;
+}
+
+void
+TreeBB_CopyStats(struct cb_copy_stats *stats)
+{
+        int cpu;
+
+        stats->updates = READ_ONCE(copyStats.updates);
+        stats->nodes = 0;
+        for_each_possible_cpu(cpu)
+                stats->nodes += READ_ONCE(per_cpu(copyNodes, cpu));
+        stats->retained = READ_ONCE(copyStats.retained);
+}
+
+/*
+ * jmal: Whole tree walks may sleep, they keep their stack of
+ * MAX_DEPTH nodes in a scratch array instead of on the
+ * kernel stack. Readers may be walking the same nodes, so
+ * the stackless rotations of destroyIter() are not an option.
+ */
+static node_t **
+walkStack(void)
+{
+        return kmalloc_array(MAX_DEPTH, sizeof(node_t *), GFP_KERNEL);
+}
+
+/*
+ * jmal: Layout report. The sum of the subtree sizes is
+ * the sum of the node depths (from 1), so it gives the
+ * average number of nodes a successful search visits.
+ * If the walk gets no memory, nodes is left 0.
+ */
+void
+TreeBB_Layout(struct cb_root *tree, struct cb_layout *layout)
+{
+        node_t **stack, *node = tree->root;
+        int depth = 0;
+
+        layout->node_size = sizeof(node_t);
+        layout->node_align = __alignof__(node_t);
+        layout->hot_bytes = offsetof(node_t, kv) + offsetof(kv_t, value);
+        layout->nodes = 0;
+        layout->path_length = 0;
+        if (!node)
+                return;
+        stack = walkStack();
+        if (!stack)
+                return;
+
+        layout->nodes = nodeSize(node);
+        stack[depth++] = node;
+        while (depth) {
+                node = stack[--depth];
+                layout->path_length += nodeSize(node);
+                if (GET(node->left)) {
+                        BUG_ON(depth == MAX_DEPTH);
+                        stack[depth++] = GET(node->left);
+                }
+                if (GET(node->right)) {
+                        BUG_ON(depth == MAX_DEPTH);
+                        stack[depth++] = GET(node->right);
+                }
+        }
+        kfree(stack);
+}
+
+static void
+foreachRec(node_t *node, void (*cb)(struct cb_kv *))
 {
         if (!node)
                 return;
-        foreach(GET(node->left), cb);
+        foreachRec(GET(node->left), cb);
         cb(&node->kv);
-        foreach(GET(node->right), cb);
+        foreachRec(GET(node->right), cb);
+}
+
+/*
+ * jmal: In-order walk with an explicit stack of left spines,
+ * recursive if there is no memory for the stack
+ */
+static void
+foreachIter(node_t *node, void (*cb)(struct cb_kv *))
+{
+        node_t **stack = walkStack();
+        int depth = 0;
+
+        if (!stack) {
+                foreachRec(node, cb);
+                return;
+        }
+        while (node || depth) {
+                while (node) {
+                        BUG_ON(depth == MAX_DEPTH);
+                        stack[depth++] = node;
+                        node = GET(node->left);
+                }
+                node = stack[--depth];
+                cb(&node->kv);
+                node = GET(node->right);
+        }
+        kfree(stack);
 }
 
 void
 TreeBB_ForEach(struct cb_root *tree, void (*cb)(struct cb_kv *))
 {
-        foreach(tree->root, cb);
+        if (recursive)
+                foreachRec(tree->root, cb);
+        else
+                foreachIter(tree->root, cb);
 }
 
 /* jmal: Add postorder tree destroyer */
@@ -411,15 +1556,115 @@ destroy_helper(node_t *node)
 	kmem_cache_free(node_cache, node);
 }
 
+/*
+ * Stackless destroy, rotating left children up until
+ * the leftmost node has none, which is then the in-order
+ * minimum and can go. Only safe once no reader remains.
+ */
+enum { DESTROY_BATCH = 1024 };
+
+static void
+destroyIter(node_t *node, void (*kv_destroyer)(struct cb_kv *))
+{
+	node_t *left, *next;
+	unsigned long freed = 0;
+
+	while(node){
+		left = GET(node->left);
+		if(left){
+			SET(node->left, GET(left->right));
+			SET(left->right, node);
+			node = left;
+			continue;
+		}
+		next = GET(node->right);
+		if(kv_destroyer != NULL)
+			kv_destroyer(&node->kv);
+		kmem_cache_free(node_cache, node);
+		node = next;
+		/* Large trees take a while, let others run */
+		if(!(++freed % DESTROY_BATCH))
+			cond_resched();
+	}
+}
+
+/*
+ * jmal: Parallel teardown support. Detach frees the top
+ * of the tree breadth first until it has been split in
+ * up to max disjoint subtrees, which can then be destroyed
+ * concurrently. The tree is left empty.
+ */
+int
+TreeBB_Detach(struct cb_root *tree, void **subtrees, int max,
+              void (*kv_destroyer)(struct cb_kv *))
+{
+	node_t *node = tree->root, *child;
+	int head = 0, tail = 0;
+
+	tree->root = NULL;
+	if(node)
+		subtrees[tail++] = node;
+	/* Splitting a node nets at most one more subtree */
+	while(head < tail && tail - head < max){
+		node = subtrees[head++];
+		if(tail + 2 > max){
+			memmove(subtrees, subtrees + head,
+				(tail - head) * sizeof(*subtrees));
+			tail -= head;
+			head = 0;
+		}
+		child = GET(node->left);
+		if(child)
+			subtrees[tail++] = child;
+		child = GET(node->right);
+		if(child)
+			subtrees[tail++] = child;
+		if(kv_destroyer != NULL)
+			kv_destroyer(&node->kv);
+		kmem_cache_free(node_cache, node);
+	}
+	memmove(subtrees, subtrees + head, (tail - head) * sizeof(*subtrees));
+	return tail - head;
+}
+
 void
-TreeBB_Destroy(struct cb_root *tree, void (*kv_destroyer)(struct cb_kv *))
+TreeBB_DestroySubtree(void *subtree, void (*kv_destroyer)(struct cb_kv *))
 {
-	node_t *node = tree->root;
-	/* Call key-value pair destroyer on each tree node */
-	if(kv_destroyer != NULL)
-		foreach(node, kv_destroyer);
-	/* Post order node freeing */
-	destroy_helper(node);
+	destroyIter(subtree, kv_destroyer);
+}
+
+void
+TreeBB_DestroyCache(void)
+{
+	/*
+	 * Nodes replaced by earlier updates may still be
+	 * waiting for their grace period, let those frees
+	 * finish before the cache goes away
+	 */
+	WARN_ON(!list_empty(&snapshots));
+	rcu_barrier();
+	drainMagazines();
+	free_percpu(updatePaths);
+	updatePaths = NULL;
 	/* Destroy kmem cache created on tree init */
 	kmem_cache_destroy(node_cache);
+	node_cache = NULL;
+}
+
+void
+TreeBB_Destroy(struct cb_root *tree, void (*kv_destroyer)(struct cb_kv *))
+{
+	node_t *node = tree->root;
+
+	if(recursive){
+		/* Call key-value pair destroyer on each tree node */
+		if(kv_destroyer != NULL)
+			foreachRec(node, kv_destroyer);
+		/* Post order node freeing */
+		destroy_helper(node);
+	}else{
+		destroyIter(node, kv_destroyer);
+	}
+	tree->root = NULL;
+	TreeBB_DestroyCache();
 }
@@ -7,16 +7,31 @@
 
 #include <linux/kernel.h>
 #include <linux/stddef.h>
+#include <linux/list.h>
 
+/*
+ * jmal: Keys are u64, compared as integers unless the
+ * tree has a comparator, in which case they are opaque
+ * (e.g. pointers to string keys). With a prefix function
+ * every node caches an order preserving u64 summary of its
+ * key, prefix(a) < prefix(b) must imply a < b, and only
+ * keys with equal prefixes reach the comparator.
+ */
 struct cb_root
 {
 	// XXX Should be SHARED(...)
         struct TreeBB_Node *root;
+        int (*cmp)(u64 a, u64 b);
+        u64 (*prefix)(u64 key);
+        /* jmal: Published updates, only counted in persistent mode */
+        u64 version;
 };
 
+/* jmal: key and prefix first, they are what searches read */
 struct cb_kv
 {
-	uintptr_t key;
+	u64 key;
+	u64 prefix;
 	void *value;
 };
 
@@ -24,41 +39,128 @@ struct cb_kv
 
 #define CB_EMPTY_ROOT(cbroot)	(GET((cbroot)->root) == NULL)
 
-static inline void
-cb_insert(struct cb_root *tree, uintptr_t key, void *value)
+/* Returns 0 if inserted, -1 if the key was already present */
+static inline int
+cb_insert(struct cb_root *tree, u64 key, void *value)
 {
-	void TreeBB_Insert(struct cb_root *tree, uintptr_t key, void *value);
-	TreeBB_Insert(tree, key, value);
+	int TreeBB_Insert(struct cb_root *tree, u64 key, void *value);
+	return TreeBB_Insert(tree, key, value);
 }
 
 static inline void *
-cb_erase(struct cb_root *tree, uintptr_t key)
+cb_erase(struct cb_root *tree, u64 key)
 {
-	void *TreeBB_Delete(struct cb_root *tree, uintptr_t key);
+	void *TreeBB_Delete(struct cb_root *tree, u64 key);
 	return TreeBB_Delete(tree, key);
 }
 
 static inline struct cb_kv *
-cb_find(struct cb_root *tree, uintptr_t needle)
+cb_find(struct cb_root *tree, u64 needle)
 {
-	struct cb_kv *TreeBB_Find(struct cb_root *tree, uintptr_t needle);
+	struct cb_kv *TreeBB_Find(struct cb_root *tree, u64 needle);
 	return TreeBB_Find(tree, needle);
 }
 
 static inline struct cb_kv *
-cb_find_gt(struct cb_root *tree, uintptr_t needle)
+cb_find_gt(struct cb_root *tree, u64 needle)
 {
-	struct cb_kv *TreeBB_FindGT(struct cb_root *tree, uintptr_t needle);
+	struct cb_kv *TreeBB_FindGT(struct cb_root *tree, u64 needle);
 	return TreeBB_FindGT(tree, needle);
 }
 
 static inline struct cb_kv *
-cb_find_le(struct cb_root *tree, uintptr_t needle)
+cb_find_le(struct cb_root *tree, u64 needle)
 {
-	struct cb_kv *TreeBB_FindLE(struct cb_root *tree, uintptr_t needle);
+	struct cb_kv *TreeBB_FindLE(struct cb_root *tree, u64 needle);
 	return TreeBB_FindLE(tree, needle);
 }
 
+/*
+ * jmal: Order statistics from the subtree sizes, rank is
+ * the number of keys below needle, select the k-th smallest
+ * key (from 0) and count_range the number of keys in [lo, hi]
+ */
+static inline unsigned long
+cb_rank(struct cb_root *tree, u64 needle)
+{
+	unsigned long TreeBB_Rank(struct cb_root *tree, u64 needle);
+	return TreeBB_Rank(tree, needle);
+}
+
+static inline struct cb_kv *
+cb_select(struct cb_root *tree, unsigned long k)
+{
+	struct cb_kv *TreeBB_Select(struct cb_root *tree, unsigned long k);
+	return TreeBB_Select(tree, k);
+}
+
+static inline unsigned long
+cb_count_range(struct cb_root *tree, u64 lo, u64 hi)
+{
+	unsigned long TreeBB_CountRange(struct cb_root *tree, u64 lo, u64 hi);
+	return TreeBB_CountRange(tree, lo, hi);
+}
+
+/*
+ * jmal: Join based bulk operations, each publishing the
+ * result with one rcu_assign_pointer() per tree, so readers
+ * see either the old or the new version. Split moves the
+ * keys >= key to the empty tree right, join appends right
+ * (all of whose keys must be greater, -1 otherwise) and
+ * union merges other in, keeping tree's value for keys in
+ * both. erase_range removes [lo, hi] and returns how many
+ * keys went. Pairs dropped by erase_range and union are
+ * passed to kv_destroyer after publication, readers may
+ * still see them until a grace period has elapsed.
+ */
+static inline void
+cb_split(struct cb_root *tree, u64 key, struct cb_root *right)
+{
+	void TreeBB_Split(struct cb_root *tree, u64 key, struct cb_root *right);
+	TreeBB_Split(tree, key, right);
+}
+
+static inline int
+cb_join(struct cb_root *tree, struct cb_root *right)
+{
+	int TreeBB_Join(struct cb_root *tree, struct cb_root *right);
+	return TreeBB_Join(tree, right);
+}
+
+static inline unsigned long
+cb_erase_range(struct cb_root *tree, u64 lo, u64 hi,
+	       void (*kv_destroyer)(struct cb_kv *))
+{
+	unsigned long TreeBB_EraseRange(struct cb_root *tree, u64 lo, u64 hi,
+					void (*func)(struct cb_kv *));
+	return TreeBB_EraseRange(tree, lo, hi, kv_destroyer);
+}
+
+static inline void
+cb_union(struct cb_root *tree, struct cb_root *other,
+	 void (*kv_destroyer)(struct cb_kv *))
+{
+	void TreeBB_Union(struct cb_root *tree, struct cb_root *other,
+			  void (*func)(struct cb_kv *));
+	TreeBB_Union(tree, other, kv_destroyer);
+}
+
+/*
+ * jmal: Union on up to threads kthreads (rounded down to
+ * a power of two, at most 64), forking at the top
+ * log2(threads) levels of the recursion where the halves
+ * are big enough to be worth a thread. Sleeps, so the
+ * caller must not hold a spinning lock.
+ */
+static inline void
+cb_union_parallel(struct cb_root *tree, struct cb_root *other, int threads,
+		  void (*kv_destroyer)(struct cb_kv *))
+{
+	void TreeBB_UnionParallel(struct cb_root *tree, struct cb_root *other,
+				  int threads, void (*func)(struct cb_kv *));
+	TreeBB_UnionParallel(tree, other, threads, kv_destroyer);
+}
+
 /*
  * jmal: Add for each wrapper, add tree
  * destroyer, add initialization function
@@ -79,6 +181,198 @@ cb_destroy(struct cb_root *tree, void (*kv_destroyer)(struct cb_kv *))
 	TreeBB_Destroy(tree, kv_destroyer);
 }
 
+/*
+ * jmal: Teardown in pieces, detach splits the tree in up
+ * to max subtrees (returning how many), which can each be
+ * destroyed on a different thread, and the node cache goes
+ * once all of them are done
+ */
+static inline int
+cb_detach(struct cb_root *tree, void **subtrees, int max,
+	  void (*kv_destroyer)(struct cb_kv *))
+{
+	int TreeBB_Detach(struct cb_root *tree, void **subtrees, int max,
+			  void (*func)(struct cb_kv *));
+	return TreeBB_Detach(tree, subtrees, max, kv_destroyer);
+}
+
+static inline void
+cb_destroy_subtree(void *subtree, void (*kv_destroyer)(struct cb_kv *))
+{
+	void TreeBB_DestroySubtree(void *subtree, void (*func)(struct cb_kv *));
+	TreeBB_DestroySubtree(subtree, kv_destroyer);
+}
+
+static inline void
+cb_destroy_cache(void)
+{
+	void TreeBB_DestroyCache(void);
+	TreeBB_DestroyCache();
+}
+
+/*
+ * jmal: Updates, foreach and destroy are iterative with a
+ * bounded path array, this switches all trees back to the
+ * original recursive versions for comparison
+ */
+static inline void
+cb_set_recursive(bool on)
+{
+	void TreeBB_SetRecursive(bool on);
+	TreeBB_SetRecursive(on);
+}
+
+/* jmal: Prefetch both children at every level of a lookup */
+static inline void
+cb_set_prefetch(bool on)
+{
+	void TreeBB_SetPrefetch(bool on);
+	TreeBB_SetPrefetch(on);
+}
+
+/*
+ * jmal: Node layout and tree shape, hot_bytes is the
+ * leading part of a node searches read and path_length
+ * the sum of the node depths, counting the root as 1.
+ * Walks the whole tree, call it with no writer running
+ * and where it may sleep, nodes stays 0 without memory.
+ */
+struct cb_layout
+{
+	size_t node_size;
+	size_t node_align;
+	size_t hot_bytes;
+	unsigned long nodes;
+	unsigned long path_length;
+};
+
+static inline void
+cb_get_layout(struct cb_root *tree, struct cb_layout *layout)
+{
+	void TreeBB_Layout(struct cb_root *tree, struct cb_layout *layout);
+	TreeBB_Layout(tree, layout);
+}
+
+/*
+ * jmal: Per-CPU node magazines, set before cb_init. Writers
+ * call cb_refill with no lock held so that the nodes they
+ * allocate under the lock come from the magazine.
+ */
+struct cb_mag_stats
+{
+	/* Allocations served by a magazine, and by the slab */
+	unsigned long hits;
+	unsigned long misses;
+	/* Refills and the nodes they brought in */
+	unsigned long refills;
+	unsigned long refilled;
+	/* Nodes back from a grace period, kept or sent to the slab */
+	unsigned long recycled;
+	unsigned long overflows;
+};
+
+static inline void
+cb_set_magazines(bool on)
+{
+	void TreeBB_SetMagazines(bool on);
+	TreeBB_SetMagazines(on);
+}
+
+static inline void
+cb_refill(void)
+{
+	void TreeBB_Refill(void);
+	TreeBB_Refill();
+}
+
+static inline void
+cb_magazine_stats(struct cb_mag_stats *stats)
+{
+	void TreeBB_MagazineStats(struct cb_mag_stats *stats);
+	TreeBB_MagazineStats(stats);
+}
+
+/*
+ * jmal: Persistent mode, set before cb_init. Updates copy
+ * their whole path instead of writing one pointer in place,
+ * so every root ever published stays a consistent tree and
+ * cb_snapshot can pin one for as long as a scan needs, while
+ * writers go on. Snapshot readers use the usual lookups and
+ * cb_for_each on snap->tree, without rcu_read_lock() and
+ * may sleep. Nodes and values the snapshot can reach are
+ * kept until it is released, every snapshot must be
+ * released before the tree is destroyed. version is the
+ * tree's update count at the snapshot, an update being
+ * published at that moment may or may not be counted.
+ */
+struct cb_snapshot
+{
+	struct cb_root tree;
+	u64 version;
+	unsigned long size;
+	/* jmal: Private, retired nodes and values it keeps alive */
+	struct list_head list;
+	struct rcu_head *limbo;
+	struct rcu_head *limboLast;
+};
+
+/*
+ * jmal: Published updates (bulk operations count as one),
+ * nodes they allocated, path copies included, and retired
+ * nodes and values held back for a snapshot
+ */
+struct cb_copy_stats
+{
+	unsigned long updates;
+	unsigned long nodes;
+	unsigned long retained;
+};
+
+static inline void
+cb_set_persistent(bool on)
+{
+	void TreeBB_SetPersistent(bool on);
+	TreeBB_SetPersistent(on);
+}
+
+/* Returns -1 outside persistent mode */
+static inline int
+cb_snapshot(struct cb_root *tree, struct cb_snapshot *snap)
+{
+	int TreeBB_Snapshot(struct cb_root *tree, struct cb_snapshot *snap);
+	return TreeBB_Snapshot(tree, snap);
+}
+
+static inline void
+cb_snapshot_release(struct cb_snapshot *snap)
+{
+	void TreeBB_SnapshotRelease(struct cb_snapshot *snap);
+	TreeBB_SnapshotRelease(snap);
+}
+
+/*
+ * jmal: For objects erased with their key, such as values,
+ * that a live snapshot may still reach. Returns true if
+ * func was queued to run after the snapshots that may see
+ * the object are released and a grace period has elapsed,
+ * false if no snapshot needs it and the caller frees it as
+ * it would without snapshots.
+ */
+static inline bool
+cb_snapshot_defer(struct rcu_head *head, void (*func)(struct rcu_head *))
+{
+	bool TreeBB_SnapshotDefer(struct rcu_head *head,
+				  void (*func)(struct rcu_head *));
+	return TreeBB_SnapshotDefer(head, func);
+}
+
+static inline void
+cb_copy_stats(struct cb_copy_stats *stats)
+{
+	void TreeBB_CopyStats(struct cb_copy_stats *stats);
+	TreeBB_CopyStats(stats);
+}
+
 /* 
  * XXX: Only call this once no matter how many trees you use!
  * This function creates a common kernel cache for all tree nodes
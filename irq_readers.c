@@ -0,0 +1,182 @@
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+#include <linux/printk.h>
+#include <linux/percpu.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/smp.h>
+#include <linux/cpumask.h>
+#include <linux/math64.h>
+#include <linux/version.h>
+#include "irq_readers.h"
+
+/* hrtimer_setup() took over from hrtimer_init() in 6.13 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+static inline void hrtimer_setup(struct hrtimer *timer,
+		enum hrtimer_restart (*function)(struct hrtimer *),
+		clockid_t clock_id, enum hrtimer_mode mode)
+{
+	hrtimer_init(timer, clock_id, mode);
+	timer->function = function;
+}
+#endif
+
+struct irq_reader {
+	struct hrtimer timer;
+	struct rnd_state rnd;
+	bool started;
+	/* Written by the timer callback only */
+	unsigned long reads;
+	unsigned long hits;
+	u64 latency_ns;
+	u64 delay_ns;
+	/* Since the last report, which resets them */
+	u64 max_latency_ns;
+	u64 max_delay_ns;
+	/* Totals at the last report */
+	unsigned long reported_reads;
+	unsigned long reported_hits;
+	u64 reported_latency_ns;
+	u64 reported_delay_ns;
+};
+
+static struct irq_reader __percpu *readers;
+static struct lock_tree *reader_lt;
+static enum hrtimer_mode timer_mode;
+static ktime_t period;
+static u64 reader_keys;
+static u64 (*reader_key)(u64);
+
+static enum hrtimer_restart irq_reader_fn(struct hrtimer *timer)
+{
+	struct irq_reader *r = container_of(timer, struct irq_reader, timer);
+	ktime_t start = ktime_get();
+	u64 key, latency, delay;
+	char *found;
+
+	/* How long the expiry was held back, mostly by disabled BH or IRQs */
+	delay = ktime_to_ns(ktime_sub(start, hrtimer_get_expires(timer)));
+	key = reader_key(((u64)prandom_u32_state(&r->rnd) * reader_keys >> 32) + 1);
+
+	lt_read_lock(reader_lt);
+	found = lt_search(reader_lt, key);
+	lt_read_unlock(reader_lt);
+
+	latency = ktime_to_ns(ktime_sub(ktime_get(), start));
+	r->reads++;
+	if(found)
+		r->hits++;
+	r->latency_ns += latency;
+	r->delay_ns += delay;
+	if(latency > r->max_latency_ns)
+		r->max_latency_ns = latency;
+	if(delay > r->max_delay_ns)
+		r->max_delay_ns = delay;
+
+	hrtimer_forward_now(timer, period);
+	return HRTIMER_RESTART;
+}
+
+int irq_readers_init(struct lock_tree *lt, IRQREADERS_T mode,
+		unsigned int period_us, u64 num_keys, u64 (*key)(u64),
+		unsigned long seed)
+{
+	int cpu;
+
+	if(mode == IRQ_READERS_NONE)
+		return 0;
+
+	readers = alloc_percpu(struct irq_reader);
+	if(!readers){
+		pr_err("Could not allocate per-CPU interrupt readers\n");
+		return -1;
+	}
+	reader_lt = lt;
+	timer_mode = mode == IRQ_READERS_SOFTIRQ ? HRTIMER_MODE_REL_PINNED_SOFT :
+		HRTIMER_MODE_REL_PINNED_HARD;
+	period = ns_to_ktime((u64)max(period_us, 1U) * NSEC_PER_USEC);
+	reader_keys = num_keys;
+	reader_key = key;
+
+	for_each_possible_cpu(cpu){
+		struct irq_reader *r = per_cpu_ptr(readers, cpu);
+
+		hrtimer_setup(&r->timer, irq_reader_fn, CLOCK_MONOTONIC, timer_mode);
+		prandom_seed_state(&r->rnd, seed + cpu);
+	}
+	return 0;
+}
+
+void irq_readers_exit(void)
+{
+	free_percpu(readers);
+	readers = NULL;
+}
+
+/* Runs on every online CPU, the timers are pinned to it */
+static void irq_reader_start_cpu(void *unused)
+{
+	struct irq_reader *r = this_cpu_ptr(readers);
+
+	r->started = true;
+	hrtimer_start(&r->timer, period, timer_mode);
+}
+
+void irq_readers_start(void)
+{
+	if(!readers)
+		return;
+	on_each_cpu(irq_reader_start_cpu, NULL, 1);
+}
+
+/* Waits for running callbacks, the tree can go afterwards */
+void irq_readers_stop(void)
+{
+	int cpu;
+
+	if(!readers)
+		return;
+	for_each_possible_cpu(cpu){
+		struct irq_reader *r = per_cpu_ptr(readers, cpu);
+
+		if(!r->started)
+			continue;
+		hrtimer_cancel(&r->timer);
+		r->started = false;
+	}
+}
+
+void irq_readers_report(const char *stage_name)
+{
+	unsigned long reads = 0, hits = 0;
+	u64 latency = 0, delay = 0, max_latency = 0, max_delay = 0;
+	int cpu;
+
+	if(!readers)
+		return;
+	for_each_possible_cpu(cpu){
+		struct irq_reader *r = per_cpu_ptr(readers, cpu);
+		unsigned long now_reads = READ_ONCE(r->reads);
+		unsigned long now_hits = READ_ONCE(r->hits);
+		u64 now_latency = READ_ONCE(r->latency_ns);
+		u64 now_delay = READ_ONCE(r->delay_ns);
+
+		reads += now_reads - r->reported_reads;
+		hits += now_hits - r->reported_hits;
+		latency += now_latency - r->reported_latency_ns;
+		delay += now_delay - r->reported_delay_ns;
+		r->reported_reads = now_reads;
+		r->reported_hits = now_hits;
+		r->reported_latency_ns = now_latency;
+		r->reported_delay_ns = now_delay;
+		/* A callback racing with the reset may lose its maximum */
+		max_latency = max(max_latency, xchg(&r->max_latency_ns, 0));
+		max_delay = max(max_delay, xchg(&r->max_delay_ns, 0));
+	}
+	if(!reads)
+		return;
+	pr_info("%s stage: %lu interrupt context searches (%lu hits), latency avg "
+			"%llu ns max %llu ns, timer delay avg %llu ns max %llu ns\n",
+			stage_name, reads, hits, div64_u64(latency, reads),
+			max_latency, div64_u64(delay, reads), max_delay);
+}
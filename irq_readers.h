@@ -0,0 +1,31 @@
+#ifndef _IRQ_READERS_H
+#define _IRQ_READERS_H
+
+#include <linux/types.h>
+#include "aux_structs.h"
+
+/*
+ * Readers in interrupt context, one pinned hrtimer per
+ * online CPU firing every period and searching a random key
+ * from softirq (soft hrtimers) or hardirq context, as an
+ * in-kernel index serving timers or the network stack
+ * would. Each stage reports the search latency and how late
+ * the timers fired, which is how long process context kept
+ * bottom halves or interrupts disabled on the timers' CPUs.
+ */
+typedef enum {
+	IRQ_READERS_NONE,
+	IRQ_READERS_SOFTIRQ,
+	IRQ_READERS_HARDIRQ
+}IRQREADERS_T;
+
+/* Keys are key(1) to key(num_keys) */
+int irq_readers_init(struct lock_tree *lt, IRQREADERS_T mode,
+		unsigned int period_us, u64 num_keys, u64 (*key)(u64),
+		unsigned long seed);
+void irq_readers_exit(void);
+void irq_readers_start(void);
+void irq_readers_stop(void);
+void irq_readers_report(const char *stage_name);
+
+#endif /* _IRQ_READERS_H */
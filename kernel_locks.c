@@ -14,7 +14,22 @@
 #include <asm/atomic.h>
 #include <linux/slab.h>
 #include <linux/gfp.h>
+#include <linux/debugfs.h>
+#ifdef CONFIG_X86
+#include <asm/processor.h>
+#endif
 #include "aux_structs.h"
+#include "thread_stats.h"
+#include "op_trace.h"
+#include "run_stats.h"
+#include "busy_work.h"
+#include "payload.h"
+#include "key_table.h"
+#include "kv_dev.h"
+#include "irq_readers.h"
+#include "snap_scan.h"
+#include "bulk_check.h"
+#include "lock_tree_trace.h"
 
 /*
  * XXX: Be careful!
@@ -23,14 +38,99 @@
  * to be translated correctly. NULL is the last element of each
  * array so that we do not require a size parameter to know when done
  */
-static char *possible_lock_types[] = {"MUTEX", "RWLOCK", "SPINLOCK", "RWSEM", NULL};
-static char *possible_tree_types[] = {"RB_TREE", "RCU_TREE", NULL};
+static char *possible_lock_types[] = {"MUTEX", "RWLOCK", "SPINLOCK", "RWSEM", "ADAPTIVE", NULL};
+static char *possible_tree_types[] = {"RB_TREE", "RCU_TREE", "SKIPLIST", NULL};
+static char *possible_workloads[] = {"POINT", "VMA", NULL};
+static char *possible_payload_dists[] = {"FIXED", "UNIFORM", "LOG", NULL};
+static char *possible_read_modes[] = {"NONE", "READ", "COPY", NULL};
+static char *possible_key_types[] = {"U64", "STRING", NULL};
+static char *possible_irq_readers[] = {"NONE", "SOFTIRQ", "HARDIRQ", NULL};
+static char *possible_sched_mixes[] = {"NONE", "NICE", "FIFO", "MIXED", NULL};
+
+/*
+ * Workloads, POINT is the original insert then
+ * search/erase on linear offsets, VMA emulates
+ * page faults and mmap/munmap on an address space
+ */
+typedef enum {
+	POINT,
+	VMA
+}WORKLOAD_T;
+
+/*
+ * What searches do with a found value under the
+ * read lock: nothing, read every cache line of it,
+ * or copy it out with lt_search_copy
+ */
+typedef enum {
+	READ_NONE,
+	READ_TOUCH,
+	READ_COPY
+}READMODE_T;
+
+/*
+ * Scheduling classes of the workers: all default, nice
+ * -10, 0 and 10 in turn, every fourth one SCHED_FIFO, or
+ * every fourth one SCHED_FIFO and the others niced
+ */
+typedef enum {
+	SCHED_MIX_NONE,
+	SCHED_MIX_NICE,
+	SCHED_MIX_FIFO,
+	SCHED_MIX_MIXED
+}SCHEDMIX_T;
 
 static unsigned int num_threads = 8;
-static unsigned int num_ops = 1000000;
+static unsigned long num_ops = 1000000;
+static unsigned long tree_size = 0;
+static unsigned long ops = 0;
+static unsigned int llc_kb = 0;
 static char *lock_type = "SPINLOCK";
 static char *tree_type = "RB_TREE";
 static unsigned int del_ratio = 20;
+static unsigned int stall_ms = 1000;
+static bool combining = false;
+static char *workload = "POINT";
+static unsigned int fault_ratio = 95;
+static unsigned long seed = 0;
+static char *trace_file = NULL;
+static unsigned int repeats = 1;
+static unsigned int warmup = 0;
+static unsigned long cs_cycles = 0;
+static unsigned int cs_lines = 0;
+static unsigned long think_cycles = 0;
+static unsigned int think_lines = 0;
+static bool shared_work = false;
+static unsigned int payload_size = 11;
+static unsigned int payload_max = 0;
+static char *payload_dist = "FIXED";
+static unsigned int payload_pool = 0;
+static char *read_value = "NONE";
+static char *key_type = "U64";
+static unsigned int key_len = 32;
+static unsigned int key_shared = 0;
+static bool key_prefix = false;
+static bool cb_recursive = false;
+static bool cb_prefetch = false;
+static bool cb_magazines = false;
+static bool layout_report = false;
+static bool kv_dev = false;
+static bool kv_lock_per_op = false;
+static unsigned int teardown_parts = 0;
+static unsigned int order_ratio = 0;
+static unsigned int range_len = 100;
+static unsigned int range_erase_ratio = 0;
+static char *irq_readers = "NONE";
+static unsigned int irq_period_us = 100;
+static bool cb_persistent = false;
+static unsigned int snapshot_ms = 0;
+static bool bench_output = false;
+static unsigned int oversubscribe = 0;
+static char *sched_mix = "NONE";
+static unsigned int holder_preempt = 0;
+static unsigned int stall_abort_ms = 0;
+static unsigned int lookaside = 0;
+static unsigned long bulk_check = 0;
 
 /* 
  * Our module parameters are not visible to sysfs
@@ -40,24 +140,235 @@ static unsigned int del_ratio = 20;
 module_param(num_threads, uint, 0);
 MODULE_PARM_DESC(num_threads, "Number of threads to run operations, default: 8");
 
-module_param(num_ops, uint, 0);
-MODULE_PARM_DESC(num_ops, "Number of operations to perform on each stage, default: 1000000");
+module_param(num_ops, ulong, 0);
+MODULE_PARM_DESC(num_ops, "Number of operations to perform on each stage, the \
+default of tree_size and ops, default: 1000000");
+
+module_param(tree_size, ulong, 0);
+MODULE_PARM_DESC(tree_size, "Keys (VMA: regions) the insert stage puts in the tree, \
+and the key space of the second stage, 0 uses num_ops, default: 0");
+
+module_param(ops, ulong, 0);
+MODULE_PARM_DESC(ops, "Operations of the search/erase (VMA: fault) stage, \
+0 uses num_ops, default: 0");
+
+module_param(llc_kb, uint, 0);
+MODULE_PARM_DESC(llc_kb, "Size of the last level cache in KiB the working set is \
+compared to, 0 takes the boot CPU's on x86, default: 0");
 
 module_param(lock_type, charp, 0);
 MODULE_PARM_DESC(lock_type, "Locking mechanism to be used for operations, \
-possible values: MUTEX, RWLOCK, SPINLOCK, RWSEM, default: SPINLOCK");
+possible values: MUTEX, RWLOCK, SPINLOCK, RWSEM, ADAPTIVE, default: SPINLOCK");
 
 module_param(tree_type, charp, 0);
 MODULE_PARM_DESC(tree_type, "Tree structure to be used for operations, \
-possible values: RB_TREE, RCU_TREE, default: RB_TREE");
+possible values: RB_TREE, RCU_TREE, SKIPLIST (lock-free, lock_type is unused), \
+default: RB_TREE");
 
 module_param(del_ratio, uint, 0);
 MODULE_PARM_DESC(del_ratio, "Percentage of deletes in overall operations for \
 lookup/delete stage, possible values: 0-100, default: 20");
 
+module_param(stall_ms, uint, 0);
+MODULE_PARM_DESC(stall_ms, "Flag threads that make no progress for this many \
+milliseconds during a stage, 0 disables the stall monitor, default: 1000");
+
+module_param(combining, bool, 0);
+MODULE_PARM_DESC(combining, "Apply inserts and erases through flat combining, \
+the lock holder applies the pending writes of all threads in one batch, default: false");
+
+module_param(workload, charp, 0);
+MODULE_PARM_DESC(workload, "Workload to run, possible values: POINT (insert, then \
+search/erase on linear offsets), VMA (address space emulation, region maps, then \
+page fault floor searches and mmap/munmap), default: POINT");
+
+module_param(fault_ratio, uint, 0);
+MODULE_PARM_DESC(fault_ratio, "Percentage of page faults in the second stage of \
+the VMA workload, the rest are mmap/munmap, possible values: 0-100, default: 95");
+
+module_param(seed, ulong, 0);
+MODULE_PARM_DESC(seed, "Seed for the pre-generated operation traces, the same seed \
+replays the same operations, 0 picks a random seed, default: 0");
+
+module_param(trace_file, charp, 0);
+MODULE_PARM_DESC(trace_file, "Replay a captured trace loaded through the firmware \
+loader instead of generating one, num_ops, tree_size, ops, workload and seed are \
+then ignored, the trace of the last run is exported in debugfs as lock_tree/trace, \
+default: none");
+
+module_param(repeats, uint, 0);
+MODULE_PARM_DESC(repeats, "Number of measured runs of both stages, each on a fresh \
+tree with the same traces, more than one reports mean, median, stddev, min/max, \
+95% confidence intervals and MAD outliers per stage, default: 1");
+
+module_param(warmup, uint, 0);
+MODULE_PARM_DESC(warmup, "Number of warm-up runs before the measured ones, \
+discarded from the statistics, default: 0");
+
+module_param(cs_cycles, ulong, 0);
+MODULE_PARM_DESC(cs_cycles, "Cycles of busy work inside the critical section \
+of every operation, default: 0");
+
+module_param(cs_lines, uint, 0);
+MODULE_PARM_DESC(cs_lines, "Cache lines of the work buffer touched inside the \
+critical section of every operation, default: 0");
+
+module_param(think_cycles, ulong, 0);
+MODULE_PARM_DESC(think_cycles, "Cycles of busy work between operations, \
+outside the lock, default: 0");
+
+module_param(think_lines, uint, 0);
+MODULE_PARM_DESC(think_lines, "Cache lines of the work buffer touched between \
+operations, outside the lock, default: 0");
+
+module_param(shared_work, bool, 0);
+MODULE_PARM_DESC(shared_work, "Touch one work buffer shared by all threads \
+instead of a private one per thread, default: false");
+
+module_param(payload_size, uint, 0);
+MODULE_PARM_DESC(payload_size, "Value size in bytes of the POINT workload, the \
+minimum size for the UNIFORM and LOG distributions, default: 11");
+
+module_param(payload_max, uint, 0);
+MODULE_PARM_DESC(payload_max, "Maximum value size in bytes for the UNIFORM and \
+LOG distributions, default: 0");
+
+module_param(payload_dist, charp, 0);
+MODULE_PARM_DESC(payload_dist, "Value size distribution, possible values: FIXED, \
+UNIFORM, LOG (power of two range picked uniformly, then uniform within it), \
+default: FIXED");
+
+module_param(payload_pool, uint, 0);
+MODULE_PARM_DESC(payload_pool, "Store POINT workload values by reference into a \
+pool of this many refcounted values instead of copying them, 0 copies, default: 0");
+
+module_param(read_value, charp, 0);
+MODULE_PARM_DESC(read_value, "What searches do with a found value under the read \
+lock, possible values: NONE, READ (every cache line), COPY (lt_search_copy into a \
+per-thread buffer), default: NONE");
+
+module_param(key_type, charp, 0);
+MODULE_PARM_DESC(key_type, "Tree key type of the POINT workload, possible values: \
+U64, STRING (byte strings compared through a comparator), default: U64");
+
+module_param(key_len, uint, 0);
+MODULE_PARM_DESC(key_len, "Length of STRING keys in bytes, at least key_shared + 16, \
+default: 32");
+
+module_param(key_shared, uint, 0);
+MODULE_PARM_DESC(key_shared, "Leading bytes shared by all STRING keys, default: 0");
+
+module_param(key_prefix, bool, 0);
+MODULE_PARM_DESC(key_prefix, "Cache the first 8 bytes of STRING keys in the tree \
+nodes so that most comparisons skip the key bytes, default: false");
+
+module_param(cb_recursive, bool, 0);
+MODULE_PARM_DESC(cb_recursive, "Use the original recursive RCU_TREE insert, delete, \
+foreach and destroy instead of the iterative ones, to compare them, default: false");
+
+module_param(cb_prefetch, bool, 0);
+MODULE_PARM_DESC(cb_prefetch, "Prefetch both children at every level of RCU_TREE \
+lookups, default: false");
+
+module_param(cb_magazines, bool, 0);
+MODULE_PARM_DESC(cb_magazines, "Allocate RCU_TREE nodes from per-CPU magazines, \
+refilled before writers take the lock and fed by nodes back from their grace \
+period, default: false");
+
+module_param(kv_dev, bool, 0);
+MODULE_PARM_DESC(kv_dev, "After the runs, serve a fresh tree to userspace on \
+/dev/lock_tree through a shared memory ring until the module is removed, U64 keys \
+only, default: false");
+
+module_param(kv_lock_per_op, bool, 0);
+MODULE_PARM_DESC(kv_lock_per_op, "Take the lock for every /dev/lock_tree ring entry \
+instead of once per ring drain, default: false");
+
+module_param(layout_report, bool, 0);
+MODULE_PARM_DESC(layout_report, "Report the RCU_TREE node layout and expected cache \
+lines per lookup after the insert stage, walks the whole tree, default: false");
+
+module_param(teardown_parts, uint, 0);
+MODULE_PARM_DESC(teardown_parts, "Number of subtrees the tree is split in to be \
+destroyed in parallel by a workqueue after every run, 1 destroys it serially, \
+0 uses 4 per online CPU, default: 0");
+
+module_param(order_ratio, uint, 0);
+MODULE_PARM_DESC(order_ratio, "Percentage of order statistics queries (rank, select \
+and range count, evenly) in the search/erase stage of the POINT workload, rank \
+and select walk the whole SKIPLIST, possible values: 0-100, default: 0");
+
+module_param(range_len, uint, 0);
+MODULE_PARM_DESC(range_len, "Number of consecutive trace keys covered by a range \
+count query or range erase, default: 100");
+
+module_param(range_erase_ratio, uint, 0);
+MODULE_PARM_DESC(range_erase_ratio, "Percentage of the erases of the POINT workload \
+that remove range_len consecutive keys at once, possible values: 0-100, default: 0");
+
+module_param(irq_readers, charp, 0);
+MODULE_PARM_DESC(irq_readers, "Search the tree from a per-CPU timer in interrupt \
+context as well, possible values: NONE, SOFTIRQ, HARDIRQ. Process context then \
+takes RB_TREE locks with bottom halves or interrupts disabled, default: NONE");
+
+module_param(irq_period_us, uint, 0);
+MODULE_PARM_DESC(irq_period_us, "Microseconds between interrupt context searches \
+on each CPU, default: 100");
+
+module_param(cb_persistent, bool, 0);
+MODULE_PARM_DESC(cb_persistent, "Copy the whole path on every RCU_TREE update \
+instead of updating in place, which keeps every published version consistent \
+and allows snapshots, default: false");
+
+module_param(snapshot_ms, uint, 0);
+MODULE_PARM_DESC(snapshot_ms, "Milliseconds between scans of a whole RCU_TREE \
+snapshot taken while the workers run, needs cb_persistent, 0 disables them, \
+default: 0");
+
+module_param(bench_output, bool, 0);
+MODULE_PARM_DESC(bench_output, "Log the stage durations of every measured run as \
+\"bench <stage> <run> <us>\" lines for tools/bench.sh, default: false");
+
+module_param(oversubscribe, uint, 0);
+MODULE_PARM_DESC(oversubscribe, "Run this many threads per online CPU instead of \
+num_threads, possible values: 0-8, 0 uses num_threads, default: 0");
+
+module_param(sched_mix, charp, 0);
+MODULE_PARM_DESC(sched_mix, "Scheduling of the worker threads, possible values: \
+NONE, NICE (nice -10, 0 and 10 in turn), FIFO (every fourth one SCHED_FIFO), \
+MIXED (every fourth one SCHED_FIFO, the others niced), default: NONE");
+
+module_param(holder_preempt, uint, 0);
+MODULE_PARM_DESC(holder_preempt, "Yield the CPU while holding the write lock every \
+this many operations of a thread, MUTEX and RWSEM without combining only, 0 disables \
+it, default: 0");
+
+module_param(stall_abort_ms, uint, 0);
+MODULE_PARM_DESC(stall_abort_ms, "Cut the run short and fail the module load once a \
+thread has made no progress for this many milliseconds, at least stall_ms, \
+0 disables it, default: 0");
+
+module_param(lookaside, uint, 0);
+MODULE_PARM_DESC(lookaside, "Entries of a per-CPU cache of search results that \
+searches try before taking the read lock, rounded up to a power of two, at most \
+65536, 0 disables it, default: 0");
+
+module_param(bulk_check, ulong, 0);
+MODULE_PARM_DESC(bulk_check, "Check cb_split, cb_join, cb_union and cb_union_parallel \
+on scratch RCU_TREEs of this many keys before the runs, timing the union on 1 up to \
+the online CPUs kthreads, the module fails to load on a wrong result, RCU_TREE only, \
+0 disables it, default: 0");
+
 
 /* Our lock-tree structure to be used for the experiment */
 static struct lock_tree global_lt;
+static WORKLOAD_T global_workload;
+static READMODE_T global_read_mode;
+static SCHEDMIX_T global_sched_mix;
+
+/* Injected work, see busy_work.h */
+static struct busy_work cs_work;
+static struct busy_work think_work;
 
 /*
  * We need some sort of barrier to 
@@ -70,6 +381,23 @@ static struct lock_tree global_lt;
 static struct simple_barrier stage_one;
 static struct simple_barrier stage_two;
 static struct simple_barrier finish;
+/* Workers of the current run still inside tree_operation_thread */
+static atomic_t workers_running;
+static DECLARE_WAIT_QUEUE_HEAD(workers_done);
+
+/* Per-thread operation counts and timings, see thread_stats.h */
+static struct thread_stats *wstats;
+
+/*
+ * Per-thread operation traces, kept until the module
+ * is removed so that they can be read back from debugfs
+ */
+static struct op_traces traces;
+static struct dentry *debugfs_dir;
+
+/* Stage durations of every run, see run_stats.h */
+static struct run_stats rstats;
+static unsigned int current_run;
 
 /* Translation functions to go from string to enum */
 static LOCKTYPE_T translate_lock_string(void)
@@ -108,129 +436,792 @@ static TREETYPE_T translate_tree_string(void)
 	return (TREETYPE_T)i;
 }
 
+static WORKLOAD_T translate_workload_string(void)
+{
+	int i = 0;
+	char *type;
+	while(possible_workloads[i]){
+		type = possible_workloads[i];
+		if(!strncmp(workload, type, strlen(type)))
+			break;
+		i++;
+	}
+	/* Was the type found? */
+	if(!possible_workloads[i]){
+		pr_err("Invalid workload string, falling back to default POINT\n");
+		return POINT;
+	}
+	return (WORKLOAD_T)i;
+}
+
+/* Critical section work, run with the lock held */
+static void do_cs_work(int id)
+{
+	if(!busy_work_empty(&cs_work))
+		busy_work_run(id, &cs_work);
+}
+
+/*
+ * Lock holder preemption, a writer gives its CPU away with
+ * the write lock held, as an involuntary preemption would,
+ * once every holder_preempt of its operations. Only allowed
+ * under sleeping locks.
+ */
+static void do_holder_preempt(int id)
+{
+	if(holder_preempt && !(READ_ONCE(wstats[id].progress) % holder_preempt))
+		yield();
+}
+
+static PAYLOADDIST_T translate_payload_dist_string(void)
+{
+	int i = 0;
+	char *type;
+	while(possible_payload_dists[i]){
+		type = possible_payload_dists[i];
+		if(!strncmp(payload_dist, type, strlen(type)))
+			break;
+		i++;
+	}
+	/* Was the type found? */
+	if(!possible_payload_dists[i]){
+		pr_err("Invalid payload distribution string, falling back to default FIXED\n");
+		return PAYLOAD_FIXED;
+	}
+	return (PAYLOADDIST_T)i;
+}
+
+static READMODE_T translate_read_mode_string(void)
+{
+	int i = 0;
+	char *type;
+	while(possible_read_modes[i]){
+		type = possible_read_modes[i];
+		if(!strncmp(read_value, type, strlen(type)))
+			break;
+		i++;
+	}
+	/* Was the type found? */
+	if(!possible_read_modes[i]){
+		pr_err("Invalid read mode string, falling back to default NONE\n");
+		return READ_NONE;
+	}
+	return (READMODE_T)i;
+}
+
+static KEYTYPE_T translate_key_type_string(void)
+{
+	int i = 0;
+	char *type;
+	while(possible_key_types[i]){
+		type = possible_key_types[i];
+		if(!strncmp(key_type, type, strlen(type)))
+			break;
+		i++;
+	}
+	/* Was the type found? */
+	if(!possible_key_types[i]){
+		pr_err("Invalid key type string, falling back to default U64\n");
+		return KEY_U64;
+	}
+	return (KEYTYPE_T)i;
+}
+
+static IRQREADERS_T translate_irq_readers_string(void)
+{
+	int i = 0;
+	char *type;
+	while(possible_irq_readers[i]){
+		type = possible_irq_readers[i];
+		if(!strncmp(irq_readers, type, strlen(type)))
+			break;
+		i++;
+	}
+	/* Was the type found? */
+	if(!possible_irq_readers[i]){
+		pr_err("Invalid interrupt readers string, falling back to default NONE\n");
+		return IRQ_READERS_NONE;
+	}
+	return (IRQREADERS_T)i;
+}
+
+static SCHEDMIX_T translate_sched_mix_string(void)
+{
+	int i = 0;
+	char *type;
+	while(possible_sched_mixes[i]){
+		type = possible_sched_mixes[i];
+		if(!strncmp(sched_mix, type, strlen(type)))
+			break;
+		i++;
+	}
+	/* Was the type found? */
+	if(!possible_sched_mixes[i]){
+		pr_err("Invalid scheduling mix string, falling back to default NONE\n");
+		return SCHED_MIX_NONE;
+	}
+	return (SCHEDMIX_T)i;
+}
+
+/* Tree key of a trace key, the trace key itself or its string key */
+static inline u64 tree_key(u64 key)
+{
+	if(global_lt.key_type == KEY_STRING)
+		return (uintptr_t)key_table_get(key);
+	return key;
+}
+
+/*
+ * Tree keys of the range of op->arg keys from op->key. String
+ * keys are spread over the key space, so their range is the
+ * byte order range between the string keys of its two ends,
+ * ordered, and covers a varying number of keys.
+ */
+static void tree_range(struct trace_op *op, u64 *lo, u64 *hi)
+{
+	*lo = tree_key(op->key);
+	*hi = tree_key(op->key + op->arg);
+	if(global_lt.key_type == KEY_STRING && lt_skey_cmp(*lo, *hi) > 0)
+		swap(*lo, *hi);
+}
+
+/*
+ * Write paths, either a plain locked operation
+ * or a request published for the combiner
+ */
+static int do_insert_data(int id, const void *data, size_t len, u64 offset)
+{
+	int ret;
+
+	if(combining)
+		return lt_combined_insert_data(&global_lt, id, data, len, offset);
+	lt_write_lock(&global_lt);
+	ret = lt_insert_data(&global_lt, data, len, offset);
+	do_cs_work(id);
+	do_holder_preempt(id);
+	lt_write_unlock(&global_lt);
+	return ret;
+}
+
+static int do_insert_ref(int id, struct lt_value *value, u64 offset)
+{
+	int ret;
+
+	if(combining)
+		return lt_combined_insert_ref(&global_lt, id, value, offset);
+	lt_write_lock(&global_lt);
+	ret = lt_insert_ref(&global_lt, value, offset);
+	do_cs_work(id);
+	do_holder_preempt(id);
+	lt_write_unlock(&global_lt);
+	return ret;
+}
+
+/* POINT workload values, shared from the pool or copied */
+static int do_insert_payload(int id, u64 key)
+{
+	struct lt_value *value = payload_ref(key);
+
+	if(value)
+		return do_insert_ref(id, value, tree_key(key));
+	return do_insert_data(id, payload_source(), payload_len(key),
+			tree_key(key));
+}
+
+/* Search, caller holds the read lock */
+static char *do_search(int id, u64 offset)
+{
+	char *found;
+
+	switch(global_read_mode){
+		case READ_COPY:
+			found = payload_scratch(id);
+			if(lt_search_copy(&global_lt, offset, found,
+						payload_max_len()) < 0)
+				found = NULL;
+			return found;
+		case READ_TOUCH:
+			found = lt_search(&global_lt, offset);
+			if(found)
+				payload_read(found);
+			return found;
+		default:
+			return lt_search(&global_lt, offset);
+	}
+}
+
+/*
+ * Lookaside cache hit, without the lock. The value stays
+ * valid until rcu_read_unlock(), so it is copied or read here.
+ */
+static char *do_cached_search(int id, u64 offset)
+{
+	char *found;
+
+	if(!lookaside)
+		return NULL;
+	rcu_read_lock();
+	found = lt_lookaside_search(&global_lt, offset);
+	if(found){
+		switch(global_read_mode){
+			case READ_COPY:
+				memcpy(payload_scratch(id), found, min(payload_max_len(),
+							lt_value_of(found)->len));
+				found = payload_scratch(id);
+				break;
+			case READ_TOUCH:
+				payload_read(found);
+				break;
+			default:
+				break;
+		}
+	}
+	rcu_read_unlock();
+	return found;
+}
+
+static unsigned long do_erase_range(int id, struct trace_op *op)
+{
+	unsigned long ret;
+	u64 lo, hi;
+
+	tree_range(op, &lo, &hi);
+	if(combining)
+		return lt_combined_erase_range(&global_lt, id, lo, hi);
+	lt_write_lock(&global_lt);
+	ret = lt_erase_range(&global_lt, lo, hi);
+	do_cs_work(id);
+	do_holder_preempt(id);
+	lt_write_unlock(&global_lt);
+	return ret;
+}
+
+static int do_erase(int id, u64 offset)
+{
+	int ret;
+
+	if(combining)
+		return lt_combined_erase(&global_lt, id, offset);
+	lt_write_lock(&global_lt);
+	ret = lt_erase(&global_lt, offset);
+	do_cs_work(id);
+	do_holder_preempt(id);
+	lt_write_unlock(&global_lt);
+	return ret;
+}
+
+/*
+ * Workload generators, run before the first stage
+ * to fill the per-thread traces. Each thread's share
+ * is generated from its own PRNG state seeded with
+ * seed + id, so a given seed always yields the same trace.
+ */
+
 /* 
  * First stage: Each thread inserts
- * num_ops/num_threads entries on the tree
- * The key used is the linear offset based 
- * on the thread id, and the data is the 
- * string "dummy_data"
- *
+ * tree_size/num_threads entries on the tree
+ * The keys are the linear offsets of the
+ * thread's own share of 1 to tree_size, so
+ * the tree ends up with exactly tree_size keys,
+ * and the data is a payload of the configured
+ * size, by default the string "dummy_data"
+ */
+static void point_gen_insert(int id, struct op_trace *trace,
+		struct rnd_state *rnd)
+{
+	unsigned long i, first = id * (tree_size / num_threads) + 1;
+
+	for(i=0;i<trace->len;i++){
+		trace->ops[i].type = OP_INSERT;
+		trace->ops[i].key = first + i;
+		trace->ops[i].arg = 0;
+	}
+}
+
+/* Uniform in [0, n), tree_size may be past 32 bits */
+static unsigned long rand_below(struct rnd_state *rnd, unsigned long n)
+{
+	unsigned long r = prandom_u32_state(rnd);
+
+#if BITS_PER_LONG == 64
+	if(n > U32_MAX)
+		r = (r << 32) | prandom_u32_state(rnd);
+#endif
+	return r % n;
+}
+
+/*
  * Second stage: Each thread performs lookups/deletes
  * randomly, while adhering to the global delete ratio,
  * and chooses a random offset for the operation
  */
+static void point_gen_search_erase(int id, struct op_trace *trace,
+		struct rnd_state *rnd)
+{
+	unsigned long i, deletes_remaining;
+	unsigned int rand_op;
+
+	deletes_remaining = trace->len * del_ratio / 100;
+	for(i=0;i<trace->len;i++){
+		rand_op = prandom_u32_state(rnd) % 2;
+		trace->ops[i].key = rand_below(rnd, tree_size) + 1;
+		trace->ops[i].arg = 0;
+		/* order_ratio percent are queries, drawn only if enabled */
+		if(order_ratio && prandom_u32_state(rnd) % 100 < order_ratio){
+			trace->ops[i].type = OP_RANK + prandom_u32_state(rnd) % 3;
+			if(trace->ops[i].type == OP_SELECT)
+				trace->ops[i].key--;
+			else if(trace->ops[i].type == OP_COUNT_RANGE)
+				trace->ops[i].arg = range_len;
+			continue;
+		}
+		/* 
+		 * 0 for lookup, 1 for delete 
+		 * Only delete as long as it is possible
+		 * while conforming to the ratio parameter
+		 */
+		if(rand_op && deletes_remaining){
+			deletes_remaining--;
+			trace->ops[i].type = OP_ERASE;
+			if(range_erase_ratio &&
+					prandom_u32_state(rnd) % 100 < range_erase_ratio){
+				trace->ops[i].type = OP_ERASE_RANGE;
+				trace->ops[i].arg = range_len;
+			}
+		}else{
+			trace->ops[i].type = OP_SEARCH;
+		}
+	}
+}
+
+/*
+ * Address space emulation, modelled on how an mm
+ * uses the cb_tree. The address space, in pages, is
+ * split in tree_size slots of VMA_SLOT_PAGES, each holding
+ * at most one region that starts at the slot base, so
+ * regions never overlap and there are unmapped gaps
+ * between them. Keys are region starts and values carry
+ * the region bounds.
+ */
+enum { VMA_SLOT_PAGES = 16 };
+
+struct vma_region {
+	uint32_t start;
+	uint32_t end;
+};
+
+static void vma_gen_region(struct trace_op *op, unsigned long slot,
+		struct rnd_state *rnd)
+{
+	op->type = OP_MAP;
+	op->key = (u64)slot * VMA_SLOT_PAGES;
+	/* Leave at least one unmapped page after every region */
+	op->arg = op->key + 1 + prandom_u32_state(rnd) % (VMA_SLOT_PAGES - 1);
+}
+
+/*
+ * First stage: Each thread maps the regions of an interleaved
+ * set of the first q * num_threads slots, q the even share of
+ * every thread. The last thread's trace also holds the
+ * remainder, it maps the slots left at the end in order.
+ */
+static void vma_gen_map(int id, struct op_trace *trace, struct rnd_state *rnd)
+{
+	unsigned long q = tree_size / num_threads;
+	unsigned long i;
+
+	for(i=0;i<trace->len;i++)
+		vma_gen_region(&trace->ops[i], i < q ? i * num_threads + id :
+				q * num_threads + (i - q), rnd);
+}
+
+/*
+ * Second stage: fault_ratio percent of the operations
+ * are page faults, a floor search on a random page whose
+ * result is checked against the region end, the rest are
+ * an even mix of mmap and munmap of a random slot
+ */
+static void vma_gen_fault(int id, struct op_trace *trace, struct rnd_state *rnd)
+{
+	unsigned long i, slot;
+
+	for(i=0;i<trace->len;i++){
+		struct trace_op *op = &trace->ops[i];
+
+		if(prandom_u32_state(rnd) % 100 < fault_ratio){
+			op->type = OP_FAULT;
+			op->key = prandom_u32_state(rnd) % (tree_size * VMA_SLOT_PAGES);
+			op->arg = 0;
+			continue;
+		}
+		slot = prandom_u32_state(rnd) % tree_size;
+		if(prandom_u32_state(rnd) % 2){
+			vma_gen_region(op, slot, rnd);
+		}else{
+			op->type = OP_ERASE;
+			op->key = (u64)slot * VMA_SLOT_PAGES;
+			op->arg = 0;
+		}
+	}
+}
+
+static void generate_traces(unsigned long trace_seed)
+{
+	struct rnd_state rnd;
+	int i;
+
+	for(i=0;i<num_threads;i++){
+		struct op_trace *insert = &traces.stage[STAGE_INSERT][i];
+		struct op_trace *search = &traces.stage[STAGE_SEARCH_ERASE][i];
+
+		prandom_seed_state(&rnd, trace_seed + i);
+		if(global_workload == VMA){
+			vma_gen_map(i, insert, &rnd);
+			vma_gen_fault(i, search, &rnd);
+		}else{
+			point_gen_insert(i, insert, &rnd);
+			point_gen_search_erase(i, search, &rnd);
+		}
+	}
+}
+
+/* llc_kb, or the last level cache the boot CPU reports, 0 if unknown */
+static unsigned int llc_size_kb(void)
+{
+	if(llc_kb)
+		return llc_kb;
+#ifdef CONFIG_X86
+	if(boot_cpu_data.x86_cache_size > 0)
+		return boot_cpu_data.x86_cache_size;
+#endif
+	return 0;
+}
+
+/*
+ * Estimated bytes of a tree of tree_size keys, its nodes,
+ * values and string keys, printed against the last level
+ * cache and with bench_output as "bench_ws <tree_size>
+ * <ops> <bytes> <llc bytes>" for tools/size_sweep.sh.
+ * Allocator rounding is left out.
+ */
+static void working_set_report(void)
+{
+	u64 bytes = (u64)tree_size * lt_node_bytes(&global_lt);
+	u64 llc = (u64)llc_size_kb() * 1024;
+
+	if(global_workload == VMA)
+		bytes += (u64)tree_size * (sizeof(struct lt_value) +
+				sizeof(struct vma_region));
+	else
+		bytes += payload_bytes(tree_size);
+	if(global_lt.key_type == KEY_STRING)
+		bytes += (u64)tree_size * (sizeof(struct lt_skey) + key_len);
+
+	if(llc)
+		pr_info("Working set of %lu keys: about %llu KiB, %llu.%02llu times "
+				"the %llu KiB last level cache\n", tree_size, bytes >> 10,
+				div64_u64(bytes, llc), div64_u64(bytes * 100, llc) % 100,
+				llc >> 10);
+	else
+		pr_info("Working set of %lu keys: about %llu KiB, last level cache "
+				"size unknown, set llc_kb\n", tree_size, bytes >> 10);
+	if(bench_output)
+		pr_info("bench_ws %lu %lu %llu %llu\n", tree_size, ops, bytes, llc);
+}
+
+/* Order statistics query, caller holds the read lock */
+static unsigned long do_query(struct trace_op *op)
+{
+	u64 lo, hi;
+
+	switch(op->type){
+		case OP_RANK:
+			return lt_rank(&global_lt, tree_key(op->key));
+		case OP_SELECT:
+			return lt_select(&global_lt, op->key) != NULL;
+		default:
+			tree_range(op, &lo, &hi);
+			return lt_count_range(&global_lt, lo, hi);
+	}
+}
+
+/* Largest key a trace op turns into a tree key, 0 for none */
+static u64 traces_max_key(void)
+{
+	int stage, i;
+	unsigned long j;
+	u64 key, max_key = 0;
+
+	for(stage=0;stage<NUM_STAGES;stage++){
+		for(i=0;i<num_threads;i++){
+			struct op_trace *trace = &traces.stage[stage][i];
+
+			for(j=0;j<trace->len;j++){
+				struct trace_op *op = &trace->ops[j];
+
+				/* Select takes a rank, not a key */
+				if(op->type == OP_SELECT)
+					continue;
+				key = op->key;
+				if(op->type == OP_ERASE_RANGE ||
+						op->type == OP_COUNT_RANGE)
+					key += op->arg;
+				max_key = max(max_key, key);
+			}
+		}
+	}
+	return max_key;
+}
+
+static bool traces_have_queries(void)
+{
+	int stage, i;
+	unsigned long j;
+
+	for(stage=0;stage<NUM_STAGES;stage++){
+		for(i=0;i<num_threads;i++){
+			struct op_trace *trace = &traces.stage[stage][i];
+
+			for(j=0;j<trace->len;j++)
+				if(trace->ops[j].type >= OP_RANK &&
+						trace->ops[j].type <= OP_COUNT_RANGE)
+					return true;
+		}
+	}
+	return false;
+}
+
+/* Timed loop, replays a thread's trace for one stage */
+static void replay_stage(int id, struct op_trace *trace,
+		struct thread_stats *ts, struct stage_stats *ss)
+{
+	unsigned long i;
+	struct vma_region vma, *region;
+	char *found_str;
+
+	for(i=0;i<trace->len;i++){
+		struct trace_op *op = &trace->ops[i];
+
+		/* Let a stalled thread have the CPU back and end the run */
+		if(stall_monitor_aborted())
+			break;
+
+		switch(op->type){
+			case OP_INSERT:
+				do_insert_payload(id, op->key);
+				ss->inserts++;
+				break;
+			case OP_SEARCH:
+				found_str = do_cached_search(id, tree_key(op->key));
+				if(!found_str){
+					lt_read_lock(&global_lt);
+					found_str = do_search(id, tree_key(op->key));
+					do_cs_work(id);
+					lt_read_unlock(&global_lt);
+				}
+				ss->searches++;
+				if(found_str)
+					ss->hits++;
+				break;
+			case OP_ERASE:
+				do_erase(id, tree_key(op->key));
+				ss->erases++;
+				break;
+			case OP_ERASE_RANGE:
+				do_erase_range(id, op);
+				ss->erases++;
+				break;
+			case OP_MAP:
+				vma.start = op->key;
+				vma.end = op->arg;
+				do_insert_data(id, &vma, sizeof(vma), vma.start);
+				ss->inserts++;
+				break;
+			case OP_FAULT:
+				lt_read_lock(&global_lt);
+				region = (struct vma_region *)lt_search_le(&global_lt,
+						op->key);
+				found_str = region && op->key < region->end ?
+					(char *)region : NULL;
+				do_cs_work(id);
+				lt_read_unlock(&global_lt);
+				ss->searches++;
+				if(found_str)
+					ss->hits++;
+				break;
+			case OP_RANK:
+			case OP_SELECT:
+			case OP_COUNT_RANGE:
+				lt_read_lock(&global_lt);
+				do_query(op);
+				do_cs_work(id);
+				lt_read_unlock(&global_lt);
+				ss->queries++;
+				break;
+		}
+		thread_stats_tick(ts);
+		if(!busy_work_empty(&think_work))
+			busy_work_run(id, &think_work);
+	}
+}
+
 static int tree_operation_thread(void *arg)
 {
 	int id = *(int *)arg;
-	unsigned int i, per_thread_ops = num_ops / num_threads;
-	unsigned int rand_op, rand_offset, deletes_remaining;
-	char *found_str;
+	struct thread_stats *ts = &wstats[id];
+	struct stage_stats *ss;
 	/* ns accuracy kernel timers */	
 	ktime_t time_start, time_done, time_diff;
 
 	/*
-	 * Add remainder to last thread if necessary
+	 * Begin first stage in a coordinated manner. Every
+	 * barrier gives up once the stall monitor aborts, a
+	 * thread that cut its stage short must not wait for
+	 * one that never will
 	 */
-	if(id == num_threads - 1)
-		per_thread_ops += num_ops % num_threads;
-	deletes_remaining = per_thread_ops * del_ratio / 100;
-
-	/* Begin first stage in a coordinated manner */
-	simple_barrier_wait(&stage_one);
+	if(simple_barrier_wait_abortable(&stage_one, stall_monitor_aborted))
+		return -1;
 
 	if(!id)
 		time_start = ktime_get();
 
 	/* Start first stage */
-	for(i=0;i<per_thread_ops;i++){
-		lt_write_lock(&global_lt);
-		lt_insert(&global_lt, "dummy_data", (id * i) + 1);
-		lt_write_unlock(&global_lt);
-	}
+	ss = &ts->stage_stats[STAGE_INSERT];
+	trace_lt_stage_begin(STAGE_INSERT, id);
+	thread_stats_begin(ts, STAGE_INSERT);
+	replay_stage(id, &traces.stage[STAGE_INSERT][id], ts, ss);
+	ss->ops = ss->searches + ss->inserts + ss->erases + ss->queries;
+	thread_stats_end(ts, STAGE_INSERT);
+	trace_lt_stage_end(STAGE_INSERT, id);
 
 	/* 
 	 * Synchronize to start second stage,
 	 * coordinator must also time things
 	 */
-	simple_barrier_wait(&stage_two);
+	if(simple_barrier_wait_abortable(&stage_two, stall_monitor_aborted))
+		return -1;
 	if(!id){
 		time_done = ktime_get();
 		time_diff = ktime_sub(time_done, time_start);
 		pr_info("Insert stage took %lld ms\n", ktime_to_ms(time_diff));
+		run_stats_record(&rstats, current_run, STAGE_INSERT, time_diff);
+		thread_stats_report(wstats, num_threads, STAGE_INSERT, "Insert");
+		lt_lock_report(&global_lt, "Insert");
+		irq_readers_report("Insert");
+		snap_scan_report("Insert");
+		if(layout_report)
+			lt_tree_report(&global_lt);
 		time_start = ktime_get();
 	}
 
 	/* Start second stage */
-	for(i=0;i<per_thread_ops;i++){
-		rand_op = get_random_int() % 2;
-		rand_offset = (get_random_int() % num_ops) + 1;
-		/* 
-		 * 0 for lookup, 1 for delete 
-		 * Only delete as long as it is possible
-		 * while conforming to the ratio parameter
-		 */
-		if(rand_op && deletes_remaining){
-			deletes_remaining--;
-			lt_write_lock(&global_lt);
-			lt_erase(&global_lt, rand_offset);
-			lt_write_unlock(&global_lt);
-		}else{
-			lt_read_lock(&global_lt);
-			found_str = lt_search(&global_lt, rand_offset);
-			lt_read_unlock(&global_lt);
-		}
-	}
+	ss = &ts->stage_stats[STAGE_SEARCH_ERASE];
+	trace_lt_stage_begin(STAGE_SEARCH_ERASE, id);
+	thread_stats_begin(ts, STAGE_SEARCH_ERASE);
+	replay_stage(id, &traces.stage[STAGE_SEARCH_ERASE][id], ts, ss);
+	ss->ops = ss->searches + ss->inserts + ss->erases + ss->queries;
+	thread_stats_end(ts, STAGE_SEARCH_ERASE);
+	trace_lt_stage_end(STAGE_SEARCH_ERASE, id);
 
 	/* Synchronize to complete together */
-	simple_barrier_wait(&finish);
+	if(simple_barrier_wait_abortable(&finish, stall_monitor_aborted))
+		return -1;
 
 	if(!id){
 		time_done = ktime_get();
 		time_diff = ktime_sub(time_done, time_start);
 		pr_info("Search/Erase stage took %lld ms\n", ktime_to_ms(time_diff));
+		run_stats_record(&rstats, current_run, STAGE_SEARCH_ERASE, time_diff);
+		thread_stats_report(wstats, num_threads, STAGE_SEARCH_ERASE,
+				"Search/Erase");
+		lt_lock_report(&global_lt, "Search/Erase");
+		irq_readers_report("Search/Erase");
+		snap_scan_report("Search/Erase");
 	}
 	return 0;
 }
 
-static int __init kernel_locks_init(void)
+/*
+ * Workers stay around after their stages until the
+ * coordinator stops them, so that every worker of a run
+ * is gone before the barriers are reset for the next one
+ */
+static int worker_thread(void *arg)
 {
-	int i, *thread_ids;
-	struct task_struct **workers;
+	tree_operation_thread(arg);
+	if(atomic_dec_and_test(&workers_running))
+		wake_up(&workers_done);
 
-	/* Setup our lock-tree structure */
-	global_lt.lock_type = translate_lock_string();
-	global_lt.tree_type = translate_tree_string();
+	set_current_state(TASK_INTERRUPTIBLE);
+	while(!kthread_should_stop()){
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
 
-	if(del_ratio > 100){
-		pr_err("Invalid delete ratio argument, defaulting to 20%%\n");
-		del_ratio = 20;
+/* Applied to the workers only, the coordinator is the insmod process */
+static void worker_set_sched(struct task_struct *task, int id)
+{
+	bool fifo = id % 4 == 1;
+
+	switch(global_sched_mix){
+		case SCHED_MIX_FIFO:
+			if(fifo)
+				sched_set_fifo_low(task);
+			break;
+		case SCHED_MIX_MIXED:
+			if(fifo){
+				sched_set_fifo_low(task);
+				break;
+			}
+			/* fall through */
+		case SCHED_MIX_NICE:
+			set_user_nice(task, (id % 3 - 1) * 10);
+			break;
+		default:
+			break;
 	}
+}
 
-	lt_init_lock(&global_lt);
-	lt_init_tree(&global_lt);
+/*
+ * After an abort, gives the workers stall_abort_ms to leave
+ * their stages and names the ones that did not. Those are
+ * blocked inside a lock that will never be released and
+ * cannot be recovered: nothing can pull a thread out of
+ * lt_write_lock() or lt_read_lock(), and the tree and traces
+ * they use cannot be freed under them, so stopping them
+ * waits for good.
+ */
+static void run_wait_aborted(void)
+{
+	int i;
+
+	if(wait_event_timeout(workers_done, !atomic_read(&workers_running),
+				msecs_to_jiffies(stall_abort_ms)))
+		return;
+	for(i=1;i<num_threads;i++)
+		if(READ_ONCE(wstats[i].stage) >= 0)
+			pr_err("Thread %d is stuck inside its stage, most likely in the "
+					"lock, and cannot be recovered, waiting for it\n", i);
+}
+
+/* One run of both stages on the current tree */
+static int run_once(int *thread_ids, struct task_struct **workers)
+{
+	int i;
 
 	/* Initialize barriers */
 	simple_barrier_init(&stage_one, num_threads);
 	simple_barrier_init(&stage_two, num_threads);
 	simple_barrier_init(&finish, num_threads);
-
-	/* Allocate memory for worker ids and task pointers */
-	thread_ids = kmalloc(num_threads * sizeof(*thread_ids), GFP_KERNEL);
-	if(!thread_ids){
-		pr_err("Could not kmalloc thread id array\n");
-		return -1;
-	}
-
-	workers = kmalloc((num_threads - 1) * sizeof(*workers), GFP_KERNEL);
-	if(!workers){
-		pr_err("Could not kmalloc task_struct pointer array\n");
-		kfree(thread_ids);
-		return -1;
-	}
+	thread_stats_reset(wstats, num_threads);
+	atomic_set(&workers_running, 0);
 
 	for(i = 1;i < num_threads;i++){
 		thread_ids[i] = i;
-		workers[i - 1] = kthread_create(tree_operation_thread, &thread_ids[i],
+		workers[i - 1] = kthread_create(worker_thread, &thread_ids[i],
 				"lock_tree_worker-%d", i);
 
 		if(IS_ERR(workers[i - 1])){
@@ -242,25 +1233,394 @@ static int __init kernel_locks_init(void)
 			 */
 			for(j=1;j<i;j++)
 				kthread_stop(workers[j-1]);
-			kfree(thread_ids);
-			kfree(workers);
 			return -1;
 		}
 		/* Round-robin CPU bind, then wakeup */
 		kthread_bind(workers[i - 1], i % num_online_cpus());
+		worker_set_sched(workers[i - 1], i);
+		atomic_inc(&workers_running);
 		wake_up_process(workers[i - 1]);
 	}
 	/* Actual module process becomes coordinator */
 	thread_ids[0] = 0;
 	tree_operation_thread((void *)&thread_ids[0]);
+	if(stall_monitor_aborted())
+		run_wait_aborted();
+
+	for(i = 1;i < num_threads;i++)
+		kthread_stop(workers[i - 1]);
+	return 0;
+}
+
+/*
+ * Teardown stage, the tree of every run is destroyed
+ * and timed right after it, instead of leaving the
+ * last one to stall rmmod
+ */
+static void teardown_stage(unsigned int run)
+{
+	ktime_t time_start, time_diff;
+
+	time_start = ktime_get();
+	lt_destroy_tree_parallel(&global_lt, teardown_parts);
+	time_diff = ktime_sub(ktime_get(), time_start);
+	pr_info("Teardown stage took %lld ms (%u parts)\n",
+			ktime_to_ms(time_diff), teardown_parts);
+	run_stats_record(&rstats, run, RUN_STAGE_TEARDOWN, time_diff);
+}
+
+static int __init kernel_locks_init(void)
+{
+	int *thread_ids;
+	unsigned int run;
+	struct task_struct **workers, *monitor;
+	IRQREADERS_T irq_mode;
+
+	/* Setup our lock-tree structure */
+	global_lt.lock_type = translate_lock_string();
+	global_lt.tree_type = translate_tree_string();
+	global_workload = translate_workload_string();
+	global_read_mode = translate_read_mode_string();
+	global_lt.key_type = translate_key_type_string();
+	global_lt.prefix_cache = key_prefix;
+
+	if(del_ratio > 100){
+		pr_err("Invalid delete ratio argument, defaulting to 20%%\n");
+		del_ratio = 20;
+	}
+
+	if(range_erase_ratio > 100){
+		pr_err("Invalid range erase ratio argument, defaulting to 0\n");
+		range_erase_ratio = 0;
+	}
+
+	if(order_ratio > 100){
+		pr_err("Invalid order statistics ratio argument, defaulting to 0\n");
+		order_ratio = 0;
+	}
+
+	if(oversubscribe > 8){
+		pr_err("Invalid oversubscribe argument, clamping to 8\n");
+		oversubscribe = 8;
+	}
+	if(oversubscribe){
+		num_threads = oversubscribe * num_online_cpus();
+		pr_info("Oversubscribed %ux: %u threads on %u online CPUs\n",
+				oversubscribe, num_threads, num_online_cpus());
+	}
+	global_sched_mix = translate_sched_mix_string();
+
+	/* Spinning locks and RCU read sections must not schedule */
+	if(holder_preempt && ((global_lt.lock_type != MUTEX &&
+				global_lt.lock_type != RWSEM) ||
+				global_lt.tree_type == SKIPLIST)){
+		pr_err("Lock holders can only yield under MUTEX and RWSEM on the "
+				"trees, disabling holder_preempt\n");
+		holder_preempt = 0;
+	}
+	/* Combined writes return before the holder would yield */
+	if(holder_preempt && combining){
+		pr_err("Lock holders do not yield under flat combining, "
+				"disabling holder_preempt\n");
+		holder_preempt = 0;
+	}
+
+	if(stall_abort_ms && !stall_ms){
+		pr_err("Aborting stalled runs needs the stall monitor, disabling it\n");
+		stall_abort_ms = 0;
+	}
+	if(stall_abort_ms && stall_abort_ms < stall_ms){
+		pr_err("Invalid stall abort argument, raising it to stall_ms\n");
+		stall_abort_ms = stall_ms;
+	}
+
+	if(fault_ratio > 100){
+		pr_err("Invalid fault ratio argument, defaulting to 95%%\n");
+		fault_ratio = 95;
+	}
+
+	if(!payload_size){
+		pr_err("Invalid payload size argument, defaulting to 11\n");
+		payload_size = 11;
+	}
+	if(payload_max < payload_size)
+		payload_max = payload_size;
+
+	/* Region starts are page numbers, floor searched as integers */
+	if(global_workload == VMA && global_lt.key_type != KEY_U64){
+		pr_err("The VMA workload only uses U64 keys, ignoring key_type\n");
+		global_lt.key_type = KEY_U64;
+	}
+
+	/* VMA values are the region bounds themselves */
+	if(global_workload == VMA && payload_pool){
+		pr_err("Payload pool is only used by the POINT workload, ignoring it\n");
+		payload_pool = 0;
+	}
+
+	if(!repeats){
+		pr_err("Invalid repeats argument, defaulting to 1\n");
+		repeats = 1;
+	}
+
+	/* The tree and the work on it scale apart, both default to num_ops */
+	if(!tree_size)
+		tree_size = num_ops;
+	if(!ops)
+		ops = num_ops;
+	if(tree_size < num_threads){
+		pr_err("Invalid tree_size argument, it takes a key per thread, "
+				"using %u\n", num_threads);
+		tree_size = num_threads;
+	}
+
+	/* Region starts are page numbers, keep them in 32 bits */
+	if(global_workload == VMA && tree_size > U32_MAX / VMA_SLOT_PAGES){
+		pr_err("Too many regions for the VMA workload, clamping tree_size\n");
+		tree_size = U32_MAX / VMA_SLOT_PAGES;
+	}
+
+	/*
+	 * Interrupt context can only spin, and RCU_TREE readers
+	 * never block writers, so only RB_TREE spinning locks
+	 * need to turn off bottom halves or interrupts
+	 */
+	irq_mode = translate_irq_readers_string();
+	if(irq_mode != IRQ_READERS_NONE && global_lt.tree_type == RB_TREE){
+		if(global_lt.lock_type != RWLOCK && global_lt.lock_type != SPINLOCK){
+			pr_err("Interrupt context readers need RWLOCK or SPINLOCK, "
+					"disabling them\n");
+			irq_mode = IRQ_READERS_NONE;
+		}else{
+			global_lt.irq_safe = irq_mode == IRQ_READERS_SOFTIRQ ?
+				LT_IRQ_BH : LT_IRQ_HARD;
+		}
+	}
+
+	/* Only whole path copies leave versions a snapshot can pin */
+	if(snapshot_ms && (global_lt.tree_type != RCU_TREE || !cb_persistent)){
+		pr_err("Snapshot scans need RCU_TREE and cb_persistent, "
+				"disabling them\n");
+		snapshot_ms = 0;
+	}
+
+	if(bulk_check && global_lt.tree_type != RCU_TREE){
+		pr_err("Bulk operations are only checked on RCU_TREE, skipping them\n");
+		bulk_check = 0;
+	}
+
+	if(lt_init_lock(&global_lt)){
+		pr_err("Could not initialize lock\n");
+		return -1;
+	}
+	cb_set_recursive(cb_recursive);
+	cb_set_prefetch(cb_prefetch);
+	cb_set_magazines(cb_magazines);
+	cb_set_persistent(cb_persistent);
+	lt_init_tree(&global_lt);
+	if(combining && lt_init_combining(&global_lt, num_threads)){
+		pr_err("Could not initialize flat combining, using plain writes\n");
+		combining = false;
+	}
+	if(lookaside && lt_init_lookaside(&global_lt, lookaside)){
+		pr_err("Could not allocate the lookaside cache, searches go to the tree\n");
+		lookaside = 0;
+	}
+	/* On scratch trees, sharing the node cache of the one just set up */
+	if(bulk_check && bulk_check_run(bulk_check, num_online_cpus()))
+		goto out_lt;
+
+	cs_work.cycles = cs_cycles;
+	cs_work.lines = cs_lines;
+	think_work.cycles = think_cycles;
+	think_work.lines = think_lines;
+	if(busy_work_init(num_threads, max(cs_lines, think_lines), shared_work))
+		goto out_lt;
+	/* The combiner does the critical section work of every write it applies */
+	if(combining)
+		global_lt.fc.cs_work = do_cs_work;
+
+	if(payload_init(translate_payload_dist_string(), payload_size, payload_max,
+				payload_pool,
+				global_read_mode == READ_COPY ? num_threads : 0))
+		goto out_work;
+
+	/* Lay out the whole workload before anything is timed */
+	if(trace_file){
+		if(op_traces_load(&traces, num_threads, trace_file))
+			goto out_payload;
+	}else{
+		unsigned long stage_ops[NUM_STAGES] = {tree_size, ops};
+		unsigned long trace_seed = seed ? seed : get_random_u32();
+
+		if(op_traces_alloc(&traces, num_threads, stage_ops))
+			goto out_payload;
+		generate_traces(trace_seed);
+		pr_info("Generated %s workload traces with seed %lu\n",
+				possible_workloads[global_workload], trace_seed);
+		working_set_report();
+	}
+	/* The RB tree only keeps subtree sizes if something queries them */
+	global_lt.order_stats = traces_have_queries();
+
+	/*
+	 * A string key per trace key, range ends included, and
+	 * per key the interrupt context readers may search
+	 */
+	if(global_lt.key_type == KEY_STRING &&
+			key_table_init(max(traces_max_key(), (u64)tree_size) + 1,
+				key_len, key_shared))
+		goto out_traces;
+
+	debugfs_dir = debugfs_create_dir("lock_tree", NULL);
+	if(IS_ERR_OR_NULL(debugfs_dir)){
+		pr_err("Could not create debugfs directory, trace not exported\n");
+		debugfs_dir = NULL;
+	}else{
+		op_traces_debugfs_init(&traces, debugfs_dir);
+	}
+
+	/* Interrupt context searches draw from the keys of the POINT workload */
+	if(irq_readers_init(&global_lt, irq_mode, irq_period_us, tree_size, tree_key,
+				seed))
+		goto out_keys;
+
+	if(snap_scan_init(&global_lt, snapshot_ms))
+		goto out_irq;
+
+	if(run_stats_alloc(&rstats, warmup, repeats))
+		goto out_scan;
+
+	/* Allocate memory for worker ids, stats and task pointers */
+	thread_ids = kmalloc(num_threads * sizeof(*thread_ids), GFP_KERNEL);
+	if(!thread_ids){
+		pr_err("Could not kmalloc thread id array\n");
+		goto out_rstats;
+	}
+
+	wstats = thread_stats_alloc(num_threads);
+	if(!wstats){
+		pr_err("Could not kmalloc thread stats array\n");
+		goto out_ids;
+	}
+
+	workers = kmalloc((num_threads - 1) * sizeof(*workers), GFP_KERNEL);
+	if(!workers){
+		pr_err("Could not kmalloc task_struct pointer array\n");
+		goto out_stats;
+	}
+
+	monitor = stall_monitor_start(wstats, num_threads, stall_ms,
+			stall_abort_ms);
+
+	if(!teardown_parts)
+		teardown_parts = min(num_online_cpus() * 4, 256U);
+
+	/*
+	 * Every run replays the same traces on a fresh
+	 * tree, warm-up runs are reported but left out
+	 * of the aggregate statistics
+	 */
+	for(run = 0;run < warmup + repeats;run++){
+		if(run)
+			lt_init_tree(&global_lt);
+		if(run < warmup)
+			pr_info("Warm-up run %u of %u\n", run + 1, warmup);
+		else if(warmup + repeats > 1)
+			pr_info("Run %u of %u\n", run - warmup + 1, repeats);
+		current_run = run;
+		irq_readers_start();
+		snap_scan_start();
+		if(run_once(thread_ids, workers)){
+			snap_scan_stop();
+			irq_readers_stop();
+			stall_monitor_stop(monitor);
+			goto out_workers;
+		}
+		/* No snapshot may outlive the tree */
+		snap_scan_stop();
+		irq_readers_stop();
+		teardown_stage(run);
+		if(stall_monitor_aborted()){
+			pr_err("Run %u was cut short by the stall monitor, giving up\n",
+					run + 1);
+			stall_monitor_stop(monitor);
+			goto out_workers;
+		}
+	}
+	stall_monitor_stop(monitor);
+
+	if(repeats > 1){
+		run_stats_report(&rstats, STAGE_INSERT, "Insert");
+		run_stats_report(&rstats, STAGE_SEARCH_ERASE, "Search/Erase");
+		run_stats_report(&rstats, RUN_STAGE_TEARDOWN, "Teardown");
+	}
+	if(bench_output){
+		run_stats_export(&rstats, STAGE_INSERT, "Insert");
+		run_stats_export(&rstats, STAGE_SEARCH_ERASE, "Search/Erase");
+		run_stats_export(&rstats, RUN_STAGE_TEARDOWN, "Teardown");
+	}
+
+	/* The runs tore their trees down, the device gets a new one */
+	if(kv_dev){
+		if(global_lt.key_type != KEY_U64){
+			pr_err("The device only serves U64 keys, not registering it\n");
+		}else{
+			lt_init_tree(&global_lt);
+			kv_dev_register(&global_lt, kv_lock_per_op);
+		}
+	}
+
+	thread_stats_free(wstats);
 	kfree(thread_ids);
 	kfree(workers);
+	run_stats_free(&rstats);
 	return 0;
+
+out_workers:
+	kfree(workers);
+out_stats:
+	thread_stats_free(wstats);
+out_ids:
+	kfree(thread_ids);
+out_rstats:
+	run_stats_free(&rstats);
+out_scan:
+	snap_scan_exit();
+out_irq:
+	irq_readers_exit();
+out_keys:
+	key_table_exit();
+out_traces:
+	debugfs_remove_recursive(debugfs_dir);
+	op_traces_free(&traces);
+out_payload:
+	payload_exit();
+out_work:
+	busy_work_exit();
+out_lt:
+	/* Every failure after lt_init_tree, or the node cache outlives us */
+	lt_destroy_tree(&global_lt);
+	lt_destroy_lookaside(&global_lt);
+	lt_destroy_combining(&global_lt);
+	lt_destroy_lock(&global_lt);
+	return -1;
 }
 
 static void __exit kernel_locks_exit(void)
 {
+	kv_dev_unregister();
+	snap_scan_exit();
+	irq_readers_exit();
+	debugfs_remove_recursive(debugfs_dir);
+	op_traces_free(&traces);
+	busy_work_exit();
 	lt_destroy_tree(&global_lt);
+	payload_exit();
+	key_table_exit();
+	lt_destroy_lookaside(&global_lt);
+	lt_destroy_combining(&global_lt);
+	lt_destroy_lock(&global_lt);
 }
 
 module_init(kernel_locks_init);
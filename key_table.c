@@ -0,0 +1,72 @@
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+#include <linux/printk.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include "key_table.h"
+
+static struct key_table {
+	char *keys;
+	unsigned long num_keys;
+	size_t stride;
+}table;
+
+/* Spread the keys over the hex digits, odd multipliers are a bijection */
+#define KEY_TABLE_MIX	0x9e3779b97f4a7c15ULL
+
+static const char shared_pattern[] = "shared/key/prefix/";
+
+int key_table_init(unsigned long num_keys, unsigned int key_len,
+		unsigned int shared)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned long i;
+	unsigned int j;
+
+	if(key_len < shared + KEY_TABLE_UNIQUE_LEN){
+		key_len = shared + KEY_TABLE_UNIQUE_LEN;
+		pr_warn("String keys need %u bytes past the shared prefix, "
+				"using %u byte keys\n", KEY_TABLE_UNIQUE_LEN, key_len);
+	}
+	table.stride = ALIGN(sizeof(struct lt_skey) + key_len, sizeof(u64));
+	table.num_keys = num_keys;
+	table.keys = vmalloc(num_keys * table.stride);
+	if(!table.keys){
+		pr_err("Could not allocate %lu string keys\n", num_keys);
+		return -1;
+	}
+
+	for(i=0;i<num_keys;i++){
+		struct lt_skey *k = (struct lt_skey *)(table.keys + i * table.stride);
+		u64 mixed = (u64)i * KEY_TABLE_MIX;
+
+		k->len = key_len;
+		for(j=0;j<shared;j++)
+			k->bytes[j] = shared_pattern[j % (sizeof(shared_pattern) - 1)];
+		for(j=0;j<KEY_TABLE_UNIQUE_LEN;j++)
+			k->bytes[shared + j] = hex[(mixed >> (60 - 4 * j)) & 0xf];
+		for(j=shared + KEY_TABLE_UNIQUE_LEN;j<key_len;j++)
+			k->bytes[j] = '.';
+		if(!(i % 65536))
+			cond_resched();
+	}
+	pr_info("Generated %lu string keys of %u bytes, %u shared\n", num_keys,
+			key_len, shared);
+	return 0;
+}
+
+void key_table_exit(void)
+{
+	vfree(table.keys);
+	table.keys = NULL;
+}
+
+struct lt_skey *key_table_get(u64 key)
+{
+	u64 index;
+
+	div64_u64_rem(key, table.num_keys, &index);
+	return (struct lt_skey *)(table.keys + index * table.stride);
+}
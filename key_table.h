@@ -0,0 +1,25 @@
+#ifndef _KEY_TABLE_H
+#define _KEY_TABLE_H
+
+#include <linux/types.h>
+#include "aux_structs.h"
+
+/*
+ * String keys of the POINT workload. Traces keep
+ * integer keys, and every integer key maps to one
+ * string key of key_len bytes laid out in a single
+ * vmalloc'd table, so the tree can store pointers to
+ * them for as long as the module is loaded. The first
+ * shared bytes are common to all keys, to model key
+ * spaces with long common prefixes, and are followed by
+ * 16 hex digits that tell the keys apart.
+ */
+enum { KEY_TABLE_UNIQUE_LEN = 16 };
+
+int key_table_init(unsigned long num_keys, unsigned int key_len,
+		unsigned int shared);
+void key_table_exit(void);
+/* Keys past the table wrap around, size it for the largest key used */
+struct lt_skey *key_table_get(u64 key);
+
+#endif /* _KEY_TABLE_H */
@@ -0,0 +1,328 @@
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+#include <linux/printk.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/jiffies.h>
+#include <linux/err.h>
+#include <linux/log2.h>
+#include "kv_ring.h"
+#include "kv_dev.h"
+
+/*
+ * Character device front-end, every open file can set up
+ * one ring. Entries are applied in submission order, under
+ * one lock acquisition per drain unless lock_per_op is set,
+ * in which case every entry takes the lock on its own.
+ */
+struct kv_ring {
+	struct kv_ring_hdr *hdr;
+	struct kv_sqe *sq;
+	struct kv_cqe *cq;
+	char *data;
+	u32 entries;
+	/* Serializes drains and setup */
+	struct mutex lock;
+	/* Polling thread, NULL without KV_SETUP_SQPOLL */
+	struct task_struct *poller;
+	unsigned long sq_idle;
+	/* Statistics, reported on release */
+	unsigned long enters;
+	unsigned long drains;
+	unsigned long ops;
+};
+
+static struct lock_tree *kv_lt;
+static bool kv_lock_per_op;
+
+/* Applies one entry, write_locked says which lock a batch drain holds */
+static int kv_apply(struct kv_ring *ring, u32 index, bool write_locked)
+{
+	struct kv_sqe *sqe = &ring->sq[index];
+	char *buf = ring->data + (size_t)index * KV_VALUE_MAX;
+	u32 op = READ_ONCE(sqe->op), len = READ_ONCE(sqe->len);
+	u64 key = READ_ONCE(sqe->key);
+	int ret;
+
+	/* The entry may have changed since the drain picked its lock */
+	if(op != KV_OP_SEARCH && !write_locked)
+		return -EAGAIN;
+
+	switch(op){
+		case KV_OP_INSERT:
+			if(!len || len > KV_VALUE_MAX)
+				return -EINVAL;
+			return lt_insert_data(kv_lt, buf, len, key) ? -EEXIST : 0;
+		case KV_OP_SEARCH:
+			ret = lt_search_copy(kv_lt, key, buf, min_t(u32, len,
+						KV_VALUE_MAX));
+			return ret < 0 ? -ENOENT : ret;
+		case KV_OP_ERASE:
+			return lt_erase(kv_lt, key) ? -ENOENT : 0;
+		default:
+			return -EINVAL;
+	}
+}
+
+static int kv_apply_locked(struct kv_ring *ring, u32 index)
+{
+	int ret;
+
+	if(READ_ONCE(ring->sq[index].op) == KV_OP_SEARCH){
+		lt_read_lock(kv_lt);
+		ret = kv_apply(ring, index, false);
+		lt_read_unlock(kv_lt);
+	}else{
+		lt_write_lock(kv_lt);
+		ret = kv_apply(ring, index, true);
+		lt_write_unlock(kv_lt);
+	}
+	return ret;
+}
+
+/*
+ * Applies every pending entry there is room to complete.
+ * A batch with no writes only takes the read lock.
+ */
+static u32 kv_ring_drain(struct kv_ring *ring)
+{
+	struct kv_ring_hdr *hdr = ring->hdr;
+	u32 mask = ring->entries - 1;
+	u32 sq_head = hdr->sq_head, sq_tail = smp_load_acquire(&hdr->sq_tail);
+	u32 cq_tail = hdr->cq_tail, cq_head = smp_load_acquire(&hdr->cq_head);
+	u32 n, i;
+	bool write = false;
+
+	n = min3(sq_tail - sq_head, ring->entries - (cq_tail - cq_head),
+			ring->entries);
+	if(!n)
+		return 0;
+
+	if(!kv_lock_per_op){
+		for(i=0;i<n && !write;i++)
+			write = READ_ONCE(ring->sq[(sq_head + i) & mask].op) !=
+				KV_OP_SEARCH;
+		if(write)
+			lt_write_lock(kv_lt);
+		else
+			lt_read_lock(kv_lt);
+	}
+	for(i=0;i<n;i++){
+		u32 index = (sq_head + i) & mask;
+		struct kv_cqe *cqe = &ring->cq[(cq_tail + i) & mask];
+
+		cqe->user_data = READ_ONCE(ring->sq[index].user_data);
+		cqe->res = kv_lock_per_op ? kv_apply_locked(ring, index) :
+			kv_apply(ring, index, write);
+	}
+	if(!kv_lock_per_op){
+		if(write)
+			lt_write_unlock(kv_lt);
+		else
+			lt_read_unlock(kv_lt);
+	}
+
+	smp_store_release(&hdr->sq_head, sq_head + n);
+	smp_store_release(&hdr->cq_tail, cq_tail + n);
+	ring->drains++;
+	ring->ops += n;
+	return n;
+}
+
+/*
+ * Drains while there is work and spins for sq_idle once it
+ * runs dry, then flags NEED_WAKEUP and sleeps until the next
+ * KV_IOC_ENTER. The flag is set before the last check for
+ * work, so a submission either is seen or sees the flag.
+ */
+static int kv_poll_thread(void *arg)
+{
+	struct kv_ring *ring = arg;
+	struct kv_ring_hdr *hdr = ring->hdr;
+	unsigned long idle_since = jiffies;
+
+	while(!kthread_should_stop()){
+		mutex_lock(&ring->lock);
+		if(kv_ring_drain(ring))
+			idle_since = jiffies;
+		mutex_unlock(&ring->lock);
+
+		if(time_before(jiffies, idle_since + ring->sq_idle)){
+			cond_resched();
+			continue;
+		}
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		WRITE_ONCE(hdr->flags, hdr->flags | KV_RING_NEED_WAKEUP);
+		smp_mb();
+		if(smp_load_acquire(&hdr->sq_tail) == hdr->sq_head &&
+				!kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+		WRITE_ONCE(hdr->flags, hdr->flags & ~KV_RING_NEED_WAKEUP);
+		idle_since = jiffies;
+	}
+	return 0;
+}
+
+static int kv_ring_setup(struct kv_ring *ring, struct kv_ring_setup *p)
+{
+	size_t sq_off, cq_off, data_off, size;
+	struct task_struct *task;
+	void *mem;
+
+	if(!p->entries || !is_power_of_2(p->entries) ||
+			p->entries > KV_RING_MAX_ENTRIES)
+		return -EINVAL;
+	if(p->flags & ~KV_SETUP_SQPOLL)
+		return -EINVAL;
+	if(ring->hdr)
+		return -EBUSY;
+
+	sq_off = ALIGN(sizeof(struct kv_ring_hdr), 64);
+	cq_off = ALIGN(sq_off + p->entries * sizeof(struct kv_sqe), 64);
+	data_off = ALIGN(cq_off + p->entries * sizeof(struct kv_cqe), 64);
+	size = PAGE_ALIGN(data_off + (size_t)p->entries * KV_VALUE_MAX);
+
+	mem = vmalloc_user(size);
+	if(!mem)
+		return -ENOMEM;
+	ring->hdr = mem;
+	ring->sq = mem + sq_off;
+	ring->cq = mem + cq_off;
+	ring->data = mem + data_off;
+	ring->entries = p->entries;
+	ring->hdr->magic = KV_RING_MAGIC;
+	ring->hdr->entries = p->entries;
+	ring->hdr->value_max = KV_VALUE_MAX;
+	ring->hdr->sq_off = sq_off;
+	ring->hdr->cq_off = cq_off;
+	ring->hdr->data_off = data_off;
+	p->size = size;
+
+	if(p->flags & KV_SETUP_SQPOLL){
+		ring->sq_idle = msecs_to_jiffies(p->sq_idle_ms);
+		task = kthread_run(kv_poll_thread, ring, "lock_tree_sqpoll");
+		if(IS_ERR(task)){
+			pr_err("Could not start submission polling thread\n");
+			vfree(mem);
+			ring->hdr = NULL;
+			return PTR_ERR(task);
+		}
+		ring->poller = task;
+	}
+	return 0;
+}
+
+static long kv_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct kv_ring *ring = file->private_data;
+	struct kv_ring_setup p;
+	long ret;
+
+	switch(cmd){
+		case KV_IOC_SETUP:
+			if(copy_from_user(&p, (void __user *)arg, sizeof(p)))
+				return -EFAULT;
+			mutex_lock(&ring->lock);
+			ret = kv_ring_setup(ring, &p);
+			mutex_unlock(&ring->lock);
+			if(!ret && copy_to_user((void __user *)arg, &p, sizeof(p)))
+				ret = -EFAULT;
+			return ret;
+		case KV_IOC_ENTER:
+			if(!ring->hdr)
+				return -ENXIO;
+			ring->enters++;
+			if(ring->poller){
+				wake_up_process(ring->poller);
+				return 0;
+			}
+			mutex_lock(&ring->lock);
+			ret = kv_ring_drain(ring);
+			mutex_unlock(&ring->lock);
+			return ret;
+		default:
+			return -ENOTTY;
+	}
+}
+
+static int kv_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct kv_ring *ring = file->private_data;
+
+	if(!ring->hdr || vma->vm_pgoff)
+		return -EINVAL;
+	return remap_vmalloc_range(vma, ring->hdr, 0);
+}
+
+static int kv_open(struct inode *inode, struct file *file)
+{
+	struct kv_ring *ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+
+	if(!ring)
+		return -ENOMEM;
+	mutex_init(&ring->lock);
+	file->private_data = ring;
+	return 0;
+}
+
+static int kv_release(struct inode *inode, struct file *file)
+{
+	struct kv_ring *ring = file->private_data;
+
+	if(ring->poller)
+		kthread_stop(ring->poller);
+	if(ring->drains)
+		pr_info("Ring of %u entries: %lu ops in %lu syscalls and %lu drains, "
+				"%lu ops per drain\n", ring->entries, ring->ops,
+				ring->enters, ring->drains, ring->ops / ring->drains);
+	vfree(ring->hdr);
+	kfree(ring);
+	return 0;
+}
+
+static const struct file_operations kv_fops = {
+	.owner = THIS_MODULE,
+	.open = kv_open,
+	.release = kv_release,
+	.unlocked_ioctl = kv_ioctl,
+	.mmap = kv_mmap,
+};
+
+static struct miscdevice kv_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lock_tree",
+	.fops = &kv_fops,
+	.mode = 0600,
+};
+
+static bool registered;
+
+int kv_dev_register(struct lock_tree *lt, bool lock_per_op)
+{
+	kv_lt = lt;
+	kv_lock_per_op = lock_per_op;
+	if(misc_register(&kv_miscdev)){
+		pr_err("Could not register /dev/%s\n", kv_miscdev.name);
+		return -1;
+	}
+	registered = true;
+	pr_info("Serving the tree on /dev/%s\n", kv_miscdev.name);
+	return 0;
+}
+
+void kv_dev_unregister(void)
+{
+	if(!registered)
+		return;
+	misc_deregister(&kv_miscdev);
+	registered = false;
+}
@@ -0,0 +1,16 @@
+#ifndef _KV_DEV_H
+#define _KV_DEV_H
+
+#include <linux/types.h>
+#include "aux_structs.h"
+
+/*
+ * Character device serving lt on /dev/lock_tree through
+ * the ring described in kv_ring.h, for integer keys only.
+ * Open files keep the module loaded, so unregistering it
+ * leaves no ring behind.
+ */
+int kv_dev_register(struct lock_tree *lt, bool lock_per_op);
+void kv_dev_unregister(void);
+
+#endif /* _KV_DEV_H */
@@ -0,0 +1,95 @@
+#ifndef _KV_RING_H
+#define _KV_RING_H
+
+/*
+ * Shared memory ring of the lock_tree character device,
+ * included by the module and by userspace alike. After
+ * KV_IOC_SETUP the ring is mapped with one mmap() of
+ * kv_ring_setup.size bytes at offset 0, laid out as the
+ * header, entries submission entries, entries completion
+ * entries and entries value buffers of KV_VALUE_MAX bytes,
+ * at the offsets the header gives.
+ *
+ * Userspace writes a submission entry at sq_tail & (entries
+ * - 1) and its value into the buffer of the same index,
+ * then advances sq_tail. The module consumes entries from
+ * sq_head, posts one completion per entry at cq_tail, in
+ * submission order, and a search copies the value found
+ * into the buffer of the entry's index. An index must not
+ * be reused before its completion has been consumed.
+ * Heads and tails are free running, published with release
+ * and read with acquire semantics.
+ */
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define KV_RING_MAGIC		0x474e524b	/* "KRNG" */
+#define KV_RING_MAX_ENTRIES	4096
+#define KV_VALUE_MAX		256
+
+enum {
+	KV_OP_INSERT,
+	KV_OP_SEARCH,
+	KV_OP_ERASE
+};
+
+struct kv_sqe {
+	__u32 op;
+	/* Value length of an insert, buffer size of a search */
+	__u32 len;
+	__u64 key;
+	/* Passed back untouched in the completion */
+	__u64 user_data;
+};
+
+struct kv_cqe {
+	__u64 user_data;
+	/* 0 or the value length on success, negative errno otherwise */
+	__s32 res;
+	__u32 pad;
+};
+
+/* Set by the polling thread when it sleeps and needs KV_IOC_ENTER */
+#define KV_RING_NEED_WAKEUP	(1U << 0)
+
+struct kv_ring_hdr {
+	__u32 magic;
+	__u32 entries;
+	__u32 flags;
+	__u32 value_max;
+	__u64 sq_off;
+	__u64 cq_off;
+	__u64 data_off;
+	/* Written by the module */
+	__u32 sq_head __attribute__((aligned(64)));
+	/* Written by userspace */
+	__u32 sq_tail __attribute__((aligned(64)));
+	/* Written by userspace */
+	__u32 cq_head __attribute__((aligned(64)));
+	/* Written by the module */
+	__u32 cq_tail __attribute__((aligned(64)));
+};
+
+/* The submissions are drained by a kernel thread, no syscalls needed */
+#define KV_SETUP_SQPOLL		(1U << 0)
+
+struct kv_ring_setup {
+	/* In: power of two, up to KV_RING_MAX_ENTRIES */
+	__u32 entries;
+	__u32 flags;
+	/* In: ms the polling thread spins idle before sleeping */
+	__u32 sq_idle_ms;
+	__u32 pad;
+	/* Out: bytes to mmap */
+	__u64 size;
+};
+
+#define KV_IOC_MAGIC	'k'
+#define KV_IOC_SETUP	_IOWR(KV_IOC_MAGIC, 1, struct kv_ring_setup)
+/*
+ * Drains the submission ring and returns the number of entries
+ * processed, with KV_SETUP_SQPOLL it only wakes the polling thread
+ */
+#define KV_IOC_ENTER	_IO(KV_IOC_MAGIC, 2)
+
+#endif /* _KV_RING_H */
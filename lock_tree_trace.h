@@ -0,0 +1,205 @@
+/*
+ * Static tracepoints for the lock_tree module, usable
+ * with ftrace and perf under the lock_tree system
+ * (e.g. perf record -e 'lock_tree:*'). Disabled
+ * tracepoints cost a patched-out branch.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lock_tree
+
+#if !defined(_LOCK_TREE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LOCK_TREE_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/smp.h>
+#include "aux_structs.h"
+
+TRACE_DEFINE_ENUM(MUTEX);
+TRACE_DEFINE_ENUM(RWLOCK);
+TRACE_DEFINE_ENUM(SPINLOCK);
+TRACE_DEFINE_ENUM(RWSEM);
+TRACE_DEFINE_ENUM(ADAPTIVE);
+
+#define show_lock_type(type)				\
+	__print_symbolic(type,				\
+			{ MUTEX,	"MUTEX" },	\
+			{ RWLOCK,	"RWLOCK" },	\
+			{ SPINLOCK,	"SPINLOCK" },	\
+			{ RWSEM,	"RWSEM" },	\
+			{ ADAPTIVE,	"ADAPTIVE" })
+
+/*
+ * Tree operations, entry has no result yet. String
+ * keys show up as the address of their lt_skey
+ */
+DECLARE_EVENT_CLASS(lt_op,
+
+	TP_PROTO(u64 key, int result),
+
+	TP_ARGS(key, result),
+
+	TP_STRUCT__entry(
+		__field(u64, key)
+		__field(int, result)
+		__field(int, cpu)
+	),
+
+	TP_fast_assign(
+		__entry->key = key;
+		__entry->result = result;
+		__entry->cpu = raw_smp_processor_id();
+	),
+
+	TP_printk("key=%llu result=%d cpu=%d", __entry->key, __entry->result,
+		__entry->cpu)
+);
+
+DEFINE_EVENT(lt_op, lt_insert_enter,
+	TP_PROTO(u64 key, int result), TP_ARGS(key, result));
+DEFINE_EVENT(lt_op, lt_insert_exit,
+	TP_PROTO(u64 key, int result), TP_ARGS(key, result));
+DEFINE_EVENT(lt_op, lt_search_enter,
+	TP_PROTO(u64 key, int result), TP_ARGS(key, result));
+DEFINE_EVENT(lt_op, lt_search_exit,
+	TP_PROTO(u64 key, int result), TP_ARGS(key, result));
+DEFINE_EVENT(lt_op, lt_erase_enter,
+	TP_PROTO(u64 key, int result), TP_ARGS(key, result));
+DEFINE_EVENT(lt_op, lt_erase_exit,
+	TP_PROTO(u64 key, int result), TP_ARGS(key, result));
+
+/*
+ * Lock wrappers. contended fires when an acquisition
+ * has to wait, which the wrappers only check for while
+ * the event is enabled, acquired and release bracket
+ * the critical section
+ */
+DECLARE_EVENT_CLASS(lt_lock,
+
+	TP_PROTO(int lock_type, bool write),
+
+	TP_ARGS(lock_type, write),
+
+	TP_STRUCT__entry(
+		__field(int, lock_type)
+		__field(bool, write)
+	),
+
+	TP_fast_assign(
+		__entry->lock_type = lock_type;
+		__entry->write = write;
+	),
+
+	TP_printk("lock=%s %s", show_lock_type(__entry->lock_type),
+		__entry->write ? "write" : "read")
+);
+
+DEFINE_EVENT(lt_lock, lt_lock_contended,
+	TP_PROTO(int lock_type, bool write), TP_ARGS(lock_type, write));
+DEFINE_EVENT(lt_lock, lt_lock_acquired,
+	TP_PROTO(int lock_type, bool write), TP_ARGS(lock_type, write));
+DEFINE_EVENT(lt_lock, lt_lock_release,
+	TP_PROTO(int lock_type, bool write), TP_ARGS(lock_type, write));
+
+/* cb_tree rotations, key is the node rotated around */
+#define CB_ROTATE_SINGLE_L	0
+#define CB_ROTATE_DOUBLE_L	1
+#define CB_ROTATE_SINGLE_R	2
+#define CB_ROTATE_DOUBLE_R	3
+
+TRACE_EVENT(cb_rotate,
+
+	TP_PROTO(int kind, u64 key),
+
+	TP_ARGS(kind, key),
+
+	TP_STRUCT__entry(
+		__field(int, kind)
+		__field(u64, key)
+	),
+
+	TP_fast_assign(
+		__entry->kind = kind;
+		__entry->key = key;
+	),
+
+	TP_printk("%s key=%llu",
+		__print_symbolic(__entry->kind,
+			{ CB_ROTATE_SINGLE_L,	"singleL" },
+			{ CB_ROTATE_DOUBLE_L,	"doubleL" },
+			{ CB_ROTATE_SINGLE_R,	"singleR" },
+			{ CB_ROTATE_DOUBLE_R,	"doubleR" }),
+		__entry->key)
+);
+
+/* Barriers, remaining is the count left after this arrival */
+TRACE_EVENT(barrier_arrive,
+
+	TP_PROTO(void *barrier, int remaining),
+
+	TP_ARGS(barrier, remaining),
+
+	TP_STRUCT__entry(
+		__field(void *, barrier)
+		__field(int, remaining)
+	),
+
+	TP_fast_assign(
+		__entry->barrier = barrier;
+		__entry->remaining = remaining;
+	),
+
+	TP_printk("barrier=%p remaining=%d", __entry->barrier,
+		__entry->remaining)
+);
+
+TRACE_EVENT(barrier_release,
+
+	TP_PROTO(void *barrier),
+
+	TP_ARGS(barrier),
+
+	TP_STRUCT__entry(
+		__field(void *, barrier)
+	),
+
+	TP_fast_assign(
+		__entry->barrier = barrier;
+	),
+
+	TP_printk("barrier=%p", __entry->barrier)
+);
+
+/* Stage boundaries as seen by each thread */
+DECLARE_EVENT_CLASS(lt_stage,
+
+	TP_PROTO(int stage, int thread),
+
+	TP_ARGS(stage, thread),
+
+	TP_STRUCT__entry(
+		__field(int, stage)
+		__field(int, thread)
+	),
+
+	TP_fast_assign(
+		__entry->stage = stage;
+		__entry->thread = thread;
+	),
+
+	TP_printk("stage=%s thread=%d",
+		__entry->stage ? "search/erase" : "insert", __entry->thread)
+);
+
+DEFINE_EVENT(lt_stage, lt_stage_begin,
+	TP_PROTO(int stage, int thread), TP_ARGS(stage, thread));
+DEFINE_EVENT(lt_stage, lt_stage_end,
+	TP_PROTO(int stage, int thread), TP_ARGS(stage, thread));
+
+#endif /* _LOCK_TREE_TRACE_H */
+
+/* Out of tree, the header lives next to the sources */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lock_tree_trace
+#include <trace/define_trace.h>
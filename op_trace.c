@@ -0,0 +1,220 @@
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+#include <linux/printk.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/firmware.h>
+#include <linux/device.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/err.h>
+#include <linux/math64.h>
+#include "op_trace.h"
+
+int op_traces_alloc(struct op_traces *t, int num_threads,
+		unsigned long stage_ops[NUM_STAGES])
+{
+	int stage, i;
+
+	memset(t, 0, sizeof(*t));
+	t->num_threads = num_threads;
+
+	for(stage=0;stage<NUM_STAGES;stage++){
+		t->stage[stage] = kcalloc(num_threads, sizeof(struct op_trace),
+				GFP_KERNEL);
+		if(!t->stage[stage])
+			goto fail;
+		for(i=0;i<num_threads;i++){
+			struct op_trace *trace = &t->stage[stage][i];
+
+			trace->len = op_traces_share(stage_ops[stage],
+					num_threads, i);
+			if(!trace->len)
+				continue;
+			trace->ops = vmalloc(trace->len * sizeof(struct trace_op));
+			if(!trace->ops)
+				goto fail;
+		}
+	}
+	return 0;
+
+fail:
+	pr_err("Could not allocate operation traces\n");
+	op_traces_free(t);
+	return -1;
+}
+
+void op_traces_free(struct op_traces *t)
+{
+	int stage, i;
+
+	for(stage=0;stage<NUM_STAGES;stage++){
+		if(!t->stage[stage])
+			continue;
+		for(i=0;i<t->num_threads;i++)
+			vfree(t->stage[stage][i].ops);
+		kfree(t->stage[stage]);
+		t->stage[stage] = NULL;
+	}
+}
+
+/*
+ * Load a captured trace through the firmware loader,
+ * so name is looked up in the firmware search path
+ * (usually /lib/firmware)
+ */
+int op_traces_load(struct op_traces *t, int num_threads, const char *name)
+{
+	const struct firmware *fw;
+	const struct op_trace_header *hdr;
+	const struct trace_op *rec;
+	struct device *dev;
+	unsigned long stage_ops[NUM_STAGES];
+	size_t expected;
+	int stage, i, ret = -1;
+
+	dev = root_device_register("lock_tree");
+	if(IS_ERR(dev)){
+		pr_err("Could not register device for the trace loader\n");
+		return -1;
+	}
+	if(request_firmware(&fw, name, dev)){
+		pr_err("Could not load trace %s\n", name);
+		goto out_dev;
+	}
+
+	hdr = (const struct op_trace_header *)fw->data;
+	if(fw->size < sizeof(*hdr) || hdr->magic != OP_TRACE_MAGIC ||
+			hdr->version != OP_TRACE_VERSION){
+		pr_err("Trace %s has no valid header\n", name);
+		goto out_fw;
+	}
+	expected = sizeof(*hdr);
+	for(stage=0;stage<NUM_STAGES;stage++){
+		if(hdr->ops[stage] > ULONG_MAX / sizeof(struct trace_op)){
+			pr_err("Trace %s is too large\n", name);
+			goto out_fw;
+		}
+		stage_ops[stage] = hdr->ops[stage];
+		expected += (size_t)hdr->ops[stage] * sizeof(struct trace_op);
+	}
+	if(fw->size != expected){
+		pr_err("Trace %s is %zu bytes, header says %zu\n", name,
+				fw->size, expected);
+		goto out_fw;
+	}
+
+	if(op_traces_alloc(t, num_threads, stage_ops))
+		goto out_fw;
+
+	rec = (const struct trace_op *)(hdr + 1);
+	for(stage=0;stage<NUM_STAGES;stage++){
+		for(i=0;i<num_threads;i++){
+			struct op_trace *trace = &t->stage[stage][i];
+			unsigned long j;
+
+			for(j=0;j<trace->len;j++){
+				if(rec[j].type >= NUM_OP_TYPES){
+					pr_err("Trace %s has an invalid operation\n",
+							name);
+					op_traces_free(t);
+					goto out_fw;
+				}
+			}
+			memcpy(trace->ops, rec, trace->len * sizeof(*rec));
+			rec += trace->len;
+		}
+	}
+	pr_info("Loaded trace %s, %lu insert stage and %lu search/erase stage ops\n",
+			name, stage_ops[STAGE_INSERT], stage_ops[STAGE_SEARCH_ERASE]);
+	ret = 0;
+
+out_fw:
+	release_firmware(fw);
+out_dev:
+	root_device_unregister(dev);
+	return ret;
+}
+
+/*
+ * debugfs export, records are located on the fly
+ * so the traces do not have to be copied in one
+ * contiguous image
+ */
+static struct op_traces *exported;
+
+static const struct trace_op *record_at(struct op_traces *t, u64 index)
+{
+	int stage, i;
+
+	for(stage=0;stage<NUM_STAGES;stage++){
+		for(i=0;i<t->num_threads;i++){
+			struct op_trace *trace = &t->stage[stage][i];
+
+			if(index < trace->len)
+				return &trace->ops[index];
+			index -= trace->len;
+		}
+	}
+	return NULL;
+}
+
+static ssize_t trace_read(struct file *file, char __user *buf, size_t count,
+		loff_t *ppos)
+{
+	struct op_traces *t = exported;
+	struct op_trace_header hdr;
+	size_t done = 0;
+	loff_t pos = *ppos;
+	int stage, i;
+
+	hdr.magic = OP_TRACE_MAGIC;
+	hdr.version = OP_TRACE_VERSION;
+	for(stage=0;stage<NUM_STAGES;stage++){
+		hdr.ops[stage] = 0;
+		for(i=0;i<t->num_threads;i++)
+			hdr.ops[stage] += t->stage[stage][i].len;
+	}
+
+	if(pos < sizeof(hdr)){
+		size_t n = min_t(size_t, count, sizeof(hdr) - pos);
+
+		if(copy_to_user(buf, (char *)&hdr + pos, n))
+			return -EFAULT;
+		done += n;
+		pos += n;
+	}
+
+	while(done < count){
+		u32 off;
+		u64 index = div_u64_rem(pos - sizeof(hdr), sizeof(struct trace_op),
+				&off);
+		const struct trace_op *rec = record_at(t, index);
+		size_t n;
+
+		if(!rec)
+			break;
+		n = min_t(size_t, count - done, sizeof(*rec) - off);
+		if(copy_to_user(buf + done, (const char *)rec + off, n))
+			return -EFAULT;
+		done += n;
+		pos += n;
+	}
+
+	*ppos = pos;
+	return done;
+}
+
+static const struct file_operations trace_fops = {
+	.owner = THIS_MODULE,
+	.read = trace_read,
+	.llseek = default_llseek,
+};
+
+void op_traces_debugfs_init(struct op_traces *t, struct dentry *dir)
+{
+	exported = t;
+	debugfs_create_file("trace", 0400, dir, NULL, &trace_fops);
+}
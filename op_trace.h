@@ -0,0 +1,88 @@
+#ifndef _OP_TRACE_H
+#define _OP_TRACE_H
+
+#include <linux/types.h>
+#include "thread_stats.h"
+
+/*
+ * Pre-generated operation traces. The whole workload
+ * is laid out before the first stage in one array per
+ * thread and stage, and the timed loops only replay it,
+ * so random number generation stays out of the measurements
+ * and a trace can be replayed against every lock/tree pair.
+ */
+typedef enum {
+	OP_INSERT,
+	OP_SEARCH,
+	OP_ERASE,
+	/* VMA workload, arg is the region end */
+	OP_MAP,
+	/* VMA workload, floor search checked against the region end */
+	OP_FAULT,
+	/* Order statistics, number of keys below key */
+	OP_RANK,
+	/* Order statistics, key is the position from the smallest key */
+	OP_SELECT,
+	/* Order statistics, keys in [key, key + arg] */
+	OP_COUNT_RANGE,
+	/* Erases every key in [key, key + arg] at once */
+	OP_ERASE_RANGE,
+	NUM_OP_TYPES
+}OPTYPE_T;
+
+struct trace_op {
+	uint32_t type;
+	uint32_t arg;
+	/* Integer key, mapped to a string key when those are in use */
+	uint64_t key;
+};
+
+struct op_trace {
+	struct trace_op *ops;
+	unsigned long len;
+};
+
+struct op_traces {
+	int num_threads;
+	/* num_threads traces per stage */
+	struct op_trace *stage[NUM_STAGES];
+};
+
+/*
+ * Trace file format, as exported through debugfs and
+ * loaded with request_firmware(). Host byte order, the
+ * header is followed by the records of the insert stage
+ * and then by those of the search/erase stage, each stage
+ * split in per-thread chunks the same way num_ops is split
+ * (equal shares, remainder to the last thread).
+ */
+#define OP_TRACE_MAGIC		0x5254544c	/* "LTTR" */
+#define OP_TRACE_VERSION	2
+
+struct op_trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t ops[NUM_STAGES];
+};
+
+int op_traces_alloc(struct op_traces *t, int num_threads,
+		unsigned long stage_ops[NUM_STAGES]);
+void op_traces_free(struct op_traces *t);
+int op_traces_load(struct op_traces *t, int num_threads, const char *name);
+
+/* Share of stage_ops a thread runs */
+static inline unsigned long op_traces_share(unsigned long stage_ops,
+		int num_threads, int id)
+{
+	unsigned long share = stage_ops / num_threads;
+
+	if(id == num_threads - 1)
+		share += stage_ops % num_threads;
+	return share;
+}
+
+/* Exports the traces as trace in the module's debugfs directory */
+struct dentry;
+void op_traces_debugfs_init(struct op_traces *t, struct dentry *dir);
+
+#endif /* _OP_TRACE_H */
@@ -0,0 +1,169 @@
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+#include <linux/printk.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/cache.h>
+#include <linux/math64.h>
+#include "payload.h"
+
+static struct payload {
+	PAYLOADDIST_T dist;
+	size_t min_len;
+	size_t max_len;
+	char *source;
+	struct lt_value **pool;
+	unsigned int pool_size;
+	char **scratch;
+	int num_scratch;
+}payload;
+
+/* The original "dummy_data" string, repeated */
+static const char pattern[] = "dummy_data";
+
+size_t payload_len(u64 key)
+{
+	struct payload *p = &payload;
+	uint32_t h = hash_64(key, 32);
+	unsigned int lo, hi, order;
+	size_t len;
+
+	switch(p->dist){
+		case PAYLOAD_UNIFORM:
+			return p->min_len + h % (p->max_len - p->min_len + 1);
+		case PAYLOAD_LOG:
+			lo = ilog2(p->min_len);
+			hi = ilog2(p->max_len);
+			order = lo + h % (hi - lo + 1);
+			len = (1UL << order) + (h >> 8) % (1UL << order);
+			return clamp_t(size_t, len, p->min_len, p->max_len);
+		default:
+			return p->min_len;
+	}
+}
+
+size_t payload_max_len(void)
+{
+	return payload.max_len;
+}
+
+/* Lengths are hashed from the key, a sample of keys gives their mean */
+enum { PAYLOAD_SAMPLE = 4096 };
+
+u64 payload_bytes(unsigned long num_keys)
+{
+	struct payload *p = &payload;
+	unsigned long i, n;
+	u64 sum = 0;
+
+	if(p->pool_size)
+		num_keys = min_t(unsigned long, num_keys, p->pool_size);
+	n = min_t(unsigned long, num_keys, PAYLOAD_SAMPLE);
+	if(!n)
+		return 0;
+	for(i=1;i<=n;i++)
+		sum += sizeof(struct lt_value) + payload_len(i);
+	return div64_u64(sum * num_keys, n);
+}
+
+int payload_init(PAYLOADDIST_T dist, size_t min_len, size_t max_len,
+		unsigned int pool_size, int num_scratch)
+{
+	struct payload *p = &payload;
+	unsigned int i;
+
+	p->dist = dist;
+	p->min_len = min_len;
+	p->max_len = dist == PAYLOAD_FIXED ? min_len : max_len;
+
+	p->source = vmalloc(p->max_len);
+	if(!p->source)
+		goto fail;
+	for(i=0;i<p->max_len;i++)
+		p->source[i] = i % sizeof(pattern) == sizeof(pattern) - 1 ?
+			'\0' : pattern[i % sizeof(pattern)];
+
+	if(pool_size){
+		p->pool = kcalloc(pool_size, sizeof(*p->pool), GFP_KERNEL);
+		if(!p->pool)
+			goto fail;
+		p->pool_size = pool_size;
+		for(i=0;i<pool_size;i++){
+			size_t len = payload_len(i);
+
+			p->pool[i] = lt_value_alloc(len, GFP_KERNEL);
+			if(!p->pool[i])
+				goto fail;
+			memcpy(p->pool[i]->data, p->source, len);
+		}
+	}
+
+	if(num_scratch){
+		p->scratch = kcalloc(num_scratch, sizeof(*p->scratch), GFP_KERNEL);
+		if(!p->scratch)
+			goto fail;
+		p->num_scratch = num_scratch;
+		for(i=0;i<num_scratch;i++){
+			p->scratch[i] = vmalloc(p->max_len);
+			if(!p->scratch[i])
+				goto fail;
+		}
+	}
+	return 0;
+
+fail:
+	pr_err("Could not allocate value payloads\n");
+	payload_exit();
+	return -1;
+}
+
+/* Drops the pool's references, the trees must be gone by now */
+void payload_exit(void)
+{
+	struct payload *p = &payload;
+	unsigned int i;
+
+	if(p->pool)
+		for(i=0;i<p->pool_size;i++)
+			if(p->pool[i])
+				lt_value_put(p->pool[i]);
+	kfree(p->pool);
+	if(p->scratch)
+		for(i=0;i<p->num_scratch;i++)
+			vfree(p->scratch[i]);
+	kfree(p->scratch);
+	vfree(p->source);
+	memset(p, 0, sizeof(*p));
+}
+
+const void *payload_source(void)
+{
+	return payload.source;
+}
+
+struct lt_value *payload_ref(u64 key)
+{
+	u32 index;
+
+	if(!payload.pool)
+		return NULL;
+	div_u64_rem(key, payload.pool_size, &index);
+	return payload.pool[index];
+}
+
+void *payload_scratch(int id)
+{
+	return payload.scratch[id];
+}
+
+void payload_read(const char *data)
+{
+	size_t i, len = lt_value_of(data)->len;
+
+	for(i=0;i<len;i+=L1_CACHE_BYTES)
+		(void)READ_ONCE(data[i]);
+	if(len)
+		(void)READ_ONCE(data[len - 1]);
+}
@@ -0,0 +1,38 @@
+#ifndef _PAYLOAD_H
+#define _PAYLOAD_H
+
+#include <linux/types.h>
+#include "aux_structs.h"
+
+/*
+ * Value payloads of the POINT workload. The size of a
+ * key's value is drawn from the configured distribution
+ * by hashing the key, so every run and every replay of
+ * a trace inserts the same sizes. Values are either copied
+ * from a pattern buffer on every insert or, with a pool,
+ * shared by reference from a set of refcounted values.
+ */
+typedef enum {
+	PAYLOAD_FIXED,
+	PAYLOAD_UNIFORM,
+	/* Uniform power of two range, then uniform within it */
+	PAYLOAD_LOG
+}PAYLOADDIST_T;
+
+int payload_init(PAYLOADDIST_T dist, size_t min_len, size_t max_len,
+		unsigned int pool_size, int num_scratch);
+void payload_exit(void);
+size_t payload_len(u64 key);
+size_t payload_max_len(void);
+/* Estimated bytes of the values of keys 1 to num_keys, shared ones counted once */
+u64 payload_bytes(unsigned long num_keys);
+/* Pattern buffer of payload_max_len() bytes to copy values from */
+const void *payload_source(void);
+/* Pool value shared by key, NULL without a pool */
+struct lt_value *payload_ref(u64 key);
+/* Per-thread buffer of payload_max_len() bytes for read-side copies */
+void *payload_scratch(int id);
+/* Read every cache line of a stored value */
+void payload_read(const char *data);
+
+#endif /* _PAYLOAD_H */
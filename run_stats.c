@@ -0,0 +1,182 @@
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+#include <linux/printk.h>
+#include <linux/slab.h>
+#include <linux/gfp.h>
+#include <linux/string.h>
+#include <linux/sort.h>
+#include <linux/math64.h>
+#include <linux/kernel.h>
+#include "run_stats.h"
+
+int run_stats_alloc(struct run_stats *rs, unsigned int warmup,
+		unsigned int runs)
+{
+	int stage;
+
+	memset(rs, 0, sizeof(*rs));
+	rs->warmup = warmup;
+	rs->runs = runs;
+	for(stage=0;stage<NUM_RUN_STAGES;stage++){
+		rs->us[stage] = kcalloc(warmup + runs, sizeof(u64), GFP_KERNEL);
+		if(!rs->us[stage]){
+			pr_err("Could not allocate run statistics\n");
+			run_stats_free(rs);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void run_stats_free(struct run_stats *rs)
+{
+	int stage;
+
+	for(stage=0;stage<NUM_RUN_STAGES;stage++){
+		kfree(rs->us[stage]);
+		rs->us[stage] = NULL;
+	}
+}
+
+void run_stats_record(struct run_stats *rs, unsigned int run, int stage,
+		ktime_t duration)
+{
+	rs->us[stage][run] = ktime_to_us(duration);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	if(x < y)
+		return -1;
+	return x > y;
+}
+
+/* Median of a sorted array */
+static u64 median_sorted(u64 *v, unsigned int n)
+{
+	if(n % 2)
+		return v[n / 2];
+	return (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+/*
+ * Two-sided 95% Student t quantiles for 1 to 30
+ * degrees of freedom, scaled by 1000. Past that the
+ * normal quantile is close enough.
+ */
+static const unsigned int t_quantile_milli[] = {
+	12706, 4303, 3182, 2776, 2571, 2447, 2365, 2306, 2262, 2228,
+	2201, 2179, 2160, 2145, 2131, 2120, 2110, 2101, 2093, 2086,
+	2080, 2074, 2069, 2064, 2060, 2056, 2052, 2048, 2045, 2042
+};
+
+static unsigned int t_quantile(unsigned int df)
+{
+	if(df && df <= ARRAY_SIZE(t_quantile_milli))
+		return t_quantile_milli[df - 1];
+	return 1960;
+}
+
+/*
+ * A sample is an outlier if it is more than 3 scaled
+ * MADs away from the median, the scale factor 1.4826
+ * makes the MAD consistent with the standard deviation
+ */
+enum { MAD_SCALE_TENTHOUSANDTHS = 14826, MAD_THRESHOLD = 3 };
+
+/*
+ * Print microseconds as milliseconds, through div_u64 since
+ * 32-bit kernels have no plain 64-bit division
+ */
+#define US_FMT "%llu.%03u"
+#define US_ARG(us) div_u64((us), 1000), us_frac(us)
+
+static u32 us_frac(u64 us)
+{
+	u32 rem;
+
+	div_u64_rem(us, 1000, &rem);
+	return rem;
+}
+
+void run_stats_report(struct run_stats *rs, int stage, const char *stage_name)
+{
+	unsigned int i, n = rs->runs;
+	u64 *samples = rs->us[stage] + rs->warmup;
+	u64 *sorted, *dev;
+	u64 sum = 0, var_sum = 0, mean, median, mad, stddev = 0, half = 0;
+
+	if(!n)
+		return;
+
+	sorted = kmalloc_array(n, sizeof(u64), GFP_KERNEL);
+	dev = kmalloc_array(n, sizeof(u64), GFP_KERNEL);
+	if(!sorted || !dev){
+		pr_err("Could not allocate memory for %s stage statistics\n",
+				stage_name);
+		goto out;
+	}
+
+	memcpy(sorted, samples, n * sizeof(u64));
+	sort(sorted, n, sizeof(u64), cmp_u64, NULL);
+	median = median_sorted(sorted, n);
+
+	for(i=0;i<n;i++)
+		sum += samples[i];
+	mean = div64_u64(sum, n);
+
+	if(n > 1){
+		for(i=0;i<n;i++){
+			s64 d = samples[i] - mean;
+			var_sum += d * d;
+		}
+		stddev = int_sqrt64(div64_u64(var_sum, n - 1));
+		/* t * s / sqrt(n), with sqrt(n) scaled by 1000 like t */
+		half = div64_u64((u64)t_quantile(n - 1) * stddev,
+				int_sqrt64((u64)n * 1000000));
+	}
+
+	for(i=0;i<n;i++)
+		dev[i] = samples[i] > median ? samples[i] - median :
+			median - samples[i];
+	sort(dev, n, sizeof(u64), cmp_u64, NULL);
+	mad = median_sorted(dev, n);
+
+	pr_info("%s stage over %u runs (%u warm-up discarded): mean " US_FMT
+			" ms, median " US_FMT " ms, stddev " US_FMT " ms, min "
+			US_FMT " ms, max " US_FMT " ms\n", stage_name, n,
+			rs->warmup, US_ARG(mean), US_ARG(median), US_ARG(stddev),
+			US_ARG(sorted[0]), US_ARG(sorted[n - 1]));
+	if(n > 1)
+		pr_info("%s stage 95%% confidence interval of the mean: ["
+				US_FMT ", " US_FMT "] ms\n", stage_name,
+				US_ARG(mean > half ? mean - half : 0),
+				US_ARG(mean + half));
+
+	if(!mad)
+		goto out;
+	for(i=0;i<n;i++){
+		u64 d = samples[i] > median ? samples[i] - median :
+			median - samples[i];
+
+		if(d * 10000 > (u64)MAD_THRESHOLD * MAD_SCALE_TENTHOUSANDTHS * mad)
+			pr_warn("%s stage run %u is an outlier: " US_FMT
+					" ms, median " US_FMT " ms, MAD " US_FMT
+					" ms\n", stage_name, i + 1, US_ARG(samples[i]),
+					US_ARG(median), US_ARG(mad));
+	}
+
+out:
+	kfree(sorted);
+	kfree(dev);
+}
+
+void run_stats_export(struct run_stats *rs, int stage, const char *stage_name)
+{
+	unsigned int i;
+
+	for(i=0;i<rs->runs;i++)
+		pr_info("bench %s %u %llu\n", stage_name, i + 1,
+				rs->us[stage][rs->warmup + i]);
+}
@@ -0,0 +1,41 @@
+#ifndef _RUN_STATS_H
+#define _RUN_STATS_H
+
+#include <linux/types.h>
+#include <linux/ktime.h>
+#include "thread_stats.h"
+
+/*
+ * Repeat-and-aggregate statistics. Every run of
+ * the two stages records its stage durations, the
+ * first warmup runs are discarded and the rest are
+ * summarized per stage (mean, median, stddev, min/max,
+ * 95% confidence interval of the mean), flagging outliers
+ * with the median absolute deviation (MAD).
+ */
+/* Stages timed per run, the thread stages plus tree teardown */
+enum {
+	RUN_STAGE_TEARDOWN = NUM_STAGES,
+	NUM_RUN_STAGES
+};
+
+struct run_stats {
+	unsigned int warmup;
+	unsigned int runs;
+	/* Stage durations in microseconds, warmup + runs entries */
+	u64 *us[NUM_RUN_STAGES];
+};
+
+int run_stats_alloc(struct run_stats *rs, unsigned int warmup,
+		unsigned int runs);
+void run_stats_free(struct run_stats *rs);
+void run_stats_record(struct run_stats *rs, unsigned int run, int stage,
+		ktime_t duration);
+void run_stats_report(struct run_stats *rs, int stage, const char *stage_name);
+/*
+ * Machine-readable samples of the measured runs, one
+ * "bench <stage> <run> <us>" line each, for tools/bench.sh
+ */
+void run_stats_export(struct run_stats *rs, int stage, const char *stage_name);
+
+#endif /* _RUN_STATS_H */
@@ -0,0 +1,487 @@
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+#include <linux/printk.h>
+#include <linux/slab.h>
+#include <linux/gfp.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/atomic.h>
+#include <asm/bug.h>
+#include "skiplist.h"
+
+/*
+ * Key and prefix first, they are what walks read. A node
+ * is referenced by its inserter until its tower is built
+ * and by the list until its eraser has unlinked it, the
+ * last of the two to let go frees it after a grace period.
+ */
+struct sl_node {
+	u64 key;
+	u64 prefix;
+	void *value;
+	atomic_t refs;
+	u32 height;
+	struct rcu_head rcu;
+	/* Low bit set once the node is erased at that level */
+	struct sl_node *next[];
+};
+
+#define SL_MARK		1UL
+
+static inline bool sl_marked(struct sl_node *p)
+{
+	return (uintptr_t)p & SL_MARK;
+}
+
+static inline struct sl_node *sl_ptr(struct sl_node *p)
+{
+	return (struct sl_node *)((uintptr_t)p & ~SL_MARK);
+}
+
+static inline struct sl_node *sl_mark(struct sl_node *p)
+{
+	return (struct sl_node *)((uintptr_t)p | SL_MARK);
+}
+
+/* One cache per tower height, the head has the tallest */
+static struct kmem_cache *sl_caches[SL_MAX_LEVEL];
+static char sl_cache_names[SL_MAX_LEVEL][24];
+static DEFINE_PER_CPU(struct rnd_state, sl_rnd);
+
+void sl_init(struct sl_root *root, int (*cmp)(u64 a, u64 b),
+		u64 (*prefix)(u64 key))
+{
+	int i, cpu;
+
+	for(i=0;i<SL_MAX_LEVEL;i++){
+		if(sl_caches[i])
+			continue;
+		snprintf(sl_cache_names[i], sizeof(sl_cache_names[i]),
+				"lt_skiplist_%d", i + 1);
+		sl_caches[i] = kmem_cache_create(sl_cache_names[i],
+				sizeof(struct sl_node) + (i + 1) * sizeof(struct sl_node *),
+				0, SLAB_PANIC, NULL);
+	}
+	for_each_possible_cpu(cpu)
+		prandom_seed_state(per_cpu_ptr(&sl_rnd, cpu), get_random_u64());
+
+	root->head = kmem_cache_zalloc(sl_caches[SL_MAX_LEVEL - 1],
+			GFP_KERNEL | __GFP_NOFAIL);
+	root->head->height = SL_MAX_LEVEL;
+	root->level = 1;
+	root->cmp = cmp;
+	root->prefix = prefix;
+}
+
+static void sl_node_free(struct sl_node *node)
+{
+	kmem_cache_free(sl_caches[node->height - 1], node);
+}
+
+static void sl_node_free_rcu(struct rcu_head *rcu)
+{
+	sl_node_free(container_of(rcu, struct sl_node, rcu));
+}
+
+static void sl_node_put(struct sl_node *node)
+{
+	if(atomic_dec_and_test(&node->refs))
+		call_rcu(&node->rcu, sl_node_free_rcu);
+}
+
+/* Each level holds a quarter of the level below */
+static u32 sl_random_height(void)
+{
+	struct rnd_state *rnd = get_cpu_ptr(&sl_rnd);
+	u32 r = prandom_u32_state(rnd), height = 1;
+
+	put_cpu_ptr(&sl_rnd);
+	while(height < SL_MAX_LEVEL && !(r & 3)){
+		height++;
+		r >>= 2;
+	}
+	return height;
+}
+
+/* Heights are geometric, 4/3 next pointers per node on average */
+size_t sl_node_bytes(void)
+{
+	return sizeof(struct sl_node) + sizeof(struct sl_node *) * 4 / 3;
+}
+
+static inline u64 sl_key_prefix(struct sl_root *root, u64 key)
+{
+	return root->prefix ? root->prefix(key) : 0;
+}
+
+/* Sign of key - node's key */
+static inline int sl_key_cmp(struct sl_root *root, u64 key, u64 prefix,
+		struct sl_node *node)
+{
+	if(root->prefix && prefix != node->prefix)
+		return prefix < node->prefix ? -1 : 1;
+	if(root->cmp)
+		return root->cmp(key, node->key);
+	return key < node->key ? -1 : key > node->key;
+}
+
+/*
+ * Fills preds and succs with the nodes around key on every
+ * level in use, unlinking the marked nodes it passes. A
+ * failed unlink means the predecessor changed or is being
+ * erased itself, so the walk starts over from the head.
+ * Returns whether succs[0] holds key.
+ */
+static bool sl_find(struct sl_root *root, u64 key, u64 prefix,
+		struct sl_node **preds, struct sl_node **succs)
+{
+	struct sl_node *pred, *curr, *succ;
+	int level;
+
+retry:
+	pred = root->head;
+	for(level=READ_ONCE(root->level)-1;level>=0;level--){
+		curr = sl_ptr(READ_ONCE(pred->next[level]));
+		while(curr){
+			succ = READ_ONCE(curr->next[level]);
+			if(sl_marked(succ)){
+				if(cmpxchg(&pred->next[level], curr, sl_ptr(succ)) != curr)
+					goto retry;
+				curr = sl_ptr(succ);
+				continue;
+			}
+			if(sl_key_cmp(root, key, prefix, curr) <= 0)
+				break;
+			pred = curr;
+			curr = succ;
+		}
+		preds[level] = pred;
+		succs[level] = curr;
+	}
+	return succs[0] && !sl_key_cmp(root, key, prefix, succs[0]);
+}
+
+/* Read-only walk, first node >= key on level 0, erased or not */
+static struct sl_node *sl_lower_bound(struct sl_root *root, u64 key, u64 prefix)
+{
+	struct sl_node *pred = root->head, *curr = NULL;
+	int level;
+
+	for(level=READ_ONCE(root->level)-1;level>=0;level--){
+		curr = sl_ptr(READ_ONCE(pred->next[level]));
+		while(curr && sl_key_cmp(root, key, prefix, curr) > 0){
+			pred = curr;
+			curr = sl_ptr(READ_ONCE(curr->next[level]));
+		}
+	}
+	return curr;
+}
+
+static inline bool sl_erased(struct sl_node *node)
+{
+	return sl_marked(READ_ONCE(node->next[0]));
+}
+
+/* Next live node on level 0 */
+static struct sl_node *sl_next(struct sl_node *node)
+{
+	do{
+		node = sl_ptr(READ_ONCE(node->next[0]));
+	}while(node && sl_erased(node));
+	return node;
+}
+
+static struct sl_node *sl_seek(struct sl_root *root, u64 key)
+{
+	struct sl_node *node = sl_lower_bound(root, key, sl_key_prefix(root, key));
+
+	return node && sl_erased(node) ? sl_next(node) : node;
+}
+
+static void sl_raise_level(struct sl_root *root, int height)
+{
+	int level = READ_ONCE(root->level);
+
+	while(level < height){
+		int old = cmpxchg(&root->level, level, height);
+
+		if(old == level)
+			break;
+		level = old;
+	}
+}
+
+/*
+ * The key is in once level 0 links the node, the upper
+ * levels are only shortcuts and are built bottom up after.
+ * Building stops as soon as the node is found erased, and
+ * since an erase may have unlinked the node before the last
+ * links went in, the node is unlinked again in that case.
+ */
+int sl_insert(struct sl_root *root, u64 key, void *value)
+{
+	struct sl_node *preds[SL_MAX_LEVEL], *succs[SL_MAX_LEVEL];
+	struct sl_node *node, *pred, *succ, *old;
+	u64 prefix = sl_key_prefix(root, key);
+	u32 height = sl_random_height();
+	int level;
+
+	node = kmem_cache_alloc(sl_caches[height - 1], GFP_ATOMIC);
+	if(!node){
+		pr_err("Could not allocate skip list node\n");
+		return -1;
+	}
+	node->key = key;
+	node->prefix = prefix;
+	node->value = value;
+	node->height = height;
+	atomic_set(&node->refs, 2);
+	sl_raise_level(root, height);
+
+	for(;;){
+		if(sl_find(root, key, prefix, preds, succs)){
+			/* Never published */
+			sl_node_free(node);
+			return -1;
+		}
+		for(level=0;level<height;level++)
+			node->next[level] = succs[level];
+		if(cmpxchg(&preds[0]->next[0], succs[0], node) == succs[0])
+			break;
+	}
+
+	for(level=1;level<height;level++){
+		for(;;){
+			pred = preds[level];
+			succ = succs[level];
+			old = READ_ONCE(node->next[level]);
+			if(sl_marked(old))
+				goto out;
+			if(old != succ && cmpxchg(&node->next[level], old, succ) != old)
+				goto out;
+			if(cmpxchg(&pred->next[level], succ, node) == succ)
+				break;
+			sl_find(root, key, prefix, preds, succs);
+			if(succs[0] != node)
+				goto out;
+		}
+	}
+out:
+	if(sl_erased(node))
+		sl_find(root, key, prefix, preds, succs);
+	sl_node_put(node);
+	return 0;
+}
+
+void *sl_erase(struct sl_root *root, u64 key)
+{
+	struct sl_node *preds[SL_MAX_LEVEL], *succs[SL_MAX_LEVEL];
+	struct sl_node *node, *succ, *old;
+	u64 prefix = sl_key_prefix(root, key);
+	void *value;
+	int level;
+
+	if(!sl_find(root, key, prefix, preds, succs))
+		return NULL;
+	node = succs[0];
+
+	/* Stop the tower from growing, then take level 0 */
+	for(level=node->height-1;level>0;level--){
+		succ = READ_ONCE(node->next[level]);
+		while(!sl_marked(succ)){
+			old = cmpxchg(&node->next[level], succ, sl_mark(succ));
+			if(old == succ)
+				break;
+			succ = old;
+		}
+	}
+	succ = READ_ONCE(node->next[0]);
+	for(;;){
+		/* Lost to a concurrent erase */
+		if(sl_marked(succ))
+			return NULL;
+		old = cmpxchg(&node->next[0], succ, sl_mark(succ));
+		if(old == succ)
+			break;
+		succ = old;
+	}
+
+	value = node->value;
+	sl_find(root, key, prefix, preds, succs);
+	sl_node_put(node);
+	return value;
+}
+
+void *sl_search(struct sl_root *root, u64 key)
+{
+	u64 prefix = sl_key_prefix(root, key);
+	struct sl_node *pred = root->head, *curr;
+	int level, cmp;
+
+	for(level=READ_ONCE(root->level)-1;level>=0;level--){
+		curr = sl_ptr(READ_ONCE(pred->next[level]));
+		while(curr){
+			cmp = sl_key_cmp(root, key, prefix, curr);
+			if(cmp < 0)
+				break;
+			/*
+			 * Found on the way down, no need to reach level 0. An
+			 * erased node may still be linked ahead of the key's
+			 * new node, so the walk goes on past it.
+			 */
+			if(!cmp && !sl_erased(curr))
+				return curr->value;
+			pred = curr;
+			curr = sl_ptr(READ_ONCE(curr->next[level]));
+		}
+	}
+	return NULL;
+}
+
+void *sl_search_le(struct sl_root *root, u64 key)
+{
+	struct sl_node *preds[SL_MAX_LEVEL], *succs[SL_MAX_LEVEL];
+
+	if(sl_find(root, key, sl_key_prefix(root, key), preds, succs))
+		return succs[0]->value;
+	return preds[0] == root->head ? NULL : preds[0]->value;
+}
+
+unsigned long sl_rank(struct sl_root *root, u64 key)
+{
+	u64 prefix = sl_key_prefix(root, key);
+	struct sl_node *node = sl_next(root->head);
+	unsigned long rank = 0;
+
+	while(node && sl_key_cmp(root, key, prefix, node) > 0){
+		rank++;
+		node = sl_next(node);
+	}
+	return rank;
+}
+
+void *sl_select(struct sl_root *root, unsigned long k)
+{
+	struct sl_node *node = sl_next(root->head);
+
+	while(node && k--)
+		node = sl_next(node);
+	return node ? node->value : NULL;
+}
+
+unsigned long sl_count_range(struct sl_root *root, u64 lo, u64 hi)
+{
+	u64 prefix = sl_key_prefix(root, hi);
+	struct sl_node *node = sl_seek(root, lo);
+	unsigned long count = 0;
+
+	while(node && sl_key_cmp(root, hi, prefix, node) >= 0){
+		count++;
+		node = sl_next(node);
+	}
+	return count;
+}
+
+unsigned long sl_erase_range(struct sl_root *root, u64 lo, u64 hi,
+		void (*destroy)(void *value))
+{
+	u64 prefix = sl_key_prefix(root, hi);
+	struct sl_node *node = sl_seek(root, lo);
+	unsigned long count = 0;
+	void *value;
+
+	while(node && sl_key_cmp(root, hi, prefix, node) >= 0){
+		/* The node stays readable for the rest of the grace period */
+		value = sl_erase(root, node->key);
+		if(value){
+			destroy(value);
+			count++;
+		}
+		node = sl_next(node);
+	}
+	return count;
+}
+
+void sl_destroy_cache(void)
+{
+	int i;
+
+	/* Erased nodes may still be waiting for their grace period */
+	rcu_barrier();
+	for(i=0;i<SL_MAX_LEVEL;i++){
+		kmem_cache_destroy(sl_caches[i]);
+		sl_caches[i] = NULL;
+	}
+}
+
+/*
+ * Runs start at the first node and at nodes spread along
+ * the lowest level with at least max_parts nodes. Nothing
+ * is marked once the users are gone, so the level 0 link
+ * into the next run is marked to tell a run where to stop.
+ */
+int sl_detach(struct sl_root *root, void **parts, int max_parts)
+{
+	struct sl_node *node, *pred, *prev, *first = root->head->next[0];
+	unsigned long count, stride, i = 0;
+	int level, l, n = 0;
+
+	if(!first)
+		goto out;
+	parts[n++] = first;
+
+	for(level=root->level-1;;level--){
+		count = 0;
+		for(node=root->head->next[level];node;node=node->next[level])
+			count++;
+		if(count >= max_parts || !level)
+			break;
+	}
+	stride = max(count / max_parts, 1UL);
+
+	prev = root->head;
+	for(node=root->head->next[level];node && n < max_parts;
+			prev=node, node=node->next[level]){
+		if(i++ % stride || node == first)
+			continue;
+		/* Down to its level 0 predecessor, node is linked on the way */
+		pred = prev;
+		for(l=level-1;l>=0;l--)
+			while(sl_ptr(pred->next[l]) != node)
+				pred = sl_ptr(pred->next[l]);
+		pred->next[0] = sl_mark(node);
+		parts[n++] = node;
+	}
+out:
+	sl_node_free(root->head);
+	root->head = NULL;
+	return n;
+}
+
+void sl_destroy_part(void *part, void (*destroy)(void *value))
+{
+	struct sl_node *node = part, *next;
+
+	do{
+		next = node->next[0];
+		destroy(node->value);
+		sl_node_free(node);
+		node = sl_ptr(next);
+	}while(node && !sl_marked(next));
+}
+
+void sl_destroy(struct sl_root *root, void (*destroy)(void *value))
+{
+	struct sl_node *node, *next;
+
+	if(!root->head)
+		return;
+	for(node=root->head->next[0];node;node=next){
+		next = node->next[0];
+		destroy(node->value);
+		sl_node_free(node);
+	}
+	sl_node_free(root->head);
+	root->head = NULL;
+	sl_destroy_cache();
+}
@@ -0,0 +1,67 @@
+#ifndef _SKIPLIST_H
+#define _SKIPLIST_H
+
+#include <linux/types.h>
+
+/*
+ * Lock-free skip list. Inserts and erases link and unlink
+ * nodes with compare and swap, searches take no lock, and
+ * every operation must run in an RCU read-side critical
+ * section, which keeps the nodes it walks over alive. An
+ * erase marks the node's next pointers, top level first,
+ * and the level 0 mark is what decides which erase wins and
+ * when the key is gone. Marked nodes are unlinked by the
+ * next walk over them and freed a grace period after both
+ * their inserter and their eraser are done with them.
+ *
+ * Keys are u64, compared like the RCU tree's, as integers
+ * unless cmp is set, with a prefix cached in every node
+ * when prefix is set. Towers of each height come from
+ * their own slab cache.
+ */
+enum { SL_MAX_LEVEL = 16 };
+
+struct sl_node;
+
+struct sl_root {
+	struct sl_node *head;
+	/* Highest tower in the list, only grows */
+	int level;
+	int (*cmp)(u64 a, u64 b);
+	u64 (*prefix)(u64 key);
+};
+
+void sl_init(struct sl_root *root, int (*cmp)(u64 a, u64 b),
+		u64 (*prefix)(u64 key));
+/* Returns 0 if inserted, -1 if the key was present or out of memory */
+int sl_insert(struct sl_root *root, u64 key, void *value);
+/* Value of the erased key, NULL if not found or erased concurrently */
+void *sl_erase(struct sl_root *root, u64 key);
+void *sl_search(struct sl_root *root, u64 key);
+/* Value of the greatest key <= key */
+void *sl_search_le(struct sl_root *root, u64 key);
+/* Mean bytes of a node, towers included */
+size_t sl_node_bytes(void);
+/*
+ * Ordered walks over level 0, linear in the keys they pass.
+ * The list keeps no counts, so rank and select are only
+ * there to run the same query mix as the trees.
+ */
+unsigned long sl_rank(struct sl_root *root, u64 key);
+void *sl_select(struct sl_root *root, unsigned long k);
+unsigned long sl_count_range(struct sl_root *root, u64 lo, u64 hi);
+/* Erases the keys in [lo, hi] one by one, destroy gets the erased values */
+unsigned long sl_erase_range(struct sl_root *root, u64 lo, u64 hi,
+		void (*destroy)(void *value));
+
+/*
+ * Teardown, with no concurrent users. sl_detach cuts level 0
+ * into up to max_parts runs of nodes that sl_destroy_part frees
+ * independently, sl_destroy_cache goes once they are all done.
+ */
+void sl_destroy(struct sl_root *root, void (*destroy)(void *value));
+int sl_detach(struct sl_root *root, void **parts, int max_parts);
+void sl_destroy_part(void *part, void (*destroy)(void *value));
+void sl_destroy_cache(void);
+
+#endif /* _SKIPLIST_H */
@@ -0,0 +1,151 @@
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+#include <linux/printk.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/err.h>
+#include "snap_scan.h"
+
+/* Keys walked between reschedules */
+enum { SCAN_BATCH = 1024 };
+
+static struct lock_tree *scan_lt;
+static unsigned long scan_period;
+static struct task_struct *scanner;
+
+/* State of the walk in progress, there is one scanner */
+static int (*walk_cmp)(u64 a, u64 b);
+static u64 walk_last;
+static unsigned long walk_keys;
+static u64 walk_bytes;
+static bool walk_sorted;
+
+/* Written by the scanner only */
+static unsigned long scans;
+static unsigned long scan_keys;
+static u64 scan_bytes;
+static u64 scan_ns;
+static u64 scan_updates;
+static unsigned long inconsistent;
+
+/* Totals at the last report */
+static unsigned long reported_scans;
+static unsigned long reported_keys;
+static u64 reported_bytes;
+static u64 reported_ns;
+static u64 reported_updates;
+static unsigned long reported_inconsistent;
+
+/* Reads the value too, which the snapshot has to keep alive */
+static void snap_scan_kv(struct cb_kv *kv)
+{
+	if(walk_keys){
+		if(walk_cmp ? walk_cmp(walk_last, kv->key) >= 0 :
+				walk_last >= kv->key)
+			walk_sorted = false;
+	}
+	walk_last = kv->key;
+	walk_bytes += lt_value_of(kv->value)->len;
+	if(!(++walk_keys % SCAN_BATCH))
+		cond_resched();
+}
+
+static int snap_scan_thread(void *arg)
+{
+	struct cb_snapshot snap;
+	ktime_t start;
+	u64 updates;
+
+	while(!kthread_should_stop()){
+		if(!lt_snapshot(scan_lt, &snap)){
+			start = ktime_get();
+			walk_cmp = snap.tree.cmp;
+			walk_keys = 0;
+			walk_bytes = 0;
+			walk_sorted = true;
+			/* No RCU read lock, the snapshot keeps its nodes */
+			cb_for_each(&snap.tree, snap_scan_kv);
+			updates = READ_ONCE(scan_lt->tree.rcu_tree.version) -
+				snap.version;
+			lt_snapshot_release(scan_lt, &snap);
+
+			WRITE_ONCE(scan_ns, scan_ns +
+					ktime_to_ns(ktime_sub(ktime_get(), start)));
+			WRITE_ONCE(scan_keys, scan_keys + walk_keys);
+			WRITE_ONCE(scan_bytes, scan_bytes + walk_bytes);
+			WRITE_ONCE(scan_updates, scan_updates + updates);
+			if(!walk_sorted || walk_keys != snap.size)
+				WRITE_ONCE(inconsistent, inconsistent + 1);
+			WRITE_ONCE(scans, scans + 1);
+		}
+		schedule_timeout_interruptible(scan_period);
+	}
+	return 0;
+}
+
+int snap_scan_init(struct lock_tree *lt, unsigned int period_ms)
+{
+	if(!period_ms)
+		return 0;
+	scan_lt = lt;
+	scan_period = msecs_to_jiffies(period_ms);
+	return 0;
+}
+
+void snap_scan_exit(void)
+{
+	snap_scan_stop();
+	scan_lt = NULL;
+}
+
+void snap_scan_start(void)
+{
+	struct task_struct *task;
+
+	if(!scan_lt || scanner)
+		return;
+	task = kthread_run(snap_scan_thread, NULL, "lock_tree_snapscan");
+	if(IS_ERR(task)){
+		pr_err("Could not start snapshot scanner\n");
+		return;
+	}
+	scanner = task;
+}
+
+/* Waits for the scan in progress, which releases its snapshot */
+void snap_scan_stop(void)
+{
+	if(!scanner)
+		return;
+	kthread_stop(scanner);
+	scanner = NULL;
+}
+
+void snap_scan_report(const char *stage_name)
+{
+	unsigned long now_scans = READ_ONCE(scans);
+	unsigned long now_keys = READ_ONCE(scan_keys);
+	u64 now_bytes = READ_ONCE(scan_bytes);
+	u64 now_ns = READ_ONCE(scan_ns);
+	u64 now_updates = READ_ONCE(scan_updates);
+	unsigned long now_inconsistent = READ_ONCE(inconsistent);
+	unsigned long n = now_scans - reported_scans;
+
+	if(n)
+		pr_info("%s stage: %lu snapshot scans of %lu keys and %llu value "
+				"bytes on average, %llu us per scan, %llu updates "
+				"published during a scan, %lu inconsistent\n",
+				stage_name, n, (now_keys - reported_keys) / n,
+				div64_u64(now_bytes - reported_bytes, n),
+				div64_u64(now_ns - reported_ns, n * NSEC_PER_USEC),
+				div64_u64(now_updates - reported_updates, n),
+				now_inconsistent - reported_inconsistent);
+	reported_scans = now_scans;
+	reported_keys = now_keys;
+	reported_bytes = now_bytes;
+	reported_ns = now_ns;
+	reported_updates = now_updates;
+	reported_inconsistent = now_inconsistent;
+}
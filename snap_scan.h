@@ -0,0 +1,20 @@
+#ifndef _SNAP_SCAN_H
+#define _SNAP_SCAN_H
+
+#include "aux_structs.h"
+
+/*
+ * Snapshot scanner, a thread that every period pins a
+ * snapshot of the RCU tree and walks all of it while the
+ * workers go on, as a consistent export or checksum would.
+ * Each walk checks that the keys come in order and that
+ * there are as many as the pinned root holds, which only a
+ * tree no update has touched in place guarantees.
+ */
+int snap_scan_init(struct lock_tree *lt, unsigned int period_ms);
+void snap_scan_exit(void);
+void snap_scan_start(void);
+void snap_scan_stop(void);
+void snap_scan_report(const char *stage_name);
+
+#endif /* _SNAP_SCAN_H */
@@ -0,0 +1,275 @@
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+#include <linux/printk.h>
+#include <linux/slab.h>
+#include <linux/gfp.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/jiffies.h>
+#include <linux/math64.h>
+#include <linux/err.h>
+#include <linux/string.h>
+#include <linux/rcupdate.h>
+#include <linux/sched/debug.h>
+#include "thread_stats.h"
+
+struct thread_stats *thread_stats_alloc(int num_threads)
+{
+	struct thread_stats *ts;
+	int i;
+
+	ts = kcalloc(num_threads, sizeof(*ts), GFP_KERNEL);
+	if(!ts)
+		return NULL;
+	for(i=0;i<num_threads;i++)
+		ts[i].stage = -1;
+	return ts;
+}
+
+/* Clear the stage counters before a new run, progress keeps counting */
+void thread_stats_reset(struct thread_stats *ts, int num_threads)
+{
+	int i;
+
+	for(i=0;i<num_threads;i++){
+		memset(ts[i].stage_stats, 0, sizeof(ts[i].stage_stats));
+		WRITE_ONCE(ts[i].stage, -1);
+	}
+}
+
+void thread_stats_free(struct thread_stats *ts)
+{
+	kfree(ts);
+}
+
+/* Operations per second, computed on microseconds to delay overflow */
+static u64 ops_per_sec(u64 ops, ktime_t duration)
+{
+	s64 us = ktime_to_us(duration);
+
+	if(us <= 0)
+		return 0;
+	return div64_u64(ops * USEC_PER_SEC, us);
+}
+
+/*
+ * Jain's fairness index (sum x)^2 / (n * sum x^2), scaled
+ * by 1000. The index is scale invariant, so halving x (which
+ * quarters the squares) until the products fit in 64 bits
+ * keeps the ratio intact without needing 128-bit math
+ */
+static u64 jain_index_milli(u64 sum, u64 sum_sq, int n)
+{
+	if(!sum_sq)
+		return 1000;
+	while(sum > (1ULL << 26)){
+		sum >>= 1;
+		sum_sq >>= 2;
+	}
+	if(!sum_sq)
+		return 1000;
+	return div64_u64(sum * sum * 1000, sum_sq * n);
+}
+
+void thread_stats_report(struct thread_stats *ts, int num_threads,
+		STAGE_T stage, const char *stage_name)
+{
+	int i;
+	u64 sum = 0, sum_sq = 0, max_tput = 0, min_tput = U64_MAX;
+	u64 fairness, ratio;
+	u32 frac;
+
+	for(i=0;i<num_threads;i++){
+		struct stage_stats *ss = &ts[i].stage_stats[stage];
+		ktime_t duration = ktime_sub(ss->end, ss->start);
+		u64 tput = ops_per_sec(ss->ops, duration);
+
+		if(stage == STAGE_INSERT)
+			pr_info("%s stage, thread %d: %llu ops (%llu inserts) "
+					"done in %lld ms, %llu ops/sec\n",
+					stage_name, i, ss->ops, ss->inserts,
+					ktime_to_ms(duration), tput);
+		else
+			pr_info("%s stage, thread %d: %llu ops (%llu searches, "
+					"%llu hits, %llu inserts, %llu erases, "
+					"%llu queries) done in %lld ms, %llu ops/sec\n",
+					stage_name, i, ss->ops, ss->searches, ss->hits,
+					ss->inserts, ss->erases, ss->queries,
+					ktime_to_ms(duration), tput);
+		if(ss->stalls)
+			pr_warn("%s stage, thread %d stalled %u times, "
+					"longest stall %lld ms\n", stage_name, i,
+					ss->stalls, ss->longest_stall_ms);
+
+		sum += tput;
+		sum_sq += tput * tput;
+		if(tput > max_tput)
+			max_tput = tput;
+		if(tput < min_tput)
+			min_tput = tput;
+	}
+
+	fairness = div_u64_rem(jain_index_milli(sum, sum_sq, num_threads), 1000,
+			&frac);
+	pr_info("%s stage fairness: Jain's index %llu.%03u\n", stage_name,
+			fairness, frac);
+	if(min_tput){
+		ratio = div_u64_rem(div64_u64(max_tput * 1000, min_tput), 1000, &frac);
+		pr_info("%s stage max/min thread throughput ratio: %llu.%03u\n",
+				stage_name, ratio, frac);
+	}else{
+		pr_info("%s stage max/min thread throughput ratio: inf\n",
+				stage_name);
+	}
+}
+
+/*
+ * Only one monitor runs at a time, so its
+ * arguments are kept in a static struct
+ */
+static struct stall_monitor {
+	struct thread_stats *ts;
+	int num_threads;
+	unsigned int stall_ms;
+	unsigned int abort_ms;
+	/* Stage each thread was in on the last sample */
+	int *last_stage;
+}monitor;
+
+static bool aborted;
+
+bool stall_monitor_aborted(void)
+{
+	return READ_ONCE(aborted);
+}
+
+static void stall_monitor_dump_states(struct stall_monitor *m)
+{
+	int i;
+
+	for(i=0;i<m->num_threads;i++){
+		struct thread_stats *ts = &m->ts[i];
+
+		pr_warn("Thread %d: stage %d, %lu ops done, %s\n", i,
+				READ_ONCE(ts->stage), READ_ONCE(ts->progress),
+				ts->stalled ? "stalled" : "progressing");
+	}
+}
+
+/*
+ * Owners clear their task before exiting and task structs
+ * are freed after a grace period, so one read under the RCU
+ * read lock stays valid until the unlock
+ */
+static void stall_monitor_dump_task(struct thread_stats *ts)
+{
+	struct task_struct *task;
+
+	rcu_read_lock();
+	task = READ_ONCE(ts->task);
+	if(task)
+		sched_show_task(task);
+	rcu_read_unlock();
+}
+
+static void stall_monitor_sample(struct stall_monitor *m)
+{
+	int i;
+	bool dumped = false;
+	ktime_t now = ktime_get();
+
+	for(i=0;i<m->num_threads;i++){
+		struct thread_stats *ts = &m->ts[i];
+		int stage = READ_ONCE(ts->stage);
+		unsigned long progress = READ_ONCE(ts->progress);
+		struct stage_stats *ss;
+		s64 stalled_ms;
+
+		/* Threads outside a timed loop or making progress are fine */
+		if(stage < 0 || stage != m->last_stage[i] ||
+				progress != ts->last_progress){
+			m->last_stage[i] = stage;
+			ts->last_progress = progress;
+			ts->last_change = now;
+			ts->stalled = false;
+			continue;
+		}
+
+		stalled_ms = ktime_to_ms(ktime_sub(now, ts->last_change));
+		if(stalled_ms < m->stall_ms)
+			continue;
+
+		ss = &ts->stage_stats[stage];
+		if(!ts->stalled){
+			ts->stalled = true;
+			ss->stalls++;
+			pr_warn("Thread %d made no progress for %lld ms\n",
+					i, stalled_ms);
+			if(!dumped)
+				stall_monitor_dump_states(m);
+			dumped = true;
+			stall_monitor_dump_task(ts);
+		}
+		if(stalled_ms > ss->longest_stall_ms)
+			ss->longest_stall_ms = stalled_ms;
+		if(m->abort_ms && stalled_ms >= m->abort_ms && !aborted){
+			pr_err("Thread %d stalled for %lld ms, aborting the run\n",
+					i, stalled_ms);
+			WRITE_ONCE(aborted, true);
+		}
+	}
+}
+
+static int stall_monitor_thread(void *arg)
+{
+	struct stall_monitor *m = arg;
+	unsigned long interval = msecs_to_jiffies(m->stall_ms / 2) + 1;
+
+	while(!kthread_should_stop()){
+		stall_monitor_sample(m);
+		set_current_state(TASK_INTERRUPTIBLE);
+		if(!kthread_should_stop())
+			schedule_timeout(interval);
+		__set_current_state(TASK_RUNNING);
+	}
+	return 0;
+}
+
+struct task_struct *stall_monitor_start(struct thread_stats *ts,
+		int num_threads, unsigned int stall_ms, unsigned int abort_ms)
+{
+	struct task_struct *task;
+	int i;
+
+	if(!stall_ms)
+		return NULL;
+
+	monitor.last_stage = kmalloc_array(num_threads,
+			sizeof(*monitor.last_stage), GFP_KERNEL);
+	if(!monitor.last_stage){
+		pr_err("Could not kmalloc stall monitor state, monitor disabled\n");
+		return NULL;
+	}
+	for(i=0;i<num_threads;i++)
+		monitor.last_stage[i] = -1;
+	monitor.ts = ts;
+	monitor.num_threads = num_threads;
+	monitor.stall_ms = stall_ms;
+	monitor.abort_ms = abort_ms;
+	aborted = false;
+
+	task = kthread_run(stall_monitor_thread, &monitor, "lock_tree_monitor");
+	if(IS_ERR(task)){
+		pr_err("Could not start stall monitor, monitor disabled\n");
+		kfree(monitor.last_stage);
+		return NULL;
+	}
+	return task;
+}
+
+void stall_monitor_stop(struct task_struct *task)
+{
+	if(!task)
+		return;
+	kthread_stop(task);
+	kfree(monitor.last_stage);
+}
@@ -0,0 +1,94 @@
+#ifndef _THREAD_STATS_H
+#define _THREAD_STATS_H
+
+#include <linux/types.h>
+#include <linux/ktime.h>
+#include <linux/cache.h>
+#include <linux/sched.h>
+
+/*
+ * Per-thread accounting for the two stages.
+ * Each worker owns one thread_stats slot and
+ * is the only writer of its stage counters, the
+ * stall monitor only reads the progress counter
+ * and owns the stall bookkeeping fields.
+ */
+typedef enum {
+	STAGE_INSERT,
+	STAGE_SEARCH_ERASE,
+	NUM_STAGES
+}STAGE_T;
+
+struct stage_stats {
+	u64 ops;
+	u64 inserts;
+	u64 searches;
+	u64 hits;
+	u64 erases;
+	/* Rank, select and range count queries */
+	u64 queries;
+	ktime_t start;
+	ktime_t end;
+	/* Stall info, written by the monitor */
+	unsigned int stalls;
+	s64 longest_stall_ms;
+};
+
+struct thread_stats {
+	/* Bumped by the owning thread after every operation */
+	unsigned long progress;
+	/* Stage the owner is running, -1 while outside a timed loop */
+	int stage;
+	/* Owner while it runs its stages, for the monitor's dumps */
+	struct task_struct *task;
+	struct stage_stats stage_stats[NUM_STAGES];
+	/* Monitor bookkeeping */
+	unsigned long last_progress;
+	ktime_t last_change;
+	bool stalled;
+} ____cacheline_aligned_in_smp;
+
+/* Owner side, called around the timed loop of each stage */
+static inline void thread_stats_begin(struct thread_stats *ts, STAGE_T stage)
+{
+	ts->stage_stats[stage].start = ktime_get();
+	WRITE_ONCE(ts->task, current);
+	WRITE_ONCE(ts->stage, stage);
+}
+
+static inline void thread_stats_end(struct thread_stats *ts, STAGE_T stage)
+{
+	WRITE_ONCE(ts->stage, -1);
+	WRITE_ONCE(ts->task, NULL);
+	ts->stage_stats[stage].end = ktime_get();
+}
+
+static inline void thread_stats_tick(struct thread_stats *ts)
+{
+	WRITE_ONCE(ts->progress, ts->progress + 1);
+}
+
+struct thread_stats *thread_stats_alloc(int num_threads);
+void thread_stats_reset(struct thread_stats *ts, int num_threads);
+void thread_stats_free(struct thread_stats *ts);
+void thread_stats_report(struct thread_stats *ts, int num_threads,
+		STAGE_T stage, const char *stage_name);
+
+/*
+ * Stall monitor, a kthread that samples the progress
+ * counters of all workers every stall_ms / 2 and flags
+ * threads whose counter has not moved in stall_ms, dumping
+ * the state of every worker and the stack of the stalled
+ * one. A stall longer than abort_ms (0 never) makes
+ * stall_monitor_aborted() true, workers then cut their
+ * stages short and leave the stage barriers instead of
+ * leaving the machine wedged. Only threads that get back
+ * between operations see it, one deadlocked inside the
+ * lock cannot be recovered and keeps the load waiting.
+ */
+struct task_struct *stall_monitor_start(struct thread_stats *ts,
+		int num_threads, unsigned int stall_ms, unsigned int abort_ms);
+void stall_monitor_stop(struct task_struct *monitor);
+bool stall_monitor_aborted(void);
+
+#endif /* _THREAD_STATS_H */
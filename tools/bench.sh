@@ -0,0 +1,105 @@
+#!/bin/sh
+#
+# Benchmark suite. Loads the module once per cell of the grid
+# below, with a fixed seed and bench_output=1, and prints one
+# line per cell and stage with the duration of every measured
+# run, for tools/bench_compare:
+#	<lock> <tree> <threads> <del_ratio> <stage> <us>,<us>,...
+# The output starts with # comment lines naming the machine,
+# kernel and settings it was measured with, which
+# tools/bench_compare skips. Needs root, writes a marker to
+# the kernel log before every cell and reads the log after it.
+#
+# RCU_TREE cells run once per cb_recursive setting in RECURSIVE,
+# the recursive updates under the tree name RCU_TREE_REC, and
+# the mean of every stage of both is compared on stderr:
+#	<lock> <threads> <del_ratio> <stage> <iterative us> <recursive us> <iterative %>
+#
+#	tools/bench.sh [module.ko] > results.tsv
+#
+# LOCKS, TREES, THREADS, DEL_RATIOS, RECURSIVE, NUM_OPS, REPEATS,
+# WARMUP and SEED override the canonical grid, a baseline is only
+# comparable with results from the same settings and machine.
+set -e
+
+MODULE=${1:-kernel_lock_tree_testing.ko}
+NAME=$(basename "$MODULE" .ko)
+LOCKS=${LOCKS:-"SPINLOCK RWLOCK MUTEX RWSEM"}
+TREES=${TREES:-"RB_TREE RCU_TREE"}
+THREADS=${THREADS:-"1 4 16"}
+DEL_RATIOS=${DEL_RATIOS:-"20 80"}
+RECURSIVE=${RECURSIVE:-"0 1"}
+NUM_OPS=${NUM_OPS:-200000}
+REPEATS=${REPEATS:-5}
+WARMUP=${WARMUP:-1}
+SEED=${SEED:-1}
+
+cpu=$(sed -n 's/^model name[[:space:]]*: //p' /proc/cpuinfo | head -n 1)
+echo "# $(uname -n), ${cpu:-unknown CPU}, $(nproc) CPUs, kernel $(uname -r)"
+echo "# LOCKS=\"$LOCKS\" TREES=\"$TREES\" THREADS=\"$THREADS\""
+echo "# DEL_RATIOS=\"$DEL_RATIOS\" RECURSIVE=\"$RECURSIVE\"" \
+	"NUM_OPS=$NUM_OPS REPEATS=$REPEATS WARMUP=$WARMUP SEED=$SEED"
+
+results=$(mktemp)
+trap 'rm -f "$results"' EXIT
+
+for tree in $TREES; do
+# Only the RCU tree has a recursive variant of its updates
+variants=0
+case $tree in
+	RCU_TREE) variants=$RECURSIVE;;
+esac
+for rec in $variants; do
+label=$tree
+case $rec in
+	1) label=${tree}_REC;;
+esac
+for lock in $LOCKS; do
+for threads in $THREADS; do
+for del in $DEL_RATIOS; do
+	echo "$lock $label $threads threads, del_ratio $del" >&2
+	marker="bench.sh $$ $lock $label $threads $del"
+	echo "$marker" > /dev/kmsg
+	insmod "$MODULE" lock_type=$lock tree_type=$tree num_threads=$threads \
+		del_ratio=$del num_ops=$NUM_OPS repeats=$REPEATS \
+		warmup=$WARMUP seed=$SEED cb_recursive=$rec bench_output=1
+	rmmod "$NAME"
+	dmesg | sed -n "\\|$marker\$|,\$p" |
+		sed -n 's/.*: bench \([^ ]*\) [0-9]* \([0-9]*\)$/\1 \2/p' |
+		awk -v cell="$lock $label $threads $del" '
+			!($1 in s) { order[n++] = $1; s[$1] = $2; next }
+			{ s[$1] = s[$1] "," $2 }
+			END { for(i = 0; i < n; i++) print cell, order[i], s[order[i]] }' |
+		tee -a "$results"
+done
+done
+done
+done
+done
+
+# Iterative against recursive RCU_TREE updates, cell by cell
+awk '
+	$2 != "RCU_TREE" && $2 != "RCU_TREE_REC" { next }
+	{
+		k = split($6, us, ",")
+		sum = 0
+		for(i = 1; i <= k; i++)
+			sum += us[i]
+		cell = $1 " " $3 " " $4 " " $5
+		if($2 == "RCU_TREE")
+			iter[cell] = sum / k
+		else
+			rec[cell] = sum / k
+		if(!(cell in seen)){
+			seen[cell] = 1
+			order[n++] = cell
+		}
+	}
+	END {
+		for(i = 0; i < n; i++){
+			c = order[i]
+			if((c in iter) && (c in rec) && rec[c] > 0)
+				printf "%s %.0f %.0f %.1f%%\n", c, iter[c], rec[c],
+					iter[c] * 100 / rec[c]
+		}
+	}' "$results" >&2
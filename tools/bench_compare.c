@@ -0,0 +1,210 @@
+/*
+ * Regression gate for tools/bench.sh results. Every cell
+ * (lock, tree, threads, del_ratio and stage) of the baseline
+ * is looked up in the current results, and a cell regresses
+ * when its mean duration grew by more than the threshold and
+ * Welch's t-test says the growth is significant at the 95%
+ * level (one-sided). Cells with a single sample can only be
+ * held to the threshold. Exits 1 if any cell regressed or is
+ * missing from the current results, 2 on bad input.
+ *
+ * Build with make tools, then for instance
+ *	tools/bench_compare -t 5 tools/bench_baseline.tsv bench_current.tsv
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#define CELL_MAX	128
+#define SAMPLES_MAX	256
+#define LINE_MAX_LEN	4096
+
+struct cell {
+	char name[CELL_MAX];
+	unsigned int n;
+	double us[SAMPLES_MAX];
+};
+
+struct results {
+	struct cell *cells;
+	unsigned int count;
+};
+
+static double threshold_pct = 5.0;
+
+/* One-sided 95% Student t quantiles for 1 to 30 degrees of freedom */
+static const double t_quantile_95[] = {
+	6.314, 2.920, 2.353, 2.132, 2.015, 1.943, 1.895, 1.860, 1.833, 1.812,
+	1.796, 1.782, 1.771, 1.761, 1.753, 1.746, 1.740, 1.734, 1.729, 1.725,
+	1.721, 1.717, 1.714, 1.711, 1.708, 1.706, 1.703, 1.701, 1.699, 1.697
+};
+
+static double t_quantile(double df)
+{
+	unsigned int i = (unsigned int)df;
+
+	/* Rounding the degrees of freedom down is conservative */
+	if(i < 1)
+		i = 1;
+	if(i <= sizeof(t_quantile_95) / sizeof(t_quantile_95[0]))
+		return t_quantile_95[i - 1];
+	return 1.645;
+}
+
+static int load(const char *path, struct results *r)
+{
+	char line[LINE_MAX_LEN], lock[32], tree[32], stage[32], samples[LINE_MAX_LEN];
+	unsigned int threads, del, lineno = 0;
+	struct cell *c;
+	char *tok, *end;
+	FILE *f = fopen(path, "r");
+
+	if(!f){
+		perror(path);
+		return -1;
+	}
+	while(fgets(line, sizeof(line), f)){
+		lineno++;
+		if(line[0] == '#' || line[0] == '\n')
+			continue;
+		if(sscanf(line, "%31s %31s %u %u %31s %4095s", lock, tree, &threads,
+					&del, stage, samples) != 6){
+			fprintf(stderr, "%s:%u: malformed line\n", path, lineno);
+			goto err;
+		}
+		c = realloc(r->cells, (r->count + 1) * sizeof(*c));
+		if(!c)
+			goto err;
+		r->cells = c;
+		c = &r->cells[r->count++];
+		snprintf(c->name, sizeof(c->name), "%s %s %u %u %s", lock, tree,
+				threads, del, stage);
+		c->n = 0;
+		for(tok = strtok(samples, ","); tok; tok = strtok(NULL, ",")){
+			if(c->n == SAMPLES_MAX)
+				break;
+			c->us[c->n] = strtod(tok, &end);
+			if(end == tok){
+				fprintf(stderr, "%s:%u: bad sample\n", path, lineno);
+				goto err;
+			}
+			c->n++;
+		}
+	}
+	fclose(f);
+	return 0;
+err:
+	fclose(f);
+	return -1;
+}
+
+static struct cell *find(struct results *r, const char *name)
+{
+	unsigned int i;
+
+	for(i=0;i<r->count;i++)
+		if(!strcmp(r->cells[i].name, name))
+			return &r->cells[i];
+	return NULL;
+}
+
+static void moments(struct cell *c, double *mean, double *var)
+{
+	double sum = 0, d;
+	unsigned int i;
+
+	for(i=0;i<c->n;i++)
+		sum += c->us[i];
+	*mean = sum / c->n;
+	*var = 0;
+	if(c->n < 2)
+		return;
+	for(i=0;i<c->n;i++){
+		d = c->us[i] - *mean;
+		*var += d * d;
+	}
+	*var /= c->n - 1;
+}
+
+/* Prints the verdict of one cell, returns 1 if it regressed */
+static int compare(struct cell *base, struct cell *cur)
+{
+	double mb, vb, mc, vc, change, se, t = 0, df, crit = 0;
+	const char *verdict;
+	int slower;
+
+	moments(base, &mb, &vb);
+	moments(cur, &mc, &vc);
+	change = mb > 0 ? (mc - mb) * 100 / mb : 0;
+	slower = change > threshold_pct;
+
+	if(base->n > 1 && cur->n > 1){
+		se = vb / base->n + vc / cur->n;
+		if(se > 0){
+			t = (mc - mb) / sqrt(se);
+			/* Welch-Satterthwaite */
+			df = se * se / (vb * vb / ((double)base->n * base->n *
+						(base->n - 1)) + vc * vc /
+					((double)cur->n * cur->n * (cur->n - 1)));
+			crit = t_quantile(df);
+			slower = slower && t > crit;
+		}
+	}
+
+	if(slower)
+		verdict = "SLOWER";
+	else if(change > threshold_pct)
+		verdict = "noise";
+	else if(change < -threshold_pct)
+		verdict = "faster";
+	else
+		verdict = "ok";
+	printf("%-40s %10.3f %10.3f %+7.2f%% %7.2f %7.2f  %s\n", base->name,
+			mb / 1000, mc / 1000, change, t, crit, verdict);
+	return slower;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-t threshold %%] baseline current\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct results base = {}, cur = {};
+	unsigned int i, regressed = 0, missing = 0;
+	struct cell *c;
+	int opt;
+
+	while((opt = getopt(argc, argv, "t:")) != -1){
+		switch(opt){
+			case 't': threshold_pct = strtod(optarg, NULL); break;
+			default: usage(argv[0]);
+		}
+	}
+	if(argc - optind != 2 || threshold_pct < 0)
+		usage(argv[0]);
+	if(load(argv[optind], &base) || load(argv[optind + 1], &cur))
+		return 2;
+
+	printf("%-40s %10s %10s %8s %7s %7s  %s\n", "cell", "base ms", "now ms",
+			"change", "t", "t crit", "verdict");
+	for(i=0;i<base.count;i++){
+		c = find(&cur, base.cells[i].name);
+		if(!c || !c->n || !base.cells[i].n){
+			printf("%-40s missing\n", base.cells[i].name);
+			missing++;
+			continue;
+		}
+		regressed += compare(&base.cells[i], c);
+	}
+	printf("%u of %u cells slower by more than %.1f%%, %u missing\n",
+			regressed, base.count, threshold_pct, missing);
+	free(base.cells);
+	free(cur.cells);
+	return regressed || missing ? 1 : 0;
+}
@@ -0,0 +1,264 @@
+/*
+ * Load generator for /dev/lock_tree. Every thread opens
+ * the device, sets up its own ring and keeps it filled with
+ * a random mix of inserts, searches and erases, submitting
+ * up to batch entries per KV_IOC_ENTER, or none at all with
+ * -p, where the module's polling thread drains the ring.
+ *
+ * Build with make tools, then for instance
+ *	insmod kernel_lock_tree_testing.ko kv_dev=1 tree_type=RCU_TREE
+ *	tools/kv_load -t 4 -n 1000000 -b 256
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "../kv_ring.h"
+
+#define load_acquire(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static const char *dev_path = "/dev/lock_tree";
+static unsigned long num_ops = 1000000;
+static unsigned int batch = 64;
+static unsigned int entries = 1024;
+static unsigned int read_pct = 80;
+static unsigned int erase_pct = 10;
+static unsigned long key_range = 100000;
+static unsigned int value_len = 11;
+static unsigned int num_threads = 1;
+static int sqpoll;
+static unsigned int sq_idle_ms = 10;
+
+struct worker {
+	pthread_t thread;
+	int id;
+	unsigned long ops;
+	unsigned long syscalls;
+	unsigned long hits;
+	unsigned long errors;
+};
+
+struct ring {
+	int fd;
+	void *mem;
+	size_t size;
+	struct kv_ring_hdr *hdr;
+	struct kv_sqe *sq;
+	struct kv_cqe *cq;
+	char *data;
+	uint32_t mask;
+};
+
+static int ring_open(struct ring *r)
+{
+	struct kv_ring_setup p = {
+		.entries = entries,
+		.flags = sqpoll ? KV_SETUP_SQPOLL : 0,
+		.sq_idle_ms = sq_idle_ms,
+	};
+
+	r->fd = open(dev_path, O_RDWR);
+	if(r->fd < 0){
+		perror(dev_path);
+		return -1;
+	}
+	if(ioctl(r->fd, KV_IOC_SETUP, &p)){
+		perror("KV_IOC_SETUP");
+		goto fail;
+	}
+	r->size = p.size;
+	r->mem = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+	if(r->mem == MAP_FAILED){
+		perror("mmap");
+		goto fail;
+	}
+	r->hdr = r->mem;
+	if(r->hdr->magic != KV_RING_MAGIC){
+		fprintf(stderr, "Ring has no valid header\n");
+		munmap(r->mem, r->size);
+		goto fail;
+	}
+	r->sq = (struct kv_sqe *)((char *)r->mem + r->hdr->sq_off);
+	r->cq = (struct kv_cqe *)((char *)r->mem + r->hdr->cq_off);
+	r->data = (char *)r->mem + r->hdr->data_off;
+	r->mask = r->hdr->entries - 1;
+	return 0;
+
+fail:
+	close(r->fd);
+	return -1;
+}
+
+static void ring_close(struct ring *r)
+{
+	munmap(r->mem, r->size);
+	close(r->fd);
+}
+
+/* xorshift64*, one state per thread */
+static uint64_t next_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+static void fill_sqe(struct ring *r, uint32_t index, uint64_t *rnd)
+{
+	struct kv_sqe *sqe = &r->sq[index];
+	unsigned int pick = next_rand(rnd) % 100;
+
+	sqe->key = next_rand(rnd) % key_range + 1;
+	sqe->user_data = index;
+	if(pick < read_pct){
+		sqe->op = KV_OP_SEARCH;
+		sqe->len = KV_VALUE_MAX;
+	}else if(pick < read_pct + erase_pct){
+		sqe->op = KV_OP_ERASE;
+		sqe->len = 0;
+	}else{
+		sqe->op = KV_OP_INSERT;
+		sqe->len = value_len;
+		memset(r->data + (size_t)index * KV_VALUE_MAX, 'a' + sqe->key % 26,
+				value_len);
+	}
+}
+
+static void reap(struct ring *r, struct worker *w)
+{
+	uint32_t head = r->hdr->cq_head, tail = load_acquire(&r->hdr->cq_tail);
+
+	for(;head != tail;head++){
+		struct kv_cqe *cqe = &r->cq[head & r->mask];
+		struct kv_sqe *sqe = &r->sq[cqe->user_data];
+
+		if(cqe->res >= 0 && sqe->op == KV_OP_SEARCH)
+			w->hits++;
+		else if(cqe->res < 0 && cqe->res != -ENOENT && cqe->res != -EEXIST)
+			w->errors++;
+		w->ops++;
+	}
+	store_release(&r->hdr->cq_head, head);
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	unsigned long share = num_ops / num_threads, submitted = 0;
+	uint64_t rnd = 0x9e3779b97f4a7c15ULL * (w->id + 1);
+	struct ring r;
+
+	if(ring_open(&r))
+		return NULL;
+	if(w->id == (int)num_threads - 1)
+		share += num_ops % num_threads;
+
+	while(w->ops < share){
+		uint32_t tail = r.hdr->sq_tail;
+		uint32_t inflight = tail - load_acquire(&r.hdr->cq_head);
+		uint32_t n = batch;
+
+		if(n > entries - inflight)
+			n = entries - inflight;
+		if(n > share - submitted)
+			n = share - submitted;
+		for(uint32_t i=0;i<n;i++)
+			fill_sqe(&r, (tail + i) & r.mask, &rnd);
+		store_release(&r.hdr->sq_tail, tail + n);
+		submitted += n;
+
+		if(!sqpoll){
+			if(ioctl(r.fd, KV_IOC_ENTER) < 0){
+				perror("KV_IOC_ENTER");
+				break;
+			}
+			w->syscalls++;
+		}else{
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if(load_acquire(&r.hdr->flags) & KV_RING_NEED_WAKEUP){
+				ioctl(r.fd, KV_IOC_ENTER);
+				w->syscalls++;
+			}
+		}
+		reap(&r, w);
+	}
+	ring_close(&r);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n ops] [-b batch] [-e entries] [-r read %%] "
+			"[-d erase %%] [-k key range] [-s value bytes] [-t threads] "
+			"[-p] [-i sqpoll idle ms] [-f device]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct worker *workers;
+	struct timespec start, end;
+	unsigned long ops = 0, syscalls = 0, hits = 0, errors = 0;
+	double secs;
+	unsigned int i;
+	int opt;
+
+	while((opt = getopt(argc, argv, "n:b:e:r:d:k:s:t:pi:f:")) != -1){
+		switch(opt){
+			case 'n': num_ops = strtoul(optarg, NULL, 0); break;
+			case 'b': batch = strtoul(optarg, NULL, 0); break;
+			case 'e': entries = strtoul(optarg, NULL, 0); break;
+			case 'r': read_pct = strtoul(optarg, NULL, 0); break;
+			case 'd': erase_pct = strtoul(optarg, NULL, 0); break;
+			case 'k': key_range = strtoul(optarg, NULL, 0); break;
+			case 's': value_len = strtoul(optarg, NULL, 0); break;
+			case 't': num_threads = strtoul(optarg, NULL, 0); break;
+			case 'p': sqpoll = 1; break;
+			case 'i': sq_idle_ms = strtoul(optarg, NULL, 0); break;
+			case 'f': dev_path = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if(!batch || !num_threads || !key_range || read_pct + erase_pct > 100 ||
+			!value_len || value_len > KV_VALUE_MAX)
+		usage(argv[0]);
+	if(batch > entries)
+		batch = entries;
+
+	workers = calloc(num_threads, sizeof(*workers));
+	if(!workers)
+		return 1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i=0;i<num_threads;i++){
+		workers[i].id = i;
+		pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i]);
+	}
+	for(i=0;i<num_threads;i++){
+		pthread_join(workers[i].thread, NULL);
+		ops += workers[i].ops;
+		syscalls += workers[i].syscalls;
+		hits += workers[i].hits;
+		errors += workers[i].errors;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("%lu ops in %.3f s, %.0f ops/sec, %lu syscalls, %.1f ops per syscall, "
+			"%lu search hits, %lu errors\n", ops, secs, secs > 0 ? ops / secs : 0,
+			syscalls, syscalls ? (double)ops / syscalls : 0, hits, errors);
+	free(workers);
+	return ops ? 0 : 1;
+}
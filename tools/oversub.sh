@@ -0,0 +1,74 @@
+#!/bin/sh
+#
+# Oversubscription sweep. Loads the module for every lock type
+# at each factor of threads per online CPU and prints the mean
+# throughput of both stages and how much of the first factor's
+# throughput is left:
+#	<lock> <tree> <factor>x <stage> <Mops/s> <% of first>
+# A load that fails, typically a run the stall monitor cut
+# short, is reported as aborted. Needs root, writes a marker to
+# the kernel log before every load and reads the log after it.
+#
+#	tools/oversub.sh [module.ko]
+#
+# LOCKS, TREE, FACTORS, SCHED_MIX, HOLDER_PREEMPT, NUM_OPS,
+# REPEATS, STALL_MS and STALL_ABORT_MS override the defaults.
+
+MODULE=${1:-kernel_lock_tree_testing.ko}
+NAME=$(basename "$MODULE" .ko)
+LOCKS=${LOCKS:-"SPINLOCK RWLOCK MUTEX RWSEM ADAPTIVE"}
+TREE=${TREE:-RB_TREE}
+FACTORS=${FACTORS:-"1 2 4 8"}
+SCHED_MIX=${SCHED_MIX:-NONE}
+HOLDER_PREEMPT=${HOLDER_PREEMPT:-0}
+NUM_OPS=${NUM_OPS:-1000000}
+REPEATS=${REPEATS:-3}
+STALL_MS=${STALL_MS:-1000}
+STALL_ABORT_MS=${STALL_ABORT_MS:-30000}
+
+for lock in $LOCKS; do
+	base_insert=
+	base_search=
+	for f in $FACTORS; do
+		# Only the sleeping locks let their holders yield
+		preempt=0
+		case $lock in
+			MUTEX|RWSEM) preempt=$HOLDER_PREEMPT;;
+		esac
+		marker="oversub.sh $$ $lock ${f}x"
+		echo "$marker" > /dev/kmsg
+		if ! insmod "$MODULE" lock_type=$lock tree_type=$TREE \
+				oversubscribe=$f sched_mix=$SCHED_MIX \
+				holder_preempt=$preempt num_ops=$NUM_OPS \
+				repeats=$REPEATS stall_ms=$STALL_MS \
+				stall_abort_ms=$STALL_ABORT_MS bench_output=1; then
+			echo "$lock $TREE ${f}x aborted"
+			continue
+		fi
+		rmmod "$NAME"
+		out=$(dmesg | sed -n "\\|$marker\$|,\$p" |
+			sed -n 's/.*: bench \([^ ]*\) [0-9]* \([0-9]*\)$/\1 \2/p' |
+			awk -v ops="$NUM_OPS" '
+				{ sum[$1] += $2; n[$1]++ }
+				END {
+					if(n["Insert"] && n["Search/Erase"])
+						printf "%.3f %.3f\n",
+							ops * n["Insert"] / sum["Insert"],
+							ops * n["Search/Erase"] / sum["Search/Erase"]
+				}')
+		if [ -z "$out" ]; then
+			echo "$lock $TREE ${f}x no results"
+			continue
+		fi
+		set -- $out
+		[ -n "$base_insert" ] || base_insert=$1
+		[ -n "$base_search" ] || base_search=$2
+		awk -v lock=$lock -v tree=$TREE -v f=$f -v i=$1 -v s=$2 \
+			-v bi=$base_insert -v bs=$base_search 'BEGIN {
+				printf "%s %s %sx Insert %.3f %.1f%%\n", lock, tree, f, i,
+					i * 100 / bi
+				printf "%s %s %sx Search/Erase %.3f %.1f%%\n", lock, tree, f,
+					s, s * 100 / bs
+			}'
+	done
+done
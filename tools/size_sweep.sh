@@ -0,0 +1,136 @@
+#!/bin/sh
+#
+# Tree size sweep. Loads the module for every tree type at
+# each tree_size, with the number of search/erase operations
+# held at OPS, and prints the mean per-operation latency of
+# both stages against the estimated working set and the last
+# level cache found in the cache topology of cpu0:
+#	<tree> <lock> <tree_size> <working set bytes> <llc bytes> <stage> <ns/op>
+# Latency is thread time per operation, the mean stage duration
+# times THREADS over the stage's operations. Sizes whose
+# estimated working set does not fit in MemAvailable, or whose
+# load fails, are reported as skipped. Needs root, writes a
+# marker to the kernel log before every load and reads the log
+# after it.
+#
+#	tools/size_sweep.sh [module.ko] > sweep.tsv
+#
+# With PLOT=<file.png> and gnuplot installed, the search/erase
+# latency of every tree is also plotted against the working set
+# on a log scale, with the last level cache marked.
+#
+# SIZES, TREES, LOCK, THREADS, OPS, DEL_RATIO, REPEATS, SEED and
+# LLC_KB (instead of the cache topology) override the defaults.
+
+MODULE=${1:-kernel_lock_tree_testing.ko}
+NAME=$(basename "$MODULE" .ko)
+SIZES=${SIZES:-"1000 10000 100000 1000000 10000000 100000000"}
+TREES=${TREES:-"RB_TREE RCU_TREE SKIPLIST"}
+LOCK=${LOCK:-RWLOCK}
+THREADS=${THREADS:-4}
+OPS=${OPS:-1000000}
+DEL_RATIO=${DEL_RATIO:-20}
+REPEATS=${REPEATS:-3}
+SEED=${SEED:-1}
+
+# Highest level data or unified cache of cpu0, in KiB
+llc_from_topology()
+{
+	best_level=0
+	best_kb=0
+	for index in /sys/devices/system/cpu/cpu0/cache/index*; do
+		[ -r "$index/size" ] || continue
+		case $(cat "$index/type") in
+			Data|Unified) ;;
+			*) continue;;
+		esac
+		level=$(cat "$index/level")
+		size=$(cat "$index/size")
+		case $size in
+			*K) kb=${size%K};;
+			*M) kb=$((${size%M} * 1024));;
+			*) kb=$((size / 1024));;
+		esac
+		if [ "$level" -gt "$best_level" ]; then
+			best_level=$level
+			best_kb=$kb
+		fi
+	done
+	echo $best_kb
+}
+
+LLC_KB=${LLC_KB:-$(llc_from_topology)}
+echo "Last level cache: $LLC_KB KiB" >&2
+
+# Rough bytes per key to tell sizes that cannot be built
+KEY_BYTES=128
+mem_kb=$(sed -n 's/^MemAvailable: *\([0-9]*\) kB$/\1/p' /proc/meminfo)
+
+results=$(mktemp)
+trap 'rm -f "$results"' EXIT
+
+for tree in $TREES; do
+for size in $SIZES; do
+	if [ -n "$mem_kb" ] && [ $((size / 1024 * KEY_BYTES)) -gt "$mem_kb" ]; then
+		echo "$tree $LOCK $size skipped, not enough memory" >&2
+		continue
+	fi
+	echo "$tree $LOCK tree_size $size" >&2
+	marker="size_sweep.sh $$ $tree $size"
+	echo "$marker" > /dev/kmsg
+	if ! insmod "$MODULE" lock_type=$LOCK tree_type=$tree \
+			num_threads=$THREADS tree_size=$size ops=$OPS \
+			del_ratio=$DEL_RATIO repeats=$REPEATS seed=$SEED \
+			llc_kb=$LLC_KB bench_output=1; then
+		echo "$tree $LOCK $size skipped, load failed" >&2
+		continue
+	fi
+	rmmod "$NAME"
+	dmesg | sed -n "\\|$marker\$|,\$p" |
+		sed -n -e 's/.*: \(bench_ws .*\)$/\1/p' \
+		-e 's/.*: bench \([^ ]*\) [0-9]* \([0-9]*\)$/\1 \2/p' |
+		awk -v tree=$tree -v lock=$LOCK -v threads=$THREADS '
+			$1 == "bench_ws" { keys = $2; ops = $3; ws = $4; llc = $5; next }
+			{ sum[$1] += $2; n[$1]++ }
+			END {
+				if(!n["Insert"] || !n["Search/Erase"])
+					exit
+				printf "%s %s %s %s %s Insert %.1f\n", tree, lock, keys,
+					ws, llc, sum["Insert"] * 1000 * threads /
+					(n["Insert"] * keys)
+				printf "%s %s %s %s %s Search/Erase %.1f\n", tree, lock,
+					keys, ws, llc, sum["Search/Erase"] * 1000 *
+					threads / (n["Search/Erase"] * ops)
+			}' | tee -a "$results"
+done
+done
+
+[ -n "$PLOT" ] || exit 0
+if ! command -v gnuplot > /dev/null; then
+	echo "gnuplot not found, not plotting" >&2
+	exit 0
+fi
+{
+	echo "set terminal pngcairo size 1024,640"
+	echo "set output '$PLOT'"
+	echo "set logscale x 2"
+	echo "set format x '%.0s%cB'"
+	echo "set xlabel 'working set'"
+	echo "set ylabel 'ns per search/erase'"
+	echo "set key top left"
+	if [ "$LLC_KB" -gt 0 ]; then
+		echo "set arrow from $((LLC_KB * 1024)), graph 0" \
+			"to $((LLC_KB * 1024)), graph 1 nohead dashtype 2"
+		echo "set label ' LLC' at $((LLC_KB * 1024)), graph 0.95"
+	fi
+	printf "plot"
+	sep=
+	for tree in $TREES; do
+		printf "%s '< grep \"^%s .* Search/Erase \" %s' using 4:7 with" \
+			"$sep" "$tree" "$results"
+		printf " linespoints title '%s'" "$tree"
+		sep=","
+	done
+	echo
+} | gnuplot
+echo "Plotted to $PLOT" >&2